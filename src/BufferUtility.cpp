@@ -0,0 +1,515 @@
+
+#include <cstring>
+#include <array>
+
+#include "BufferUtility.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+	#define BUFFER_UTILITY_X86
+	#include <immintrin.h>
+#endif
+
+// Each kernel set provides these operations
+// Mismatch searches return len if the buffers match
+struct Kernels
+{
+	const char *name;
+	bool (*isBlank)(const uint8_t *data, size_t len);
+	size_t (*findFirstMismatch)(const uint8_t *a, const uint8_t *b, size_t len);
+	size_t (*findLastMismatch)(const uint8_t *a, const uint8_t *b, size_t len);
+	bool (*canProgramWithoutErase)(const uint8_t *oldData, const uint8_t *newData, size_t len);
+	uint32_t (*crc32c)(const uint8_t *data, size_t len, uint32_t crc);
+};
+
+//
+// Scalar kernels. Work in 64 bit words where possible
+//
+
+static inline uint64_t load64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static bool isBlankScalar(const uint8_t *data, size_t len)
+{
+	size_t i = 0;
+	for(; i+32 <= len; i+=32)
+	{
+		uint64_t acc = load64(data+i) & load64(data+i+8) & load64(data+i+16) & load64(data+i+24);
+		if(acc != ~0ull)
+		{
+			return false;
+		}
+	}
+	for(; i < len; i++)
+	{
+		if(data[i] != 0xFF)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static size_t findFirstMismatchScalar(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i = 0;
+	for(; i+8 <= len; i+=8)
+	{
+		if(load64(a+i) != load64(b+i))
+		{
+			break;
+		}
+	}
+	for(; i < len; i++)
+	{
+		if(a[i] != b[i])
+		{
+			return i;
+		}
+	}
+	return len;
+}
+
+static size_t findLastMismatchScalar(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i = len;
+	for(; i >= 8; i-=8)
+	{
+		if(load64(a+i-8) != load64(b+i-8))
+		{
+			break;
+		}
+	}
+	while(i > 0)
+	{
+		i--;
+		if(a[i] != b[i])
+		{
+			return i;
+		}
+	}
+	return len;
+}
+
+static bool canProgramWithoutEraseScalar(const uint8_t *oldData, const uint8_t *newData, size_t len)
+{
+	size_t i = 0;
+	for(; i+32 <= len; i+=32)
+	{
+		uint64_t acc = 0;
+		for(size_t j=0; j<32; j+=8)
+		{
+			acc |= load64(newData+i+j) & ~load64(oldData+i+j);
+		}
+		if(acc)
+		{
+			return false;
+		}
+	}
+	for(; i < len; i++)
+	{
+		if(newData[i] & ~oldData[i])
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Slicing-by-8 table, reflected polynomial 0x82F63B78
+typedef std::array<std::array<uint32_t, 256>, 8> crc_table_t;
+static const crc_table_t &crcTable(void)
+{
+	static const crc_table_t table = []()
+	{
+		crc_table_t t{};
+		for(uint32_t i=0; i<256; i++)
+		{
+			uint32_t crc = i;
+			for(int j=0; j<8; j++)
+			{
+				crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78 : 0);
+			}
+			t[0][i] = crc;
+		}
+		for(uint32_t i=0; i<256; i++)
+		{
+			for(int k=1; k<8; k++)
+			{
+				t[k][i] = (t[k-1][i] >> 8) ^ t[0][t[k-1][i] & 0xFF];
+			}
+		}
+		return t;
+	}();
+	return table;
+}
+
+static uint32_t crc32cScalar(const uint8_t *data, size_t len, uint32_t crc)
+{
+	const crc_table_t &t = crcTable();
+	crc = ~crc;
+	size_t i = 0;
+	for(; i+8 <= len; i+=8)
+	{
+		// Table is for little endian word order, so go bytewise for the low word to stay portable
+		uint32_t lo = crc ^ (data[i] | (data[i+1] << 8) | (data[i+2] << 16) | (static_cast<uint32_t>(data[i+3]) << 24));
+		crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+		      t[3][data[i+4]] ^ t[2][data[i+5]] ^ t[1][data[i+6]] ^ t[0][data[i+7]];
+	}
+	for(; i < len; i++)
+	{
+		crc = (crc >> 8) ^ t[0][(crc ^ data[i]) & 0xFF];
+	}
+	return ~crc;
+}
+
+static const Kernels scalarKernels =
+{
+	"scalar",
+	isBlankScalar,
+	findFirstMismatchScalar,
+	findLastMismatchScalar,
+	canProgramWithoutEraseScalar,
+	crc32cScalar
+};
+
+#ifdef BUFFER_UTILITY_X86
+
+//
+// SSE2 kernels. 64 bytes per iteration, scalar kernels handle the tail
+//
+
+__attribute__((target("sse2"))) static bool isBlankSse2(const uint8_t *data, size_t len)
+{
+	const __m128i ones = _mm_set1_epi8(-1);
+	size_t i = 0;
+	for(; i+64 <= len; i+=64)
+	{
+		__m128i acc = _mm_and_si128(
+			_mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data+i)),    _mm_loadu_si128(reinterpret_cast<const __m128i *>(data+i+16))),
+			_mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data+i+32)), _mm_loadu_si128(reinterpret_cast<const __m128i *>(data+i+48))));
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(acc, ones)) != 0xFFFF)
+		{
+			return false;
+		}
+	}
+	return isBlankScalar(data+i, len-i);
+}
+
+__attribute__((target("sse2"))) static size_t findFirstMismatchSse2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i = 0;
+	for(; i+16 <= len; i+=16)
+	{
+		__m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a+i)), _mm_loadu_si128(reinterpret_cast<const __m128i *>(b+i)));
+		unsigned int mask = _mm_movemask_epi8(eq) ^ 0xFFFF;
+		if(mask)
+		{
+			return i + __builtin_ctz(mask);
+		}
+	}
+	return i + findFirstMismatchScalar(a+i, b+i, len-i);
+}
+
+__attribute__((target("sse2"))) static size_t findLastMismatchSse2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i = len;
+	for(; i >= 16; i-=16)
+	{
+		__m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a+i-16)), _mm_loadu_si128(reinterpret_cast<const __m128i *>(b+i-16)));
+		unsigned int mask = _mm_movemask_epi8(eq) ^ 0xFFFF;
+		if(mask)
+		{
+			return i - 16 + (31 - __builtin_clz(mask));
+		}
+	}
+	size_t idx = findLastMismatchScalar(a, b, i);
+	return (idx == i) ? len : idx;
+}
+
+__attribute__((target("sse2"))) static bool canProgramWithoutEraseSse2(const uint8_t *oldData, const uint8_t *newData, size_t len)
+{
+	size_t i = 0;
+	for(; i+64 <= len; i+=64)
+	{
+		__m128i acc = _mm_setzero_si128();
+		for(size_t j=0; j<64; j+=16)
+		{
+			// andnot computes ~first & second
+			acc = _mm_or_si128(acc, _mm_andnot_si128(
+				_mm_loadu_si128(reinterpret_cast<const __m128i *>(oldData+i+j)),
+				_mm_loadu_si128(reinterpret_cast<const __m128i *>(newData+i+j))));
+		}
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF)
+		{
+			return false;
+		}
+	}
+	return canProgramWithoutEraseScalar(oldData+i, newData+i, len-i);
+}
+
+//
+// AVX2 kernels. 128 bytes per iteration where it matters
+//
+
+__attribute__((target("avx2"))) static bool isBlankAvx2(const uint8_t *data, size_t len)
+{
+	size_t i = 0;
+	for(; i+128 <= len; i+=128)
+	{
+		__m256i acc = _mm256_and_si256(
+			_mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data+i)),    _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data+i+32))),
+			_mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data+i+64)), _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data+i+96))));
+		// testc returns 1 if (~acc & ones) == 0, i.e. acc is all ones
+		if(!_mm256_testc_si256(acc, _mm256_set1_epi8(-1)))
+		{
+			return false;
+		}
+	}
+	return isBlankSse2(data+i, len-i);
+}
+
+__attribute__((target("avx2"))) static size_t findFirstMismatchAvx2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i = 0;
+	for(; i+32 <= len; i+=32)
+	{
+		__m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(a+i)), _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b+i)));
+		uint32_t mask = ~static_cast<uint32_t>(_mm256_movemask_epi8(eq));
+		if(mask)
+		{
+			return i + __builtin_ctz(mask);
+		}
+	}
+	return i + findFirstMismatchSse2(a+i, b+i, len-i);
+}
+
+__attribute__((target("avx2"))) static size_t findLastMismatchAvx2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i = len;
+	for(; i >= 32; i-=32)
+	{
+		__m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(a+i-32)), _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b+i-32)));
+		uint32_t mask = ~static_cast<uint32_t>(_mm256_movemask_epi8(eq));
+		if(mask)
+		{
+			return i - 32 + (31 - __builtin_clz(mask));
+		}
+	}
+	size_t idx = findLastMismatchSse2(a, b, i);
+	return (idx == i) ? len : idx;
+}
+
+__attribute__((target("avx2"))) static bool canProgramWithoutEraseAvx2(const uint8_t *oldData, const uint8_t *newData, size_t len)
+{
+	size_t i = 0;
+	for(; i+128 <= len; i+=128)
+	{
+		__m256i acc = _mm256_setzero_si256();
+		for(size_t j=0; j<128; j+=32)
+		{
+			acc = _mm256_or_si256(acc, _mm256_andnot_si256(
+				_mm256_loadu_si256(reinterpret_cast<const __m256i *>(oldData+i+j)),
+				_mm256_loadu_si256(reinterpret_cast<const __m256i *>(newData+i+j))));
+		}
+		if(!_mm256_testz_si256(acc, acc))
+		{
+			return false;
+		}
+	}
+	return canProgramWithoutEraseSse2(oldData+i, newData+i, len-i);
+}
+
+//
+// SSE4.2 has a CRC32C instruction
+//
+
+__attribute__((target("sse4.2"))) static uint32_t crc32cHw(const uint8_t *data, size_t len, uint32_t crc)
+{
+	crc = ~crc;
+	size_t i = 0;
+#ifdef __x86_64__
+	uint64_t crc64 = crc;
+	for(; i+8 <= len; i+=8)
+	{
+		crc64 = _mm_crc32_u64(crc64, load64(data+i));
+	}
+	crc = static_cast<uint32_t>(crc64);
+#endif
+	for(; i < len; i++)
+	{
+		crc = _mm_crc32_u8(crc, data[i]);
+	}
+	return ~crc;
+}
+
+#endif
+
+static Kernels selectKernels(void)
+{
+	Kernels k = scalarKernels;
+#ifdef BUFFER_UTILITY_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+	{
+		k.name = "avx2";
+		k.isBlank = isBlankAvx2;
+		k.findFirstMismatch = findFirstMismatchAvx2;
+		k.findLastMismatch = findLastMismatchAvx2;
+		k.canProgramWithoutErase = canProgramWithoutEraseAvx2;
+	} else if(__builtin_cpu_supports("sse2")) {
+		k.name = "sse2";
+		k.isBlank = isBlankSse2;
+		k.findFirstMismatch = findFirstMismatchSse2;
+		k.findLastMismatch = findLastMismatchSse2;
+		k.canProgramWithoutErase = canProgramWithoutEraseSse2;
+	}
+	if(__builtin_cpu_supports("sse4.2"))
+	{
+		k.crc32c = crc32cHw;
+	}
+#endif
+	return k;
+}
+
+static const Kernels &kernels(void)
+{
+	static const Kernels k = selectKernels();
+	return k;
+}
+
+bool BufferUtility::isBlank(const uint8_t *data, size_t len)
+{
+	return kernels().isBlank(data, len);
+}
+
+std::optional<size_t> BufferUtility::findFirstMismatch(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t idx = kernels().findFirstMismatch(a, b, len);
+	if(idx == len)
+	{
+		return std::nullopt;
+	}
+	return idx;
+}
+
+std::optional<size_t> BufferUtility::findLastMismatch(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t idx = kernels().findLastMismatch(a, b, len);
+	if(idx == len)
+	{
+		return std::nullopt;
+	}
+	return idx;
+}
+
+std::optional<std::pair<size_t, size_t>> BufferUtility::mismatchExtent(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	auto first = findFirstMismatch(a, b, len);
+	if(!first)
+	{
+		return std::nullopt;
+	}
+	// Only search the part after the first mismatch
+	size_t last = *first + kernels().findLastMismatch(a+*first, b+*first, len-*first);
+	return std::make_pair(*first, last);
+}
+
+bool BufferUtility::canProgramWithoutErase(const uint8_t *oldData, const uint8_t *newData, size_t len)
+{
+	return kernels().canProgramWithoutErase(oldData, newData, len);
+}
+
+uint32_t BufferUtility::crc32c(const uint8_t *data, size_t len, uint32_t crc)
+{
+	return kernels().crc32c(data, len, crc);
+}
+
+// XXH64, as specified at https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+// Four independent lanes keep the multipliers busy, so no explicit SIMD is needed
+static constexpr uint64_t xxhPrime1 = 0x9E3779B185EBCA87ull;
+static constexpr uint64_t xxhPrime2 = 0xC2B2AE3D27D4EB4Full;
+static constexpr uint64_t xxhPrime3 = 0x165667B19E3779F9ull;
+static constexpr uint64_t xxhPrime4 = 0x85EBCA77C2B2AE63ull;
+static constexpr uint64_t xxhPrime5 = 0x27D4EB2F165667C5ull;
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input)
+{
+	acc += input * xxhPrime2;
+	acc = rotl64(acc, 31);
+	return acc * xxhPrime1;
+}
+
+static inline uint64_t xxhMergeRound(uint64_t acc, uint64_t val)
+{
+	acc ^= xxhRound(0, val);
+	return acc * xxhPrime1 + xxhPrime4;
+}
+
+uint64_t BufferUtility::hash64(const uint8_t *data, size_t len, uint64_t seed)
+{
+	size_t i = 0;
+	uint64_t h;
+	if(len >= 32)
+	{
+		uint64_t v1 = seed + xxhPrime1 + xxhPrime2;
+		uint64_t v2 = seed + xxhPrime2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - xxhPrime1;
+		for(; i+32 <= len; i+=32)
+		{
+			v1 = xxhRound(v1, load64(data+i));
+			v2 = xxhRound(v2, load64(data+i+8));
+			v3 = xxhRound(v3, load64(data+i+16));
+			v4 = xxhRound(v4, load64(data+i+24));
+		}
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = xxhMergeRound(h, v1);
+		h = xxhMergeRound(h, v2);
+		h = xxhMergeRound(h, v3);
+		h = xxhMergeRound(h, v4);
+	} else {
+		h = seed + xxhPrime5;
+	}
+
+	h += len;
+
+	for(; i+8 <= len; i+=8)
+	{
+		h ^= xxhRound(0, load64(data+i));
+		h = rotl64(h, 27) * xxhPrime1 + xxhPrime4;
+	}
+	if(i+4 <= len)
+	{
+		uint32_t v;
+		memcpy(&v, data+i, sizeof(v));
+		h ^= static_cast<uint64_t>(v) * xxhPrime1;
+		h = rotl64(h, 23) * xxhPrime2 + xxhPrime3;
+		i += 4;
+	}
+	for(; i < len; i++)
+	{
+		h ^= data[i] * xxhPrime5;
+		h = rotl64(h, 11) * xxhPrime1;
+	}
+
+	h ^= h >> 33;
+	h *= xxhPrime2;
+	h ^= h >> 29;
+	h *= xxhPrime3;
+	h ^= h >> 32;
+	return h;
+}
+
+const char *BufferUtility::implementation(void)
+{
+	return kernels().name;
+}
@@ -0,0 +1,40 @@
+#ifndef BUFFER_UTILITY_H
+#define BUFFER_UTILITY_H
+
+// Scanning kernels for flash images
+// The fastest implementation the CPU supports (AVX2, SSE2 or scalar) is selected at runtime on first use
+
+#include <cstdint>
+#include <cstddef>
+#include <optional>
+#include <utility> //pair
+
+namespace BufferUtility
+{
+
+	// True if every byte is 0xFF (i.e. erased flash)
+	bool isBlank(const uint8_t *data, size_t len);
+
+	// Index of the first/last byte that differs, or none if the buffers match
+	std::optional<size_t> findFirstMismatch(const uint8_t *a, const uint8_t *b, size_t len);
+	std::optional<size_t> findLastMismatch(const uint8_t *a, const uint8_t *b, size_t len);
+
+	// Range [first, last] containing every difference, or none if the buffers match
+	std::optional<std::pair<size_t, size_t>> mismatchExtent(const uint8_t *a, const uint8_t *b, size_t len);
+
+	// True if newData can be written over oldData without an erase
+	// Programming can only clear bits, so this requires (new & ~old) == 0
+	bool canProgramWithoutErase(const uint8_t *oldData, const uint8_t *newData, size_t len);
+
+	// CRC32C (Castagnoli), as used by iSCSI/ext4. Pass a previous result as crc to continue a calculation
+	uint32_t crc32c(const uint8_t *data, size_t len, uint32_t crc=0);
+
+	// Fast non-cryptographic 64 bit hash (XXH64), for detecting changed content
+	uint64_t hash64(const uint8_t *data, size_t len, uint64_t seed=0);
+
+	// Name of the kernel set in use, for diagnostics
+	const char *implementation(void);
+
+};
+
+#endif
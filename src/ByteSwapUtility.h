@@ -0,0 +1,133 @@
+#ifndef BYTE_SWAP_UTILITY_H
+#define BYTE_SWAP_UTILITY_H
+
+// Bulk byte order reversal of packed 16/32/64 bit words, and bit order reversal within bytes
+// src and dest may be the same buffer, but must not otherwise overlap
+// Uses SSE2 where the compiler targets it (always the case on x86-64), with a scalar tail
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+namespace ByteSwapUtility
+{
+
+	inline void swap16(const uint8_t *src, uint8_t *dest, size_t words)
+	{
+		size_t i = 0;
+#ifdef __SSE2__
+		for(; i+8 <= words; i+=8)
+		{
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src+2*i));
+			v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dest+2*i), v);
+		}
+#endif
+		for(; i < words; i++)
+		{
+			uint16_t v;
+			memcpy(&v, src+2*i, sizeof(v));
+			v = __builtin_bswap16(v);
+			memcpy(dest+2*i, &v, sizeof(v));
+		}
+	}
+
+	inline void swap32(const uint8_t *src, uint8_t *dest, size_t words)
+	{
+		size_t i = 0;
+#ifdef __SSE2__
+		for(; i+4 <= words; i+=4)
+		{
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src+4*i));
+			// Swap bytes within each 16 bit half, then swap the halves
+			v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+			v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2,3,0,1));
+			v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2,3,0,1));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dest+4*i), v);
+		}
+#endif
+		for(; i < words; i++)
+		{
+			uint32_t v;
+			memcpy(&v, src+4*i, sizeof(v));
+			v = __builtin_bswap32(v);
+			memcpy(dest+4*i, &v, sizeof(v));
+		}
+	}
+
+	inline void swap64(const uint8_t *src, uint8_t *dest, size_t words)
+	{
+		size_t i = 0;
+#ifdef __SSE2__
+		for(; i+2 <= words; i+=2)
+		{
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src+8*i));
+			v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+			v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0,1,2,3));
+			v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0,1,2,3));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dest+8*i), v);
+		}
+#endif
+		for(; i < words; i++)
+		{
+			uint64_t v;
+			memcpy(&v, src+8*i, sizeof(v));
+			v = __builtin_bswap64(v);
+			memcpy(dest+8*i, &v, sizeof(v));
+		}
+	}
+
+	// Reverse the bit order of each byte (bit 0 <-> bit 7 etc.), e.g. for FPGAs which load their bitstream LSB first
+	inline void reverseBits(const uint8_t *src, uint8_t *dest, size_t len)
+	{
+		size_t i = 0;
+#ifdef __SSE2__
+		// Swap nibbles, then pairs, then single bits. 16 bit shifts are fine as the masks stop bits crossing bytes
+		const __m128i m4 = _mm_set1_epi8(0x0F);
+		const __m128i m2 = _mm_set1_epi8(0x33);
+		const __m128i m1 = _mm_set1_epi8(0x55);
+		for(; i+16 <= len; i+=16)
+		{
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src+i));
+			v = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 4), m4), _mm_slli_epi16(_mm_and_si128(v, m4), 4));
+			v = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 2), m2), _mm_slli_epi16(_mm_and_si128(v, m2), 2));
+			v = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 1), m1), _mm_slli_epi16(_mm_and_si128(v, m1), 1));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dest+i), v);
+		}
+#endif
+		for(; i < len; i++)
+		{
+			uint8_t v = src[i];
+			v = (v >> 4) | (v << 4);
+			v = ((v >> 2) & 0x33) | ((v & 0x33) << 2);
+			v = ((v >> 1) & 0x55) | ((v & 0x55) << 1);
+			dest[i] = v;
+		}
+	}
+
+	// Dispatch on word size at compile time. Size 1 is a plain copy
+	template<size_t WORD_BYTES> inline void swap(const uint8_t *src, uint8_t *dest, size_t words)
+	{
+		static_assert(WORD_BYTES == 1 or WORD_BYTES == 2 or WORD_BYTES == 4 or WORD_BYTES == 8, "Unsupported word size");
+		if constexpr (WORD_BYTES == 1)
+		{
+			if(src != dest)
+			{
+				memcpy(dest, src, words);
+			}
+		} else if constexpr (WORD_BYTES == 2) {
+			swap16(src, dest, words);
+		} else if constexpr (WORD_BYTES == 4) {
+			swap32(src, dest, words);
+		} else {
+			swap64(src, dest, words);
+		}
+	}
+
+};
+
+#endif
@@ -0,0 +1,180 @@
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <csignal>
+
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/asio/streambuf.hpp>
+
+#include <boost/version.hpp>
+// io_service changed to io_context in 1.66
+#if (((BOOST_VERSION / 100000) == 1) && (BOOST_VERSION / 100 % 1000) >=66)
+	typedef boost::asio::io_context io_t;
+#else
+	typedef boost::asio::io_service io_t;
+#endif
+
+#include "Daemon.hpp"
+#include "FileUtility.h"
+#include "BufferUtility.h"
+#include "ImageTransform.hpp"
+
+Daemon::Daemon(std::string socketPath, FlashSession *session)
+:socketPath(socketPath), session(session)
+{
+}
+
+Daemon::~Daemon()
+{
+	// Only our own socket, never whatever may have been there when binding failed
+	std::error_code ec;
+	if(std::filesystem::is_socket(socketPath, ec))
+	{
+		std::filesystem::remove(socketPath, ec);
+	}
+}
+
+void Daemon::run(void)
+{
+	// A client disconnecting before reading its response must not kill us
+	std::signal(SIGPIPE, SIG_IGN);
+
+	io_t io;
+	// A socket left behind by a daemon which didn't exit cleanly is replaced, but nothing else is
+	if(std::filesystem::is_socket(socketPath))
+	{
+		std::filesystem::remove(socketPath);
+	} else if(std::filesystem::exists(socketPath)) {
+		throw DaemonException(socketPath + " exists and is not a socket");
+	}
+	boost::asio::local::stream_protocol::acceptor acceptor(io, boost::asio::local::stream_protocol::endpoint(socketPath));
+	std::cout << "Listening on " << socketPath << std::endl;
+
+	while(running)
+	{
+		boost::asio::local::stream_protocol::socket socket(io);
+		acceptor.accept(socket);
+
+		boost::asio::streambuf buf;
+		boost::system::error_code ec;
+		while(running)
+		{
+			boost::asio::read_until(socket, buf, '\n', ec);
+			if(ec)
+			{
+				break;
+			}
+			std::istream is(&buf);
+			std::string line;
+			std::getline(is, line);
+			if(line == "quit")
+			{
+				break;
+			}
+
+			std::string response = handle(line) + "\n";
+			boost::asio::write(socket, boost::asio::buffer(response), ec);
+			if(ec)
+			{
+				break;
+			}
+		}
+	}
+}
+
+static int parseNumber(const std::string &str)
+{
+	size_t idx;
+	int val = std::stoi(str, &idx, 0);
+	if(idx != str.size())
+	{
+		throw std::invalid_argument("Invalid number: " + str);
+	}
+	return val;
+}
+
+static std::string hexString(uint32_t val)
+{
+	std::ostringstream ss;
+	ss << "0x" << std::hex << std::setfill('0') << std::setw(8) << val;
+	return ss.str();
+}
+
+std::string Daemon::handle(const std::string &line)
+{
+	std::istringstream ls(line);
+	std::string cmd;
+	ls >> cmd;
+	std::vector<std::string> args;
+	for(std::string arg; ls >> arg; )
+	{
+		args.push_back(arg);
+	}
+
+	std::cout << "Job: " << line << std::endl;
+	try
+	{
+		if(cmd == "ping" and args.empty())
+		{
+			return "OK";
+		} else if(cmd == "flush" and args.empty()) {
+			images.clear();
+			return "OK";
+		} else if(cmd == "shutdown" and args.empty()) {
+			running = false;
+			return "OK";
+		} else if(cmd == "readid" and args.empty()) {
+			// Boards may be swapped while the daemon runs, so this is never cached
+			auto id = session->submit([](SpiFlash &f) { f.releasePowerDown(); return f.readId(); }).get();
+			std::ostringstream ss;
+			ss << "OK" << std::hex << std::setfill('0');
+			for(auto byte : id)
+			{
+				ss << " " << std::setw(2) << static_cast<int>(byte);
+			}
+			return ss.str();
+		} else if(cmd == "program" and args.size() == 2) {
+			int address = parseNumber(args[0]);
+			auto data = loadImage(args[1]);
+			session->submit([](SpiFlash &f) { f.releasePowerDown(); }).get();
+			session->program(address, data).get();
+			return "OK";
+		} else if(cmd == "verify" and args.size() == 2) {
+			int address = parseNumber(args[0]);
+			auto data = loadImage(args[1]);
+			session->submit([](SpiFlash &f) { f.releasePowerDown(); }).get();
+			auto res = session->verify(address, data).get();
+			if(!res.ok())
+			{
+				std::ostringstream ss;
+				ss << "ERR mismatch 0x" << std::hex << address+res.mismatch->first << " 0x" << address+res.mismatch->second;
+				return ss.str();
+			}
+			return "OK " + hexString(res.crc32c);
+		} else if(cmd == "read" and args.size() == 3) {
+			int address = parseNumber(args[0]);
+			int len = parseNumber(args[1]);
+			session->submit([](SpiFlash &f) { f.releasePowerDown(); }).get();
+			auto data = session->read(address, len).get();
+			FileUtility::writeFromVector(args[2], data);
+			return "OK " + hexString(BufferUtility::crc32c(data.data(), data.size()));
+		}
+		return "ERR unknown command or wrong number of arguments";
+	} catch (const std::exception &e) {
+		return std::string("ERR ") + e.what();
+	}
+}
+
+// Images are kept in memory between jobs, and only reloaded if the file changes
+ImagePtr Daemon::loadImage(const std::string &filename)
+{
+	auto mtime = std::filesystem::last_write_time(filename);
+	auto it = images.find(filename);
+	if(it == images.end() or it->second.mtime != mtime)
+	{
+		images[filename] = CachedImage{mtime, std::make_shared<const std::vector<uint8_t>>(ImageTransform().load(filename))};
+	}
+	return images[filename].data;
+}
@@ -0,0 +1,57 @@
+#ifndef DAEMON_HPP
+#define DAEMON_HPP
+
+// Keeps a programmer open and serves jobs over a local Unix socket
+// This avoids paying device open/reset and file load time on every operation
+//
+// Protocol is line based. Each request line gets a single response line starting "OK" or "ERR"
+//   readid                      -> OK <id bytes in hex>, read from the flash each time
+//   program <address> <file>    -> OK
+//   verify <address> <file>     -> OK <crc32c> or ERR mismatch <first address> <last address>
+//   read <address> <len> <file> -> OK <crc32c>
+//   ping                        -> OK
+//   flush                       -> OK (forget cached images)
+//   quit                        -> closes this connection
+//   shutdown                    -> OK, then the daemon exits
+// Numbers may be given in decimal or with a 0x prefix
+
+#include <string>
+#include <vector>
+#include <map>
+#include <filesystem>
+#include <stdexcept>
+#include <stdint.h>
+
+#include "FlashSession.hpp"
+
+class DaemonException : public std::runtime_error
+{
+	using std::runtime_error::runtime_error;
+};
+
+class Daemon
+{
+	public:
+		Daemon(std::string socketPath, FlashSession *session);
+		~Daemon();
+
+		// Serve clients one at a time until a shutdown request
+		void run(void);
+
+	private:
+		std::string handle(const std::string &line);
+		ImagePtr loadImage(const std::string &filename);
+
+		std::string socketPath;
+		FlashSession *session;
+		bool running = true;
+
+		struct CachedImage
+		{
+			std::filesystem::file_time_type mtime;
+			ImagePtr data;
+		};
+		std::map<std::string, CachedImage> images;
+};
+
+#endif
@@ -0,0 +1,285 @@
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+#include "DryRun.hpp"
+
+namespace
+{
+	// MPSSE overhead per SPI call, as generated by SpiWrapper
+	constexpr size_t csBytes = 3; // SETB_LOW, value, direction
+	constexpr size_t clockHeaderBytes = 3; // Opcode and 16 bit length
+	constexpr size_t maxSegment = 65536;
+	constexpr size_t blockingSegment = 1024;
+
+	// WbSpiWrapper moves at most 255 bytes per wishbone transaction, each with a 3 byte header
+	constexpr size_t wbChunk = 255;
+	constexpr size_t wbHeaderBytes = 3;
+
+	std::string operationName(uint8_t opcode)
+	{
+		switch(opcode)
+		{
+			case 0x03: case 0x0B: return "read";
+			case 0x02: return "program";
+			case 0x20: case 0x52: case 0xD8: return "erase";
+			case 0xC7: case 0x60: return "chip erase";
+			case 0x05: case 0x35: case 0x15: return "status";
+			case 0x06: case 0x04: case 0x50: case 0x01: return "write control";
+			default: return "other";
+		}
+	}
+}
+
+FtdiCostModel::FtdiCostModel(double sckHz, unsigned int queueDepth, size_t writeChunkSize)
+:sckHz(sckHz), queueDepth(std::max(1u, queueDepth)), writeChunkSize(writeChunkSize)
+{
+}
+
+std::string FtdiCostModel::describe(void) const
+{
+	std::ostringstream ss;
+	ss << "FTDI at " << sckHz/1e6 << "MHz SCK, USB queue depth " << queueDepth;
+	return ss.str();
+}
+
+// Buffering bytes costs their USB bandwidth and SPI clocking, plus an extra transfer each time a write chunk fills
+// With a queue, the bus and the MPSSE work at the same time, and transfers overlap
+double FtdiCostModel::buffer(size_t bytes, size_t clocked)
+{
+	size_t chunksBefore = pending/writeChunkSize;
+	pending += bytes;
+	size_t chunksFilled = pending/writeChunkSize - chunksBefore;
+
+	double usbUs = bytes/usbBytesPerUs;
+	double clockUs = clocked*8e6/sckHz;
+	if(queueDepth > 1)
+	{
+		return std::max(usbUs, clockUs) + chunksFilled*transferUs/queueDepth;
+	}
+	return usbUs + clockUs + chunksFilled*transferUs;
+}
+
+// Send the remaining partial chunk, and (if rx) wait for the response to come back
+double FtdiCostModel::roundTrip(size_t rx)
+{
+	double us = (pending % writeChunkSize) ? transferUs : 0;
+	if(rx)
+	{
+		us += transferUs + rx/usbBytesPerUs;
+	}
+	pending = 0;
+	return us;
+}
+
+double FtdiCostModel::setCs(bool)
+{
+	return buffer(csBytes, 0);
+}
+
+double FtdiCostModel::send(size_t bytes)
+{
+	double us = 0;
+	for(size_t offset = 0; offset < bytes; offset += maxSegment)
+	{
+		size_t len = std::min(maxSegment, bytes - offset);
+		us += buffer(clockHeaderBytes + len, len);
+	}
+	if(pending >= maxSegment)
+	{
+		us += roundTrip(0);
+	}
+	return us;
+}
+
+double FtdiCostModel::receive(size_t bytes)
+{
+	return transfer(bytes);
+}
+
+double FtdiCostModel::transfer(size_t bytes)
+{
+	double us = 0;
+	if(queueDepth > 1)
+	{
+		size_t segments = (bytes + maxSegment - 1)/maxSegment;
+		us += buffer(segments*clockHeaderBytes + bytes + 1, bytes);
+		return us + roundTrip(bytes);
+	}
+
+	for(size_t offset = 0; offset < bytes; offset += blockingSegment)
+	{
+		size_t len = std::min(blockingSegment, bytes - offset);
+		// The extra byte is MC_FLUSH
+		us += buffer(clockHeaderBytes + len + 1, len);
+		us += roundTrip(len);
+	}
+	return us;
+}
+
+WbUartCostModel::WbUartCostModel(double baud, double turnaroundUs)
+:baud(baud), turnaroundUs(turnaroundUs)
+{
+}
+
+std::string WbUartCostModel::describe(void) const
+{
+	std::ostringstream ss;
+	ss << "wishbone UART at " << baud << " baud, " << turnaroundUs/1000 << "ms turnaround";
+	return ss.str();
+}
+
+double WbUartCostModel::config(bool discard)
+{
+	if(discardRx == discard)
+	{
+		return 0;
+	}
+	discardRx = discard;
+	return wire(wbHeaderBytes + 1);
+}
+
+double WbUartCostModel::setCs(bool)
+{
+	return wire(wbHeaderBytes + 1);
+}
+
+double WbUartCostModel::send(size_t bytes)
+{
+	size_t chunks = (bytes + wbChunk - 1)/wbChunk;
+	return config(true) + wire(chunks*wbHeaderBytes + bytes);
+}
+
+double WbUartCostModel::receive(size_t bytes)
+{
+	// Each chunk writes the number of bytes to inject, then reads them back
+	size_t chunks = (bytes + wbChunk - 1)/wbChunk;
+	return config(false) + wire(chunks*(2*wbHeaderBytes + 1) + bytes) + chunks*turnaroundUs;
+}
+
+double WbUartCostModel::transfer(size_t bytes)
+{
+	size_t chunks = (bytes + wbChunk - 1)/wbChunk;
+	return config(false) + wire(chunks*2*wbHeaderBytes + 2*bytes) + chunks*turnaroundUs;
+}
+
+DryRunSpi::DryRunSpi(FlashEmulator *flash, SpiCostModel *model)
+:flash(flash), model(model)
+{
+}
+
+void DryRunSpi::charge(const std::string &operation, double us, size_t bytes, bool newTransaction)
+{
+	auto entry = std::find_if(entries.begin(), entries.end(), [&](const Entry &e)
+	{
+		return e.phase == phase and e.operation == operation;
+	});
+	if(entry == entries.end())
+	{
+		entries.push_back(Entry{phase, operation});
+		entry = entries.end() - 1;
+	}
+	entry->count += newTransaction;
+	entry->bytes += bytes;
+	entry->us += us;
+}
+
+void DryRunSpi::cost(double us, size_t bytes)
+{
+	nowUs += us;
+	txnUs += us;
+	txnBytes += bytes;
+}
+
+void DryRunSpi::opcode(uint8_t op)
+{
+	if(selected and !haveOpcode)
+	{
+		haveOpcode = true;
+		currentOpcode = op;
+	}
+}
+
+void DryRunSpi::setCs(bool val)
+{
+	if(!val and !selected)
+	{
+		// SpiFlash polls the status register until the last program or erase is done
+		if(nowUs < busyUntilUs)
+		{
+			charge(busyOperation, busyUntilUs - nowUs, 0, false);
+			nowUs = busyUntilUs;
+		}
+		selected = true;
+		haveOpcode = false;
+		txnUs = 0;
+		txnBytes = 0;
+	}
+
+	flash->setCs(val);
+	cost(model->setCs(val), 0);
+
+	if(val and selected)
+	{
+		selected = false;
+		std::string operation = haveOpcode ? operationName(currentOpcode) : "other";
+		charge(operation, txnUs, txnBytes, true);
+
+		double busyMs = 0;
+		switch(haveOpcode ? currentOpcode : 0)
+		{
+			case 0x02: busyMs = timing.flash.pageProgram; break;
+			case 0x20: busyMs = timing.flash.erase4k; break;
+			case 0x52: busyMs = timing.flash.erase32k; break;
+			case 0xD8: busyMs = timing.flash.erase64k; break;
+			case 0xC7: case 0x60: busyMs = timing.chipErase; break;
+		}
+		if(busyMs > 0)
+		{
+			busyUntilUs = nowUs + busyMs*1000;
+			busyOperation = operation;
+		}
+	}
+}
+
+void DryRunSpi::send(std::vector<uint8_t> data)
+{
+	if(!data.empty())
+	{
+		opcode(data[0]);
+	}
+	cost(model->send(data.size()), data.size());
+	flash->send(data);
+}
+
+std::vector<uint8_t> DryRunSpi::transfer(std::vector<uint8_t> data)
+{
+	if(!data.empty())
+	{
+		opcode(data[0]);
+	}
+	cost(model->transfer(data.size()), data.size());
+	return flash->transfer(data);
+}
+
+std::vector<uint8_t> DryRunSpi::receive(int num)
+{
+	cost(model->receive(num), num);
+	return flash->receive(num);
+}
+
+void DryRunSpi::print(std::ostream &os) const
+{
+	std::ios_base::fmtflags flags(os.flags());
+	os << "Dry run estimate for " << model->describe() << ":" << std::endl;
+	os << std::left << std::setw(10) << "Phase" << std::setw(16) << "Operation"
+		<< std::right << std::setw(10) << "Count" << std::setw(12) << "Bytes" << std::setw(12) << "Time" << std::endl;
+	os << std::fixed << std::setprecision(1);
+	for(const auto &e : entries)
+	{
+		os << std::left << std::setw(10) << e.phase << std::setw(16) << e.operation
+			<< std::right << std::setw(10) << e.count << std::setw(12) << e.bytes << std::setw(10) << e.us/1000 << "ms" << std::endl;
+	}
+	os << std::left << std::setw(48) << "Total" << std::right << std::setw(10) << nowUs/1000 << "ms" << std::endl;
+	os.flags(flags);
+}
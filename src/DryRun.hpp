@@ -0,0 +1,140 @@
+#ifndef DRY_RUN_HPP
+#define DRY_RUN_HPP
+
+// Estimates how long a job would take on real hardware, without touching it
+// DryRunSpi stands in for the programmer. Traffic goes to a FlashEmulator, so SpiFlash runs exactly as it would for real,
+// while a SpiCostModel for the chosen programmer estimates the time taken by each call
+// Time is totalled by phase (set by the caller) and by operation (from the opcode of each SPI transaction)
+// Time the flash spends busy after a program or erase is charged to that operation, using typical datasheet timings
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <ostream>
+
+#include "SpiInterface.hpp"
+#include "FlashEmulator.hpp"
+#include "ErasePlanner.hpp"
+
+// Estimated time, in microseconds, for each SpiInterface call on a particular programmer
+class SpiCostModel
+{
+	public:
+		virtual ~SpiCostModel() {};
+
+		virtual double setCs(bool val) = 0;
+		virtual double send(size_t bytes) = 0;
+		virtual double receive(size_t bytes) = 0;
+		virtual double transfer(size_t bytes) = 0;
+
+		virtual std::string describe(void) const = 0;
+};
+
+// Mirrors SpiWrapper: commands are buffered until a response is needed, then sent in writeChunkSize USB transfers
+// Without a queue, readback is done in 1K segments, each a full round trip
+class FtdiCostModel : public SpiCostModel
+{
+	public:
+		FtdiCostModel(double sckHz, unsigned int queueDepth, size_t writeChunkSize = 4096);
+
+		double setCs(bool val) override;
+		double send(size_t bytes) override;
+		double receive(size_t bytes) override;
+		double transfer(size_t bytes) override;
+		std::string describe(void) const override;
+
+		// High speed USB, as for FtdiEmulator
+		static constexpr double usbBytesPerUs = 35;
+		static constexpr double transferUs = 125;
+
+	private:
+		double buffer(size_t bytes, size_t clocked);
+		double roundTrip(size_t rx);
+
+		double sckHz;
+		unsigned int queueDepth;
+		size_t writeChunkSize;
+		size_t pending = 0; // Bytes buffered since the last flush
+};
+
+// Mirrors WbSpiWrapper over WbUart: 255 byte chunks, a 3 byte header per wishbone transaction, 10 bits per byte on the wire,
+// and a turnaround (mostly the USB serial adapter's latency) for every read
+class WbUartCostModel : public SpiCostModel
+{
+	public:
+		WbUartCostModel(double baud, double turnaroundUs = 1000);
+
+		double setCs(bool val) override;
+		double send(size_t bytes) override;
+		double receive(size_t bytes) override;
+		double transfer(size_t bytes) override;
+		std::string describe(void) const override;
+
+	private:
+		double wire(size_t bytes) const { return bytes*10e6/baud; };
+		double config(bool discardRx);
+
+		double baud;
+		double turnaroundUs;
+		bool discardRx = false;
+};
+
+class DryRunSpi : public SpiInterface
+{
+	public:
+		// Flash busy times in milliseconds. Erase and page program times are shared with ErasePlanner
+		struct Timing
+		{
+			ErasePlanner::Timing flash;
+			double chipErase = 40000;
+		};
+
+		// flash and model must outlive this
+		DryRunSpi(FlashEmulator *flash, SpiCostModel *model);
+
+		std::vector<uint8_t> transfer(std::vector<uint8_t> data) override;
+		void setCs(bool val) override;
+		void send(std::vector<uint8_t> data) override;
+		std::vector<uint8_t> receive(int num) override;
+
+		void setTiming(const Timing &t) { timing = t; };
+		// Time from now on is reported under this phase
+		void setPhase(std::string name) { phase = name; };
+
+		double totalUs(void) const { return nowUs; };
+		void print(std::ostream &os) const;
+
+	private:
+		struct Entry
+		{
+			std::string phase;
+			std::string operation;
+			uint64_t count = 0;
+			uint64_t bytes = 0;
+			double us = 0;
+		};
+
+		void charge(const std::string &operation, double us, size_t bytes, bool newTransaction);
+		void opcode(uint8_t op);
+		void cost(double us, size_t bytes);
+
+		FlashEmulator *flash;
+		SpiCostModel *model;
+		Timing timing;
+
+		std::string phase = "setup";
+		std::vector<Entry> entries; // In the order first seen
+
+		double nowUs = 0;
+		double busyUntilUs = 0;
+		std::string busyOperation; // What the flash is busy with
+
+		// Current transaction
+		bool selected = false;
+		bool haveOpcode = false;
+		uint8_t currentOpcode = 0;
+		double txnUs = 0;
+		size_t txnBytes = 0;
+};
+
+#endif
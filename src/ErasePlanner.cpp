@@ -0,0 +1,229 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "ErasePlanner.hpp"
+#include "BufferUtility.h"
+
+ErasePlanner::Plan ErasePlanner::plan(uint32_t baseAddr, const uint8_t *oldData, const uint8_t *newData, size_t len, int pageSize, Timing timing)
+{
+	if((baseAddr % blockSize) != 0 or (len % blockSize) != 0 or (blockSize % pageSize) != 0)
+	{
+		throw std::invalid_argument("Erase plan region must be aligned to erase blocks");
+	}
+
+	enum class PageClass : uint8_t
+	{
+		UNCHANGED,
+		IN_PLACE,
+		ERASE
+	};
+
+	struct BlockInfo
+	{
+		bool dirty = false; // Contains a page needing an erase
+		size_t nonBlankPages = 0; // Pages to program if erased
+		size_t inPlacePages = 0; // Pages to program if not erased
+	};
+
+	Plan ret;
+	const size_t numPages = len / pageSize;
+	const size_t pagesPerBlock = blockSize / pageSize;
+	const size_t numBlocks = len / blockSize;
+
+	std::vector<PageClass> pageClass(numPages);
+	std::vector<bool> pageBlank(numPages);
+	std::vector<BlockInfo> blocks(numBlocks);
+	for(size_t p = 0; p < numPages; p++)
+	{
+		const uint8_t *o = oldData + p*pageSize;
+		const uint8_t *n = newData + p*pageSize;
+		BlockInfo &block = blocks[p / pagesPerBlock];
+
+		pageBlank[p] = BufferUtility::isBlank(n, pageSize);
+		if(!pageBlank[p])
+		{
+			block.nonBlankPages++;
+		}
+
+		if(!BufferUtility::findFirstMismatch(o, n, pageSize))
+		{
+			pageClass[p] = PageClass::UNCHANGED;
+			ret.unchangedPages++;
+		} else if(BufferUtility::canProgramWithoutErase(o, n, pageSize)) {
+			pageClass[p] = PageClass::IN_PLACE;
+			ret.inPlacePages++;
+			block.inPlacePages++;
+		} else {
+			pageClass[p] = PageClass::ERASE;
+			ret.erasePages++;
+			block.dirty = true;
+		}
+	}
+
+	// Estimated time to deal with a run of blocks using 4K erases where needed
+	auto cost4k = [&](size_t first, size_t last)
+	{
+		double cost = 0;
+		for(size_t b = first; b < last; b++)
+		{
+			cost += blocks[b].dirty ? timing.erase4k + blocks[b].nonBlankPages*timing.pageProgram : blocks[b].inPlacePages*timing.pageProgram;
+		}
+		return cost;
+	};
+	// Estimated time to erase a run of blocks at once and rewrite them
+	auto costErase = [&](size_t first, size_t last, double eraseTime)
+	{
+		double cost = eraseTime;
+		for(size_t b = first; b < last; b++)
+		{
+			cost += blocks[b].nonBlankPages*timing.pageProgram;
+		}
+		return cost;
+	};
+	auto anyDirty = [&](size_t first, size_t last)
+	{
+		return std::any_of(blocks.begin() + first, blocks.begin() + last, [](const BlockInfo &b) { return b.dirty; });
+	};
+	// A larger erase can only be used if all of it is inside the region
+	auto whole = [&](size_t first, size_t last, uint32_t size)
+	{
+		return ((baseAddr + first*blockSize) % size) == 0 and (last - first)*blockSize == size;
+	};
+
+	// Size of the erase covering each block, or 0 if it is not erased
+	std::vector<uint32_t> erasedBy(numBlocks, 0);
+	auto choose = [&](size_t first, size_t last, uint32_t size)
+	{
+		if(size == blockSize)
+		{
+			for(size_t b = first; b < last; b++)
+			{
+				if(blocks[b].dirty)
+				{
+					erasedBy[b] = size;
+					ret.erases.push_back({static_cast<uint32_t>(baseAddr + b*blockSize), size});
+				}
+			}
+		} else {
+			std::fill(erasedBy.begin() + first, erasedBy.begin() + last, size);
+			ret.erases.push_back({static_cast<uint32_t>(baseAddr + first*blockSize), size});
+		}
+	};
+
+	// Each 64K window is planned independently, as either one 64K erase or two 32K halves
+	// Each half is either one 32K erase or 4K erases of just the blocks which need it
+	constexpr uint32_t size32k = 32*1024;
+	constexpr uint32_t size64k = 64*1024;
+	for(size_t window = 0; window < numBlocks; )
+	{
+		uint32_t windowAddr = baseAddr + window*blockSize;
+		size_t windowEnd = std::min(numBlocks, window + (size64k - windowAddr % size64k)/blockSize);
+
+		std::vector<std::pair<size_t, uint32_t>> halfChoices;
+		double halvesCost = 0;
+		for(size_t half = window; half < windowEnd; )
+		{
+			uint32_t halfAddr = baseAddr + half*blockSize;
+			size_t halfEnd = std::min(windowEnd, half + (size32k - halfAddr % size32k)/blockSize);
+			double cost = cost4k(half, halfEnd);
+			uint32_t size = blockSize;
+			if(whole(half, halfEnd, size32k) and anyDirty(half, halfEnd))
+			{
+				double cost32k = costErase(half, halfEnd, timing.erase32k);
+				if(cost32k < cost)
+				{
+					cost = cost32k;
+					size = size32k;
+				}
+			}
+			halfChoices.emplace_back(half, size);
+			halvesCost += cost;
+			half = halfEnd;
+		}
+
+		if(whole(window, windowEnd, size64k) and anyDirty(window, windowEnd) and costErase(window, windowEnd, timing.erase64k) < halvesCost)
+		{
+			choose(window, windowEnd, size64k);
+		} else {
+			for(size_t i = 0; i < halfChoices.size(); i++)
+			{
+				size_t halfEnd = (i+1 < halfChoices.size()) ? halfChoices[i+1].first : windowEnd;
+				choose(halfChoices[i].first, halfEnd, halfChoices[i].second);
+			}
+		}
+		window = windowEnd;
+	}
+
+	// Program everything non-blank in erased blocks, and in place pages elsewhere
+	for(size_t p = 0; p < numPages; p++)
+	{
+		bool erased = erasedBy[p / pagesPerBlock] != 0;
+		if((erased and !pageBlank[p]) or (!erased and pageClass[p] == PageClass::IN_PLACE))
+		{
+			ret.pages.push_back(baseAddr + p*pageSize);
+			if(pageClass[p] == PageClass::UNCHANGED)
+			{
+				ret.preservedPages++;
+			}
+		}
+	}
+
+	for(auto &erase : ret.erases)
+	{
+		ret.estimatedMs += (erase.size == blockSize) ? timing.erase4k : (erase.size == size32k) ? timing.erase32k : timing.erase64k;
+	}
+	ret.estimatedMs += ret.pages.size() * timing.pageProgram;
+
+	return ret;
+}
+
+ErasePlanner::Plan ErasePlanner::plan(uint32_t baseAddr, const uint8_t *oldData, const uint8_t *newData, size_t len, int pageSize)
+{
+	return plan(baseAddr, oldData, newData, len, pageSize, Timing());
+}
+
+ErasePlanner::Plan ErasePlanner::overwrite(uint32_t baseAddr, const uint8_t *newData, size_t len, int pageSize, Timing timing)
+{
+	if((baseAddr % blockSize) != 0 or (len % blockSize) != 0 or (blockSize % pageSize) != 0)
+	{
+		throw std::invalid_argument("Erase plan region must be aligned to erase blocks");
+	}
+
+	constexpr uint32_t size32k = 32*1024;
+	constexpr uint32_t size64k = 64*1024;
+	const bool use32k = timing.erase32k < (size32k/blockSize)*timing.erase4k;
+	const bool use64k = timing.erase64k < (use32k ? 2*timing.erase32k : (size64k/blockSize)*timing.erase4k);
+
+	Plan ret;
+	const uint32_t end = baseAddr + len;
+	for(uint32_t addr = baseAddr; addr < end; )
+	{
+		uint32_t size = blockSize;
+		if(use64k and (addr % size64k) == 0 and end - addr >= size64k)
+		{
+			size = size64k;
+		} else if(use32k and (addr % size32k) == 0 and end - addr >= size32k) {
+			size = size32k;
+		}
+		ret.erases.push_back({addr, size});
+		ret.estimatedMs += (size == blockSize) ? timing.erase4k : (size == size32k) ? timing.erase32k : timing.erase64k;
+		addr += size;
+	}
+
+	for(size_t offset = 0; offset < len; offset += pageSize)
+	{
+		if(!BufferUtility::isBlank(newData + offset, pageSize))
+		{
+			ret.pages.push_back(baseAddr + offset);
+		}
+	}
+	ret.erasePages = len / pageSize;
+	ret.estimatedMs += ret.pages.size() * timing.pageProgram;
+
+	return ret;
+}
+
+ErasePlanner::Plan ErasePlanner::overwrite(uint32_t baseAddr, const uint8_t *newData, size_t len, int pageSize)
+{
+	return overwrite(baseAddr, newData, len, pageSize, Timing());
+}
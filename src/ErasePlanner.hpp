@@ -0,0 +1,57 @@
+#ifndef ERASE_PLANNER_HPP
+#define ERASE_PLANNER_HPP
+
+// Plans the cheapest way to change flash from one image to another
+// NOR flash programming can only clear bits, so each page is classified by comparing old and new contents:
+//   unchanged     : nothing to do
+//   in place      : new & ~old == 0, so it can be programmed without an erase
+//   needs erase   : some bit must go from 0 to 1
+// Only the 4K blocks containing pages which need an erase are erased. Neighbouring blocks are merged into a 32K or 64K
+// erase where the timing model says that is quicker. Everything else in an erased block is rewritten from the new image
+
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+class ErasePlanner
+{
+	public:
+		// Typical W25Q128JV datasheet values, in milliseconds
+		struct Timing
+		{
+			double pageProgram = 0.4;
+			double erase4k = 45;
+			double erase32k = 120;
+			double erase64k = 150;
+		};
+
+		struct Erase
+		{
+			uint32_t addr;
+			uint32_t size;
+		};
+
+		struct Plan
+		{
+			std::vector<Erase> erases; // In address order
+			std::vector<uint32_t> pages; // Addresses of pages to program, in address order
+			size_t unchangedPages = 0;
+			size_t inPlacePages = 0;
+			size_t erasePages = 0; // Pages which needed an erase themselves
+			size_t preservedPages = 0; // Unchanged pages rewritten because their block was erased
+			double estimatedMs = 0;
+		};
+
+		static constexpr uint32_t blockSize = 4*1024;
+
+		// oldData and newData are the whole of [baseAddr, baseAddr+len), which must be aligned to blockSize
+		static Plan plan(uint32_t baseAddr, const uint8_t *oldData, const uint8_t *newData, size_t len, int pageSize, Timing timing);
+		static Plan plan(uint32_t baseAddr, const uint8_t *oldData, const uint8_t *newData, size_t len, int pageSize);
+
+		// For when the current contents don't matter: every block in the region is erased, with the largest erases that fit
+		// and are quicker than the smaller ones they replace. Non-blank pages of newData are programmed
+		static Plan overwrite(uint32_t baseAddr, const uint8_t *newData, size_t len, int pageSize, Timing timing);
+		static Plan overwrite(uint32_t baseAddr, const uint8_t *newData, size_t len, int pageSize);
+};
+
+#endif
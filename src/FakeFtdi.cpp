@@ -0,0 +1,300 @@
+#include <cstring>
+#include <algorithm>
+
+#include <ftdi.h>
+
+#include "FakeFtdi.hpp"
+
+namespace
+{
+	const char fakeSerial[] = "FAKE0001";
+	constexpr uint8_t fakeBus = 1;
+	constexpr uint8_t fakeAddress = 2;
+	constexpr uint8_t serialIndex = 3;
+
+	// Returned as the transfer control, so the emulator's handle can be found again
+	struct FakeTransfer
+	{
+		struct ftdi_transfer_control tc;
+		double handle;
+		bool read;
+	};
+
+	int fail(struct ftdi_context *ftdi, int code, const char *msg)
+	{
+		ftdi->error_str = msg;
+		return code;
+	}
+
+	bool isOpen(struct ftdi_context *ftdi)
+	{
+		return ftdi->usb_dev != nullptr;
+	}
+
+	int open(struct ftdi_context *ftdi)
+	{
+		ftdi->usb_dev = reinterpret_cast<struct libusb_device_handle *>(&FakeFtdi::device());
+		return 0;
+	}
+}
+
+FlashEmulator &FakeFtdi::flash(int csPin)
+{
+	static FlashEmulator adbus4, adbus5, acbus0;
+	switch(csPin)
+	{
+		case 5: return adbus5;
+		case 8: return acbus0;
+		default: return adbus4;
+	}
+}
+
+FtdiEmulator &FakeFtdi::device(void)
+{
+	static FtdiEmulator emu(&flash(4));
+	static bool attached = false;
+	if(!attached)
+	{
+		emu.attach(&flash(5), 5);
+		emu.attach(&flash(8), 8);
+		attached = true;
+	}
+	return emu;
+}
+
+extern "C"
+{
+
+int ftdi_init(struct ftdi_context *ftdi)
+{
+	std::memset(ftdi, 0, sizeof(*ftdi));
+	ftdi->writebuffer_chunksize = 4096;
+	ftdi->readbuffer_chunksize = 4096;
+	ftdi->max_packet_size = 512;
+	return 0;
+}
+
+void ftdi_deinit(struct ftdi_context *ftdi)
+{
+	ftdi->usb_dev = nullptr;
+}
+
+int ftdi_set_interface(struct ftdi_context *, enum ftdi_interface)
+{
+	return 0;
+}
+
+int ftdi_usb_open(struct ftdi_context *ftdi, int vendor, int product)
+{
+	if(vendor != 0x0403 or product != 0x6010)
+	{
+		return fail(ftdi, -3, "usb device not found");
+	}
+	return open(ftdi);
+}
+
+int ftdi_usb_open_string(struct ftdi_context *ftdi, const char *)
+{
+	// There is only one device, so it matches any description
+	return open(ftdi);
+}
+
+int ftdi_usb_open_bus_addr(struct ftdi_context *ftdi, uint8_t bus, uint8_t addr)
+{
+	if(bus != fakeBus or addr != fakeAddress)
+	{
+		return fail(ftdi, -3, "device not found");
+	}
+	return open(ftdi);
+}
+
+int ftdi_usb_close(struct ftdi_context *ftdi)
+{
+	ftdi->usb_dev = nullptr;
+	return 0;
+}
+
+int ftdi_usb_reset(struct ftdi_context *ftdi)
+{
+	if(!isOpen(ftdi))
+	{
+		return fail(ftdi, -2, "USB device unavailable");
+	}
+	FakeFtdi::device().reset();
+	return 0;
+}
+
+int ftdi_usb_purge_buffers(struct ftdi_context *ftdi)
+{
+	if(!isOpen(ftdi))
+	{
+		return fail(ftdi, -3, "USB device unavailable");
+	}
+	FakeFtdi::device().purge();
+	return 0;
+}
+
+int ftdi_set_latency_timer(struct ftdi_context *ftdi, unsigned char latency)
+{
+	if(latency < 1)
+	{
+		return fail(ftdi, -1, "latency out of range. Only valid for 1-255");
+	}
+	if(!isOpen(ftdi))
+	{
+		return fail(ftdi, -3, "USB device unavailable");
+	}
+	FakeFtdi::device().setLatencyTimer(latency);
+	return 0;
+}
+
+int ftdi_get_latency_timer(struct ftdi_context *ftdi, unsigned char *latency)
+{
+	if(!isOpen(ftdi))
+	{
+		return fail(ftdi, -2, "USB device unavailable");
+	}
+	*latency = FakeFtdi::device().getLatencyTimer();
+	return 0;
+}
+
+int ftdi_set_bitmode(struct ftdi_context *ftdi, unsigned char, unsigned char mode)
+{
+	if(!isOpen(ftdi))
+	{
+		return fail(ftdi, -2, "USB device unavailable");
+	}
+	FakeFtdi::device().setBitmode(mode);
+	return 0;
+}
+
+int ftdi_disable_bitbang(struct ftdi_context *ftdi)
+{
+	return ftdi_set_bitmode(ftdi, 0, BITMODE_RESET);
+}
+
+int ftdi_write_data_set_chunksize(struct ftdi_context *ftdi, unsigned int chunksize)
+{
+	ftdi->writebuffer_chunksize = chunksize;
+	return 0;
+}
+
+int ftdi_write_data(struct ftdi_context *ftdi, const unsigned char *buf, int size)
+{
+	if(!isOpen(ftdi))
+	{
+		return fail(ftdi, -666, "USB device unavailable");
+	}
+	// Split into transfers as libftdi does
+	for(int offset = 0; offset < size; offset += ftdi->writebuffer_chunksize)
+	{
+		int len = std::min<int>(ftdi->writebuffer_chunksize, size - offset);
+		if(!FakeFtdi::device().write(buf + offset, len))
+		{
+			return fail(ftdi, -1, "usb bulk write failed");
+		}
+	}
+	return size;
+}
+
+int ftdi_read_data(struct ftdi_context *ftdi, unsigned char *buf, int size)
+{
+	if(!isOpen(ftdi))
+	{
+		return fail(ftdi, -666, "USB device unavailable");
+	}
+	int rc = FakeFtdi::device().read(buf, size);
+	if(rc < 0)
+	{
+		return fail(ftdi, -1, "usb bulk read failed");
+	}
+	return rc;
+}
+
+struct ftdi_transfer_control *ftdi_write_data_submit(struct ftdi_context *ftdi, unsigned char *buf, int size)
+{
+	if(!isOpen(ftdi))
+	{
+		fail(ftdi, -666, "USB device unavailable");
+		return nullptr;
+	}
+	auto transfer = new FakeTransfer();
+	transfer->tc.ftdi = ftdi;
+	transfer->tc.buf = buf;
+	transfer->tc.size = size;
+	transfer->handle = FakeFtdi::device().submitWrite(buf, size);
+	transfer->read = false;
+	return &transfer->tc;
+}
+
+struct ftdi_transfer_control *ftdi_read_data_submit(struct ftdi_context *ftdi, unsigned char *buf, int size)
+{
+	if(!isOpen(ftdi))
+	{
+		fail(ftdi, -666, "USB device unavailable");
+		return nullptr;
+	}
+	auto transfer = new FakeTransfer();
+	transfer->tc.ftdi = ftdi;
+	transfer->tc.buf = buf;
+	transfer->tc.size = size;
+	transfer->read = true;
+	FakeFtdi::device().submitRead(buf, size);
+	return &transfer->tc;
+}
+
+int ftdi_transfer_data_done(struct ftdi_transfer_control *tc)
+{
+	auto transfer = reinterpret_cast<FakeTransfer *>(tc);
+	int ret = tc->size;
+	if(transfer->read)
+	{
+		ret = FakeFtdi::device().completeRead();
+	} else {
+		FakeFtdi::device().completeWrite(transfer->handle);
+	}
+	delete transfer;
+	return ret;
+}
+
+const char *ftdi_get_error_string(struct ftdi_context *ftdi)
+{
+	return ftdi->error_str ? ftdi->error_str : "";
+}
+
+libusb_device *libusb_get_device(libusb_device_handle *dev_handle)
+{
+	return reinterpret_cast<libusb_device *>(dev_handle);
+}
+
+int libusb_get_device_descriptor(libusb_device *, struct libusb_device_descriptor *desc)
+{
+	std::memset(desc, 0, sizeof(*desc));
+	desc->idVendor = 0x0403;
+	desc->idProduct = 0x6010;
+	desc->iSerialNumber = serialIndex;
+	return 0;
+}
+
+int libusb_get_string_descriptor_ascii(libusb_device_handle *, uint8_t desc_index, unsigned char *data, int length)
+{
+	if(desc_index != serialIndex)
+	{
+		return -1;
+	}
+	int len = std::min<int>(length, sizeof(fakeSerial) - 1);
+	std::memcpy(data, fakeSerial, len);
+	return len;
+}
+
+uint8_t libusb_get_bus_number(libusb_device *)
+{
+	return fakeBus;
+}
+
+uint8_t libusb_get_device_address(libusb_device *)
+{
+	return fakeAddress;
+}
+
+}
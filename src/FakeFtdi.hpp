@@ -0,0 +1,21 @@
+#ifndef FAKE_FTDI_HPP
+#define FAKE_FTDI_HPP
+
+// Stand-in for the libftdi (and libusb) functions used by SpiWrapper, linked instead of libftdi when built with
+// -DSPI_PROG_FAKE_FTDI=ON. There is a single emulated FT2232H, with serial number FAKE0001 at USB bus 1 address 2,
+// driving a 16MB FlashEmulator. SpiWrapper, and anything above it, runs unmodified
+// Two more flash chips share the bus, with chip selects on ADBUS5 and ACBUS0, for trying out --cs
+
+#include "FtdiEmulator.hpp"
+#include "FlashEmulator.hpp"
+
+namespace FakeFtdi
+{
+
+	FtdiEmulator &device(void);
+	// The flash with its chip select on csPin (4, 5 or 8)
+	FlashEmulator &flash(int csPin = 4);
+
+};
+
+#endif
@@ -2,8 +2,19 @@
 #include <string>
 #include <istream>
 #include <fstream>
+#include <filesystem>
+#include <cstdlib>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "FileUtility.h"
+#include "Timeline.hpp"
+#include "BufferUtility.h"
 
 size_t FileUtility::getSize(std::string filename)
 {
@@ -14,16 +25,181 @@ size_t FileUtility::getSize(std::string filename)
 
 std::vector<uint8_t> FileUtility::readToVector(std::string filename)
 {
+	Timeline::Span span("read file", "file");
 	std::vector<uint8_t> dat;
 	size_t filesize = getSize(filename);
+	span.arg("bytes", filesize);
 	std::ifstream is(filename, std::ios::binary);
 	dat.resize(filesize);
 	is.read((char *)dat.data(), filesize);
 	return dat;
 }
 
-void FileUtility::writeFromVector(std::string filename, std::vector<uint8_t> data)
+void FileUtility::writeFromVector(std::string filename, const std::vector<uint8_t> &data)
 {
+	Timeline::Span span("write file", "file");
+	span.arg("bytes", data.size());
 	std::ofstream of(filename, std::ios::out | std::ios::binary);
-	of.write((char *)&data[0],data.size());
+	of.write((char *)data.data(),data.size());
+}
+
+std::vector<uint8_t> FileUtility::readSparse(std::string filename, size_t *allocated)
+{
+	Timeline::Span span("read file", "file");
+	int fd = open(filename.c_str(), O_RDONLY);
+	if(fd < 0)
+	{
+		throw FileUtilityException("Could not open " + filename + ": " + strerror(errno));
+	}
+	struct stat st;
+	if(fstat(fd, &st) != 0)
+	{
+		int err = errno;
+		close(fd);
+		throw FileUtilityException("Could not stat " + filename + ": " + strerror(err));
+	}
+	std::vector<uint8_t> dat(st.st_size, 0xFF);
+
+	size_t bytesRead = 0;
+	auto readExtent = [&](off_t start, off_t end)
+	{
+		while(start < end)
+		{
+			ssize_t rc = pread(fd, dat.data() + start, end - start, start);
+			if(rc < 0 and errno == EINTR)
+			{
+				continue;
+			} else if(rc < 0) {
+				int err = errno;
+				close(fd);
+				throw FileUtilityException("Could not read " + filename + ": " + strerror(err));
+			} else if(rc == 0) {
+				// The file was truncated while being read
+				close(fd);
+				throw FileUtilityException("Could not read " + filename + ": unexpected end of file");
+			}
+			start += rc;
+			bytesRead += rc;
+		}
+	};
+
+	// The file may grow while it is read, so nothing past the size dat was allocated for is read
+	off_t pos = 0;
+	while(pos < st.st_size)
+	{
+		off_t dataStart = lseek(fd, pos, SEEK_DATA);
+		if(dataStart < 0)
+		{
+			if(errno == ENXIO)
+			{
+				// Nothing but hole from here to the end
+				break;
+			}
+			// Holes not supported, so it is all data
+			readExtent(pos, st.st_size);
+			break;
+		}
+		if(dataStart >= st.st_size)
+		{
+			break;
+		}
+		off_t dataEnd = lseek(fd, dataStart, SEEK_HOLE);
+		if(dataEnd < 0 or dataEnd > st.st_size)
+		{
+			dataEnd = st.st_size;
+		}
+		readExtent(dataStart, dataEnd);
+		pos = dataEnd;
+	}
+	close(fd);
+
+	span.arg("bytes", bytesRead);
+	if(allocated)
+	{
+		*allocated = bytesRead;
+	}
+	return dat;
+}
+
+size_t FileUtility::writeSparse(std::string filename, const std::vector<uint8_t> &data, size_t blockSize)
+{
+	Timeline::Span span("write file", "file");
+	int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(fd < 0)
+	{
+		throw FileUtilityException("Could not open " + filename + ": " + strerror(errno));
+	}
+
+	size_t written = 0;
+	size_t offset = 0;
+	while(offset < data.size())
+	{
+		// Runs of non-blank blocks are written together
+		size_t runEnd = offset;
+		while(runEnd < data.size() and !BufferUtility::isBlank(data.data() + runEnd, std::min(blockSize, data.size() - runEnd)))
+		{
+			runEnd += std::min(blockSize, data.size() - runEnd);
+		}
+		while(offset < runEnd)
+		{
+			ssize_t rc = pwrite(fd, data.data() + offset, runEnd - offset, offset);
+			if(rc < 0 and errno == EINTR)
+			{
+				continue;
+			} else if(rc < 0) {
+				int err = errno;
+				close(fd);
+				throw FileUtilityException("Could not write " + filename + ": " + strerror(err));
+			} else if(rc == 0) {
+				close(fd);
+				throw FileUtilityException("Could not write " + filename + ": nothing was written");
+			}
+			offset += rc;
+			written += rc;
+		}
+		// Skip the blank blocks, leaving a hole
+		while(offset < data.size() and BufferUtility::isBlank(data.data() + offset, std::min(blockSize, data.size() - offset)))
+		{
+			offset += std::min(blockSize, data.size() - offset);
+		}
+	}
+	// Sets the size, even if the file ends in a hole
+	if(ftruncate(fd, data.size()) != 0)
+	{
+		int err = errno;
+		close(fd);
+		throw FileUtilityException("Could not write " + filename + ": " + strerror(err));
+	}
+	close(fd);
+
+	span.arg("bytes", written);
+	return written;
+}
+
+std::string FileUtility::cacheDir(void)
+{
+	std::filesystem::path dir;
+	if(const char *xdg = std::getenv("XDG_CACHE_HOME"); xdg and *xdg)
+	{
+		dir = xdg;
+	} else if(const char *home = std::getenv("HOME"); home and *home) {
+		dir = std::filesystem::path(home) / ".cache";
+	} else {
+		dir = std::filesystem::temp_directory_path();
+	}
+	dir /= "spi_prog";
+	std::filesystem::create_directories(dir);
+	return dir.string();
+}
+
+std::string FileUtility::sanitiseFilename(std::string name)
+{
+	for(auto &c : name)
+	{
+		if(not (isalnum(static_cast<unsigned char>(c)) or c == '-' or c == '.'))
+		{
+			c = '_';
+		}
+	}
+	return name;
 }
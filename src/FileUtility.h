@@ -3,6 +3,12 @@
 
 #include <string>
 #include <vector>
+#include <stdexcept>
+
+class FileUtilityException : public std::runtime_error
+{
+	using std::runtime_error::runtime_error;
+};
 
 namespace FileUtility
 {
@@ -11,7 +17,22 @@ namespace FileUtility
 
 	std::vector<uint8_t> readToVector(std::string filename);
 
-	void writeFromVector(std::string filename, std::vector<uint8_t> data);
+	void writeFromVector(std::string filename, const std::vector<uint8_t> &data);
+
+	// Sparse files, for images of mostly erased flash. Holes stand for erased (0xFF) flash, not zeros
+	// Only the allocated extents are read, found with SEEK_DATA/SEEK_HOLE. Holes come back as 0xFF
+	// Falls back to reading everything if the filesystem can't report holes
+	// allocated is set to the number of bytes actually read
+	std::vector<uint8_t> readSparse(std::string filename, size_t *allocated = nullptr);
+	// Blocks of blockSize which are entirely 0xFF are left as holes. Returns the number of bytes actually written
+	size_t writeSparse(std::string filename, const std::vector<uint8_t> &data, size_t blockSize = 4096);
+
+	// Per-user directory for spi_prog's persistent state, created if necessary
+	// $XDG_CACHE_HOME/spi_prog, falling back to ~/.cache/spi_prog
+	std::string cacheDir(void);
+
+	// Replace any characters which are not safe in a file name
+	std::string sanitiseFilename(std::string name);
 
 };
 
@@ -0,0 +1,168 @@
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <random>
+#include <algorithm>
+#include <cstdio>
+
+#include "FlashCache.hpp"
+#include "FileUtility.h"
+#include "BufferUtility.h"
+#include "SpiFlash.hpp"
+
+static const std::string cacheMagic = "spi_prog cache v1";
+
+FlashCache::FlashCache(std::string key, int sectorSize)
+:sectorSize(sectorSize)
+{
+	filename = FileUtility::cacheDir() + "/" + FileUtility::sanitiseFilename(key) + ".cache";
+
+	std::ifstream is(filename);
+	if(!is)
+	{
+		// No cache yet
+		return;
+	}
+
+	std::string line;
+	int fileSectorSize;
+	if(!std::getline(is, line) or line != cacheMagic or !std::getline(is, line) or sscanf(line.c_str(), "sector %i", &fileSectorSize) != 1)
+	{
+		throw FlashCacheException("Corrupt cache file: " + filename);
+	}
+	if(fileSectorSize != sectorSize)
+	{
+		// Written with a different geometry, so useless
+		return;
+	}
+
+	int addr;
+	uint64_t hash;
+	while(is >> std::hex >> addr >> hash)
+	{
+		sectors[addr] = hash;
+	}
+}
+
+std::vector<uint64_t> FlashCache::hashSectors(const std::vector<uint8_t> &data, int sectorSize)
+{
+	size_t numSectors = (data.size() + sectorSize - 1)/sectorSize;
+	std::vector<uint64_t> hashes(numSectors);
+
+	auto hashRange = [&](size_t first, size_t stride)
+	{
+		std::vector<uint8_t> padded;
+		for(size_t i = first; i < numSectors; i += stride)
+		{
+			size_t offset = i*sectorSize;
+			size_t len = std::min(data.size() - offset, static_cast<size_t>(sectorSize));
+			const uint8_t *p = data.data() + offset;
+			if(len < static_cast<size_t>(sectorSize))
+			{
+				padded.assign(sectorSize, 0xFF);
+				std::copy(p, p+len, padded.begin());
+				p = padded.data();
+			}
+			hashes[i] = BufferUtility::hash64(p, sectorSize);
+		}
+	};
+
+	size_t numThreads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), numSectors);
+	std::vector<std::thread> threads;
+	for(size_t t = 1; t < numThreads; t++)
+	{
+		threads.emplace_back(hashRange, t, numThreads);
+	}
+	hashRange(0, std::max<size_t>(numThreads, 1));
+	for(auto &t : threads)
+	{
+		t.join();
+	}
+	return hashes;
+}
+
+std::vector<bool> FlashCache::unchangedSectors(int addr, const std::vector<uint64_t> &hashes) const
+{
+	std::vector<bool> ret(hashes.size());
+	for(size_t i = 0; i < hashes.size(); i++)
+	{
+		auto it = sectors.find(addr + i*sectorSize);
+		ret[i] = (it != sectors.end() and it->second == hashes[i]);
+	}
+	return ret;
+}
+
+bool FlashCache::spotCheck(SpiFlash &flash, int addr, const std::vector<uint8_t> &data, const std::vector<bool> &unchanged, int numChecks) const
+{
+	std::vector<size_t> candidates;
+	for(size_t i = 0; i < unchanged.size(); i++)
+	{
+		if(unchanged[i])
+		{
+			candidates.push_back(i);
+		}
+	}
+
+	std::random_device rd;
+	std::mt19937 rng(rd());
+	std::shuffle(candidates.begin(), candidates.end(), rng);
+	if(candidates.size() > static_cast<size_t>(numChecks))
+	{
+		candidates.resize(numChecks);
+	}
+
+	const int pageSize = flash.getPageSize();
+	for(auto sector : candidates)
+	{
+		size_t sectorOffset = sector*sectorSize;
+		size_t sectorLen = std::min(data.size() - sectorOffset, static_cast<size_t>(sectorSize));
+		size_t numPages = (sectorLen + pageSize - 1)/pageSize;
+		size_t offset = sectorOffset + std::uniform_int_distribution<size_t>(0, numPages-1)(rng)*pageSize;
+		size_t len = std::min(data.size() - offset, static_cast<size_t>(pageSize));
+
+		auto readback = flash.read(addr + offset, len);
+		if(BufferUtility::findFirstMismatch(readback.data(), data.data() + offset, len))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+void FlashCache::update(int addr, const std::vector<uint64_t> &hashes)
+{
+	for(size_t i = 0; i < hashes.size(); i++)
+	{
+		sectors[addr + i*sectorSize] = hashes[i];
+	}
+}
+
+void FlashCache::forget(int addr, size_t numSectors)
+{
+	for(size_t i = 0; i < numSectors; i++)
+	{
+		sectors.erase(addr + i*sectorSize);
+	}
+}
+
+void FlashCache::save(void) const
+{
+	// Write to a temporary file then rename, so the cache is never left half written
+	std::string tmpName = filename + ".tmp";
+	{
+		std::ofstream os(tmpName, std::ios::out | std::ios::trunc);
+		os << cacheMagic << "\n" << "sector 0x" << std::hex << sectorSize << "\n";
+		for(auto &sector : sectors)
+		{
+			os << sector.first << " " << sector.second << "\n";
+		}
+		if(!os.flush())
+		{
+			throw FlashCacheException("Could not write cache file: " + tmpName);
+		}
+	}
+	if(std::rename(tmpName.c_str(), filename.c_str()) != 0)
+	{
+		throw FlashCacheException("Could not replace cache file: " + filename);
+	}
+}
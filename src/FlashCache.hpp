@@ -0,0 +1,56 @@
+#ifndef FLASH_CACHE_HPP
+#define FLASH_CACHE_HPP
+
+// Persistent record of what was last written to a particular flash chip
+// Stores a 64 bit hash per sector, so that unchanged sectors can be skipped without a full readback
+// Each cache file is keyed by flash JEDEC ID and programmer/board identity, and lives in FileUtility::cacheDir()
+//
+// File format is text:
+//   spi_prog cache v1
+//   sector <size>
+//   Then one line per known sector: <address> <hash>, both in hex
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdexcept>
+#include <stdint.h>
+
+class SpiFlash;
+
+class FlashCacheException : public std::runtime_error
+{
+	using std::runtime_error::runtime_error;
+};
+
+class FlashCache
+{
+	public:
+		FlashCache(std::string key, int sectorSize);
+
+		// Hash each sector of an image to be written at a sector aligned address
+		// A partial last sector is hashed as though padded with 0xFF, as that is what is left in flash
+		// Sectors are split between all available cores
+		static std::vector<uint64_t> hashSectors(const std::vector<uint8_t> &data, int sectorSize);
+
+		// Sectors (indexed from addr) whose cached hash matches
+		std::vector<bool> unchangedSectors(int addr, const std::vector<uint64_t> &hashes) const;
+
+		// Read back a random page from numChecks of the unchanged sectors, and check it matches data
+		// Returns false if any do not, in which case the cache can't be trusted
+		bool spotCheck(SpiFlash &flash, int addr, const std::vector<uint8_t> &data, const std::vector<bool> &unchanged, int numChecks) const;
+
+		// Record what has been written. Sectors are forgotten before a write starts, so a failed write leaves them unknown
+		void update(int addr, const std::vector<uint64_t> &hashes);
+		void forget(int addr, size_t numSectors);
+		void clear(void) { sectors.clear(); };
+
+		void save(void) const;
+
+	private:
+		std::string filename;
+		int sectorSize;
+		std::map<int, uint64_t> sectors;
+};
+
+#endif
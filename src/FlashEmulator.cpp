@@ -0,0 +1,230 @@
+#include "FlashEmulator.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+FlashEmulator::FlashEmulator(size_t size, std::array<uint8_t,3> jedecId)
+:mem(size, 0xFF), jedecId(jedecId)
+{
+	if(size == 0 or (size % (64*1024)) != 0)
+	{
+		throw std::invalid_argument("Emulated flash size must be a multiple of 64K");
+	}
+}
+
+void FlashEmulator::select(void)
+{
+	selected = true;
+	command.clear();
+}
+
+uint8_t FlashEmulator::exchange(uint8_t mosi)
+{
+	if(!selected)
+	{
+		return 0xFF;
+	}
+	command.push_back(mosi);
+	size_t n = command.size();
+	Cmd cmd = static_cast<Cmd>(command[0]);
+
+	// Only status reads are answered while busy, and only release while powered down
+	if(poweredDown or (busyRemaining and cmd != Cmd::readStatus1))
+	{
+		return 0xFF;
+	}
+
+	switch(cmd)
+	{
+		case Cmd::readStatus1:
+			if(n < 2)
+			{
+				break;
+			}
+			if(busyRemaining)
+			{
+				busyRemaining--;
+				return status[0] | 0x01;
+			}
+			return status[0];
+		case Cmd::readStatus2:
+			return (n < 2) ? 0xFF : status[1];
+		case Cmd::readStatus3:
+			return (n < 2) ? 0xFF : status[2];
+		case Cmd::readId:
+			return (n >= 2 and n <= 4) ? jedecId[n-2] : 0xFF;
+		case Cmd::read:
+			if(n >= 5)
+			{
+				emuStats.bytesRead++;
+				return mem[(address() + n - 5) % mem.size()];
+			}
+			break;
+		case Cmd::fastRead:
+			if(n >= 6)
+			{
+				emuStats.bytesRead++;
+				return mem[(address() + n - 6) % mem.size()];
+			}
+			break;
+		default:
+			break;
+	}
+	return 0xFF;
+}
+
+void FlashEmulator::deselect(void)
+{
+	if(selected and !command.empty())
+	{
+		finishCommand();
+	}
+	selected = false;
+	command.clear();
+}
+
+std::vector<uint8_t> FlashEmulator::transfer(std::vector<uint8_t> data)
+{
+	for(auto &byte : data)
+	{
+		byte = exchange(byte);
+	}
+	return data;
+}
+
+void FlashEmulator::setCs(bool val)
+{
+	if(val)
+	{
+		deselect();
+	} else {
+		select();
+	}
+}
+
+void FlashEmulator::send(std::vector<uint8_t> data)
+{
+	for(auto byte : data)
+	{
+		exchange(byte);
+	}
+}
+
+std::vector<uint8_t> FlashEmulator::receive(int num)
+{
+	std::vector<uint8_t> ret(num);
+	for(auto &byte : ret)
+	{
+		byte = exchange(0xFF);
+	}
+	return ret;
+}
+
+uint32_t FlashEmulator::address(void) const
+{
+	return ((command[1] << 16) | (command[2] << 8) | command[3]) % mem.size();
+}
+
+bool FlashEmulator::writable(void) const
+{
+	return (status[0] & 0x02) and !(status[0] & 0x1C);
+}
+
+// Write and erase commands take effect when chip select goes high
+void FlashEmulator::finishCommand(void)
+{
+	emuStats.commands++;
+	Cmd cmd = static_cast<Cmd>(command[0]);
+	size_t n = command.size();
+
+	if(poweredDown)
+	{
+		if(cmd == Cmd::releasePowerDown)
+		{
+			poweredDown = false;
+		}
+		return;
+	}
+	if(busyRemaining)
+	{
+		return;
+	}
+
+	switch(cmd)
+	{
+		case Cmd::writeEnable:
+			status[0] |= 0x02;
+			break;
+		case Cmd::writeDisable:
+			status[0] &= ~0x02;
+			break;
+		case Cmd::volatileStatusEnable:
+			statusWriteEnabled = true;
+			break;
+		case Cmd::writeStatus:
+			if(n >= 2 and ((status[0] & 0x02) or statusWriteEnabled))
+			{
+				status[0] = command[1] & ~0x03;
+				if(n >= 3)
+				{
+					status[1] = command[2];
+				}
+				statusWriteEnabled = false;
+				setBusy();
+			}
+			status[0] &= ~0x02;
+			break;
+		case Cmd::pageProgram:
+			if(n > 4 and writable())
+			{
+				// Only the last page's worth of data is kept, and the address wraps within the page
+				uint32_t addr = address();
+				uint32_t pageBase = addr & ~0xFFu;
+				size_t first = (n > 4 + 256) ? n - 256 : 4;
+				for(size_t i = first; i < n; i++)
+				{
+					mem[pageBase | ((addr + i - 4) & 0xFF)] &= command[i];
+				}
+				emuStats.pagePrograms++;
+				emuStats.bytesProgrammed += n - first;
+				setBusy();
+			}
+			status[0] &= ~0x02;
+			break;
+		case Cmd::erase4k:
+		case Cmd::erase32k:
+		case Cmd::erase64k:
+			if(n >= 4 and writable())
+			{
+				uint32_t size = (cmd == Cmd::erase4k) ? 4*1024 : (cmd == Cmd::erase32k) ? 32*1024 : 64*1024;
+				erase(address() & ~(size-1), size);
+			}
+			status[0] &= ~0x02;
+			break;
+		case Cmd::chipErase:
+		case Cmd::chipErase2:
+			if(writable())
+			{
+				erase(0, mem.size());
+			}
+			status[0] &= ~0x02;
+			break;
+		case Cmd::powerDown:
+			poweredDown = true;
+			break;
+		default:
+			break;
+	}
+}
+
+void FlashEmulator::erase(uint32_t addr, uint32_t size)
+{
+	std::fill(mem.begin() + addr, mem.begin() + addr + size, 0xFF);
+	emuStats.erases++;
+	setBusy();
+}
+
+void FlashEmulator::setBusy(void)
+{
+	busyRemaining = busyPolls;
+}
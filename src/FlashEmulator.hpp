@@ -0,0 +1,100 @@
+#ifndef FLASH_EMULATOR_HPP
+#define FLASH_EMULATOR_HPP
+
+// Software model of a generic 25 series SPI NOR flash (e.g. W25Q128)
+// Can be driven a byte at a time (for emulating an SPI master), or used directly as a SpiInterface
+//
+// Supported commands:
+//   0x03 read, 0x0B fast read, 0x02 page program
+//   0x20 4K erase, 0x52 32K erase, 0xD8 64K erase, 0xC7/0x60 chip erase
+//   0x05/0x35/0x15 read status, 0x01 write status, 0x06 write enable, 0x04 write disable, 0x50 volatile status write enable
+//   0x9F JEDEC ID, 0xB9 power down, 0xAB release power down
+// Programming can only clear bits, and page programs wrap within the page, as on real parts
+// Any block protect bit set in status register 1 protects the whole chip
+// Unknown commands are ignored and return 0xFF
+
+#include <vector>
+#include <array>
+#include <cstddef>
+#include <stdint.h>
+
+#include "SpiInterface.hpp"
+
+class FlashEmulator final : public SpiInterface
+{
+	public:
+		// size must be a multiple of 64K. Contents start erased
+		FlashEmulator(size_t size = 16*1024*1024, std::array<uint8_t,3> jedecId = {0xEF, 0x40, 0x18});
+
+		// Byte level interface, as seen on the SPI pins
+		void select(void);
+		uint8_t exchange(uint8_t mosi);
+		void deselect(void);
+
+		// SpiInterface, for use in place of real hardware
+		std::vector<uint8_t> transfer(std::vector<uint8_t> data) override;
+		void setCs(bool val) override;
+		void send(std::vector<uint8_t> data) override;
+		std::vector<uint8_t> receive(int num) override;
+
+		// Number of status register reads which report busy after each program or erase
+		void setBusyPolls(int polls) { busyPolls = polls; };
+
+		std::vector<uint8_t> &memory(void) { return mem; };
+		const std::vector<uint8_t> &memory(void) const { return mem; };
+
+		struct Stats
+		{
+			uint64_t commands = 0;
+			uint64_t pagePrograms = 0;
+			uint64_t erases = 0;
+			uint64_t bytesRead = 0;
+			uint64_t bytesProgrammed = 0;
+		};
+		const Stats &stats(void) const { return emuStats; };
+
+	private:
+		enum class Cmd : uint8_t
+		{
+			writeStatus = 0x01,
+			pageProgram = 0x02,
+			read = 0x03,
+			writeDisable = 0x04,
+			readStatus1 = 0x05,
+			writeEnable = 0x06,
+			fastRead = 0x0B,
+			readStatus3 = 0x15,
+			erase4k = 0x20,
+			readStatus2 = 0x35,
+			volatileStatusEnable = 0x50,
+			erase32k = 0x52,
+			chipErase2 = 0x60,
+			readId = 0x9F,
+			releasePowerDown = 0xAB,
+			powerDown = 0xB9,
+			chipErase = 0xC7,
+			erase64k = 0xD8,
+		};
+
+		uint32_t address(void) const;
+		bool writable(void) const;
+		void finishCommand(void);
+		void erase(uint32_t addr, uint32_t size);
+		void setBusy(void);
+
+		std::vector<uint8_t> mem;
+		std::array<uint8_t,3> jedecId;
+
+		bool selected = false;
+		std::vector<uint8_t> command; // Bytes received since chip select went low
+
+		std::array<uint8_t,3> status = {0,0,0};
+		bool statusWriteEnabled = false;
+		bool poweredDown = false;
+		int busyPolls = 1;
+		int busyRemaining = 0;
+
+		Stats emuStats;
+};
+
+#endif
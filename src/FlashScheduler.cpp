@@ -0,0 +1,146 @@
+#include <algorithm>
+
+#include "FlashScheduler.hpp"
+#include "BufferUtility.h"
+#include "Timeline.hpp"
+
+FlashScheduler::FlashScheduler(SpiFlash *flash, int numChips, ChipSelector selectChip)
+:flash(flash), selectChip(selectChip), chips(numChips)
+{
+}
+
+void FlashScheduler::add(int chip, int addr, std::shared_ptr<const std::vector<uint8_t>> data)
+{
+	if(chip < 0 or chip >= static_cast<int>(chips.size()))
+	{
+		throw SpiFlashException("No chip " + std::to_string(chip));
+	}
+	jobs.push_back({chip, addr, data});
+}
+
+// As SpiFlash::program does for an unaligned range: read back the rest of the first and last blocks, then overwrite
+void FlashScheduler::plan(const Job &job, Chip &chip)
+{
+	const int block = ErasePlanner::blockSize;
+	const int pageSize = flash->getPageSize();
+	const int end = job.addr + job.data->size();
+	const int regionStart = job.addr - (job.addr % block);
+	const int regionEnd = ((end + block - 1)/block)*block;
+
+	std::vector<uint8_t> region(regionEnd - regionStart);
+	if(job.addr > regionStart)
+	{
+		auto head = flash->read(regionStart, job.addr - regionStart);
+		std::copy(head.begin(), head.end(), region.begin());
+	}
+	std::copy(job.data->begin(), job.data->end(), region.begin() + (job.addr - regionStart));
+	if(regionEnd > end)
+	{
+		auto tail = flash->read(end, regionEnd - end);
+		std::copy(tail.begin(), tail.end(), region.begin() + (end - regionStart));
+	}
+
+	auto plan = ErasePlanner::overwrite(regionStart, region.data(), region.size(), pageSize);
+	size_t index = chip.regions.size();
+	chip.regions.push_back(std::move(region));
+
+	// Each block is erased just before its first page is programmed
+	auto nextErase = plan.erases.begin();
+	for(auto pageAddr : plan.pages)
+	{
+		for(; nextErase != plan.erases.end() and nextErase->addr <= pageAddr; nextErase++)
+		{
+			chip.ops.push_back({true, nextErase->addr, nextErase->size, 0, 0});
+		}
+		chip.ops.push_back({false, pageAddr, 0, index, pageAddr - regionStart});
+	}
+	for(; nextErase != plan.erases.end(); nextErase++)
+	{
+		chip.ops.push_back({true, nextErase->addr, nextErase->size, 0, 0});
+	}
+}
+
+FlashScheduler::Stats FlashScheduler::run(void)
+{
+	Timeline::Span span("schedule", "flash");
+	span.arg("chips", chips.size());
+	Stats stats;
+
+	for(size_t c = 0; c < chips.size(); c++)
+	{
+		chips[c] = Chip();
+		selectChip(c);
+		for(const auto &job : jobs)
+		{
+			if(job.chip == static_cast<int>(c))
+			{
+				plan(job, chips[c]);
+			}
+		}
+		// A chip may still be finishing whatever it was last asked to do
+		chips[c].busy = true;
+	}
+
+	const int pageSize = flash->getPageSize();
+	bool working = true;
+	while(working)
+	{
+		working = false;
+		bool started = false;
+		for(size_t c = 0; c < chips.size(); c++)
+		{
+			Chip &chip = chips[c];
+			if(chip.busy)
+			{
+				selectChip(c);
+				chip.busy = flash->isBusy();
+				stats.polls++;
+			}
+			if(!chip.busy and chip.next < chip.ops.size())
+			{
+				selectChip(c);
+				const Op &op = chip.ops[chip.next++];
+				if(op.erase)
+				{
+					flash->startBlockErase(op.addr, op.size);
+					stats.erases++;
+				} else {
+					auto start = chip.regions[op.region].cbegin() + op.offset;
+					flash->write(op.addr, start, start + pageSize);
+					stats.pages++;
+				}
+				chip.busy = true;
+				started = true;
+			}
+			working = working or chip.busy or chip.next < chip.ops.size();
+		}
+		if(working and !started)
+		{
+			stats.idlePolls++;
+		}
+	}
+
+	span.arg("pages", stats.pages);
+	span.arg("erases", stats.erases);
+	return stats;
+}
+
+std::vector<FlashScheduler::Mismatch> FlashScheduler::verify(void)
+{
+	std::vector<Mismatch> mismatches;
+	for(const auto &job : jobs)
+	{
+		auto found = std::find_if(mismatches.begin(), mismatches.end(), [&](const Mismatch &m) { return m.chip == job.chip; });
+		if(found != mismatches.end())
+		{
+			continue;
+		}
+		selectChip(job.chip);
+		auto readBack = flash->read(job.addr, job.data->size());
+		if(auto extent = BufferUtility::mismatchExtent(readBack.data(), job.data->data(), job.data->size()))
+		{
+			mismatches.push_back({job.chip, static_cast<uint32_t>(job.addr + extent->first), static_cast<uint32_t>(job.addr + extent->second)});
+		}
+	}
+	return mismatches;
+}
@@ -0,0 +1,87 @@
+#ifndef FLASH_SCHEDULER_HPP
+#define FLASH_SCHEDULER_HPP
+
+// Writes several flash chips which share one SPI bus, each on its own chip select
+// An erase or page program keeps a chip busy for milliseconds to seconds, with nothing for the bus to do. Instead of
+// waiting, the scheduler polls every busy chip in turn, and starts the next operation on whichever is ready first.
+// Busy time overlaps across chips, so N chips take little longer than the slowest one alone
+//
+// Each job is planned as for SpiFlash::program: the 4K blocks covering the data are erased (merged into 32K and 64K erases
+// where quicker), anything else in them is read back first and rewritten, and only pages which aren't blank are programmed
+
+#include <vector>
+#include <functional>
+#include <memory>
+#include <stdint.h>
+
+#include "SpiFlash.hpp"
+#include "ErasePlanner.hpp"
+
+class FlashScheduler
+{
+	public:
+		// Called before each command, to route flash's bus to that chip (e.g. via SpiWrapper::selectChip)
+		typedef std::function<void(int chip)> ChipSelector;
+
+		struct Stats
+		{
+			uint64_t erases = 0;
+			uint64_t pages = 0;
+			uint64_t polls = 0; // Status register reads
+			uint64_t idlePolls = 0; // Rounds in which every chip was busy
+		};
+
+		struct Mismatch
+		{
+			int chip;
+			uint32_t first; // Flash addresses
+			uint32_t last;
+		};
+
+		// flash and selectChip must outlive the scheduler. flash is shared by every chip
+		FlashScheduler(SpiFlash *flash, int numChips, ChipSelector selectChip);
+
+		// Queue data to be written to chip at addr. Neither needs to be aligned
+		void add(int chip, int addr, std::shared_ptr<const std::vector<uint8_t>> data);
+
+		// Write everything queued, and wait until every chip is ready
+		Stats run(void);
+
+		// Read back every job (whether or not it has been run). Returns the first difference on each chip which has one
+		std::vector<Mismatch> verify(void);
+
+	private:
+		struct Job
+		{
+			int chip;
+			int addr;
+			std::shared_ptr<const std::vector<uint8_t>> data;
+		};
+
+		// Everything to do on one chip, in order
+		struct Op
+		{
+			bool erase;
+			uint32_t addr;
+			uint32_t size; // Erase size
+			size_t region; // Page contents are at this offset in regions[region]
+			size_t offset;
+		};
+
+		struct Chip
+		{
+			std::vector<std::vector<uint8_t>> regions; // Block aligned contents of each job, with what surrounds it
+			std::vector<Op> ops;
+			size_t next = 0;
+			bool busy = false;
+		};
+
+		void plan(const Job &job, Chip &chip);
+
+		SpiFlash *flash;
+		ChipSelector selectChip;
+		std::vector<Job> jobs;
+		std::vector<Chip> chips;
+};
+
+#endif
@@ -0,0 +1,87 @@
+#include "FlashSession.hpp"
+#include "BufferUtility.h"
+
+FlashSession::FlashSession(SpiInterface *spi)
+:flash(spi), thread(&FlashSession::worker, this)
+{
+}
+
+FlashSession::~FlashSession()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	cv.notify_one();
+	thread.join();
+}
+
+std::future<std::vector<uint8_t>> FlashSession::readId(JobControl control)
+{
+	return submit([](SpiFlash &f) { return f.readId(); }, control);
+}
+
+std::future<std::vector<uint8_t>> FlashSession::read(int addr, int len, JobControl control)
+{
+	return submit([addr, len](SpiFlash &f) { return f.read(addr, len); }, control);
+}
+
+std::future<void> FlashSession::program(int addr, ImagePtr data, ProgramOptions options, JobControl control)
+{
+	return submit([addr, data, options](SpiFlash &f)
+	{
+		f.setJournal(options.journal);
+		f.setVerify(options.verify, options.verifyRetries);
+		f.program(addr, *data, options.skipSectors);
+	}, control);
+}
+
+std::future<ErasePlanner::Plan> FlashSession::update(int addr, ImagePtr data, ImagePtr previous, ProgramOptions options, JobControl control)
+{
+	return submit([addr, data, previous, options](SpiFlash &f)
+	{
+		f.setVerify(options.verify, options.verifyRetries);
+		return f.update(addr, *data, previous.get());
+	}, control);
+}
+
+std::future<VerifyResult> FlashSession::verify(int addr, ImagePtr data, JobControl control)
+{
+	return submit([addr, data](SpiFlash &f)
+	{
+		auto readback = f.read(addr, data->size());
+		VerifyResult ret;
+		ret.mismatch = BufferUtility::mismatchExtent(readback.data(), data->data(), data->size());
+		ret.crc32c = BufferUtility::crc32c(data->data(), data->size());
+		return ret;
+	}, control);
+}
+
+void FlashSession::enqueue(std::function<void()> job)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		jobs.push_back(std::move(job));
+	}
+	cv.notify_one();
+}
+
+void FlashSession::worker(void)
+{
+	while(true)
+	{
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [this]() { return stopping or !jobs.empty(); });
+			if(jobs.empty())
+			{
+				// Only reached when stopping, so all submitted jobs have run
+				return;
+			}
+			job = std::move(jobs.front());
+			jobs.pop_front();
+		}
+		job();
+	}
+}
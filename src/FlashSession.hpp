@@ -0,0 +1,129 @@
+#ifndef FLASH_SESSION_HPP
+#define FLASH_SESSION_HPP
+
+// Asynchronous job API on top of SpiFlash
+// Each session owns one worker thread, which runs that device's jobs in the order they were submitted
+// Jobs return std::futures, so one process can drive many devices (one session each) concurrently
+// Exceptions thrown by a job (e.g. SpiFlashException) are delivered through its future
+
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+#include "SpiFlash.hpp"
+#include "ProgramJournal.hpp"
+
+// Shared flag used to cancel a job, either before it starts or part way through
+// Copies refer to the same flag
+class CancelToken
+{
+	public:
+		CancelToken() : flag(std::make_shared<std::atomic<bool>>(false)) {};
+		void cancel(void) { *flag = true; };
+		bool cancelled(void) const { return *flag; };
+		const std::atomic<bool> *get(void) const { return flag.get(); };
+
+	private:
+		std::shared_ptr<std::atomic<bool>> flag;
+};
+
+// Per job progress reporting and cancellation
+struct JobControl
+{
+	SpiFlash::ProgressCallback progress;
+	CancelToken cancel;
+};
+
+struct ProgramOptions
+{
+	std::vector<bool> skipSectors; // See SpiFlash::program
+	ProgramJournal *journal = nullptr; // Must outlive the job
+	bool verify = false; // Verify each sector as it is written. See SpiFlash::setVerify
+	int verifyRetries = 2;
+};
+
+struct VerifyResult
+{
+	// Range of differing bytes (offsets from the start of the image), if any
+	std::optional<std::pair<size_t, size_t>> mismatch;
+	uint32_t crc32c; // Of the expected image
+	bool ok(void) const { return !mismatch; };
+};
+
+// Images are shared rather than copied, as they may be large and jobs outlive the caller's stack frame
+typedef std::shared_ptr<const std::vector<uint8_t>> ImagePtr;
+
+class FlashSession
+{
+	public:
+		// spi must outlive the session
+		FlashSession(SpiInterface *spi);
+		// Waits for all submitted jobs to finish
+		~FlashSession();
+
+		std::future<std::vector<uint8_t>> readId(JobControl control = {});
+		std::future<std::vector<uint8_t>> read(int addr, int len, JobControl control = {});
+		std::future<void> program(int addr, ImagePtr data, ProgramOptions options = {}, JobControl control = {});
+		// Write with as few erases as possible. See SpiFlash::update. If previous is null the current contents are read back
+		// options.skipSectors and options.journal are not used
+		std::future<ErasePlanner::Plan> update(int addr, ImagePtr data, ImagePtr previous = nullptr, ProgramOptions options = {}, JobControl control = {});
+		std::future<VerifyResult> verify(int addr, ImagePtr data, JobControl control = {});
+
+		// Run any function of the form T f(SpiFlash &) as a job
+		template<class F> auto submit(F f, JobControl control = {}) -> std::future<std::invoke_result_t<F, SpiFlash &>>
+		{
+			typedef std::invoke_result_t<F, SpiFlash &> result_t;
+			auto task = std::make_shared<std::packaged_task<result_t()>>([this, f, control]() mutable
+			{
+				if(control.cancel.cancelled())
+				{
+					throw SpiFlashCancelled();
+				}
+				JobScope scope(flash, control);
+				return f(flash);
+			});
+			auto ret = task->get_future();
+			enqueue([task]() { (*task)(); });
+			return ret;
+		}
+
+	private:
+		// Installs a job's progress callback and cancel flag for the duration of the job
+		struct JobScope
+		{
+			JobScope(SpiFlash &flash, JobControl &control) : flash(flash)
+			{
+				flash.setProgressCallback(control.progress);
+				flash.setCancelFlag(control.cancel.get());
+			};
+			~JobScope()
+			{
+				flash.setProgressCallback(nullptr);
+				flash.setCancelFlag(nullptr);
+				flash.setJournal(nullptr);
+				flash.setVerify(false);
+			};
+			SpiFlash &flash;
+		};
+
+		void enqueue(std::function<void()> job);
+		void worker(void);
+
+		SpiFlash flash;
+
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::deque<std::function<void()>> jobs;
+		bool stopping = false;
+		std::thread thread; // Last, so everything else exists before the worker starts
+};
+
+#endif
@@ -0,0 +1,442 @@
+#include <algorithm>
+#include <iomanip>
+
+#include "FtdiEmulator.hpp"
+
+namespace
+{
+	// MPSSE opcodes, as in SpiWrapper
+	enum : uint8_t
+	{
+		DATA_TMS = 0x40,
+		DATA_IN = 0x20,
+		DATA_OUT = 0x10,
+		DATA_BITS = 0x02,
+		SETB_LOW = 0x80,
+		READB_LOW = 0x81,
+		SETB_HIGH = 0x82,
+		READB_HIGH = 0x83,
+		LOOPBACK_EN = 0x84,
+		LOOPBACK_DIS = 0x85,
+		SET_CLK_DIV = 0x86,
+		FLUSH = 0x87,
+		TCK_X5 = 0x8A,
+		TCK_D5 = 0x8B,
+		EN_3PH_CLK = 0x8C,
+		DIS_3PH_CLK = 0x8D,
+		CLK_N = 0x8E,
+		CLK_N8 = 0x8F,
+		EN_ADPT_CLK = 0x96,
+		DIS_ADPT_CLK = 0x97,
+		TRI = 0x9E,
+		BAD_COMMAND = 0xFA,
+	};
+
+	constexpr uint8_t BITMODE_MPSSE = 0x02;
+	constexpr int maxEmptyReads = 1000;
+}
+
+FtdiEmulator::FtdiEmulator(FlashEmulator *flash)
+:chips{{flash, 4, false}}
+{
+}
+
+void FtdiEmulator::attach(FlashEmulator *flash, int csPin)
+{
+	chips.push_back({flash, csPin, false});
+	updateSelects();
+}
+
+const FtdiEmulator::Stats &FtdiEmulator::stats(void)
+{
+	emuStats.simulatedUs = hostUs - statsStartUs;
+	return emuStats;
+}
+
+void FtdiEmulator::Stats::print(std::ostream &os) const
+{
+	std::ios_base::fmtflags flags(os.flags());
+	os << std::dec
+		<< writeTransfers << " USB writes (" << bytesWritten << " bytes), "
+		<< readTransfers << " USB reads (" << bytesRead << " bytes, " << emptyReads << " empty, " << latencyWaits << " latency timer waits), "
+		<< controlRequests << " control requests, "
+		<< spiBytes << " SPI bytes, "
+		<< std::fixed << std::setprecision(1) << simulatedUs/1000 << "ms simulated";
+	if(badCommands or unsupportedCommands or stalls)
+	{
+		os << ", " << badCommands << " bad commands, " << unsupportedCommands << " unsupported commands, " << stalls << " stalls";
+	}
+	os.flags(flags);
+}
+
+void FtdiEmulator::control(void)
+{
+	emuStats.controlRequests++;
+	hostUs = std::max(hostUs, busUs) + timing.controlUs;
+}
+
+void FtdiEmulator::reset(void)
+{
+	control();
+	clearBuffers();
+	mpsse = false;
+	highValue = highDirection = 0;
+	setLow(0, 0);
+	loopback = false;
+	divideBy5 = true;
+}
+
+void FtdiEmulator::purge(void)
+{
+	control();
+	clearBuffers();
+}
+
+void FtdiEmulator::clearBuffers(void)
+{
+	commands.clear();
+	commandProgress = 0;
+	txBuffer.clear();
+	flushed = false;
+	stalled = false;
+}
+
+void FtdiEmulator::setBitmode(uint8_t mode)
+{
+	control();
+	mpsse = (mode == BITMODE_MPSSE);
+}
+
+void FtdiEmulator::setLatencyTimer(uint8_t ms)
+{
+	control();
+	latencyTimer = ms;
+}
+
+uint8_t FtdiEmulator::getLatencyTimer(void)
+{
+	control();
+	return latencyTimer;
+}
+
+double FtdiEmulator::clockUs(size_t bytes) const
+{
+	double baseMHz = divideBy5 ? 12.0 : 60.0;
+	double sckMHz = baseMHz/((1 + clockDivider)*2.0);
+	return bytes*8/sckMHz;
+}
+
+double FtdiEmulator::transferUs(size_t bytes) const
+{
+	return timing.transferUs + bytes/timing.usbBytesPerUs;
+}
+
+void FtdiEmulator::setLow(uint8_t value, uint8_t direction)
+{
+	lowValue = value;
+	lowDirection = direction;
+	updateSelects();
+}
+
+void FtdiEmulator::updateSelects(void)
+{
+	for(auto &chip : chips)
+	{
+		uint8_t value = (chip.csPin < 8) ? lowValue : highValue;
+		uint8_t direction = (chip.csPin < 8) ? lowDirection : highDirection;
+		uint8_t mask = 1 << (chip.csPin % 8);
+		bool cs = (direction & mask) ? (value & mask) : true;
+		if(!cs and !chip.selected)
+		{
+			chip.flash->select();
+		} else if(cs and chip.selected) {
+			chip.flash->deselect();
+		}
+		chip.selected = !cs;
+	}
+}
+
+// Every selected chip sees the byte. MISO is pulled up, and any chip driving a 0 wins
+uint8_t FtdiEmulator::exchange(uint8_t mosi)
+{
+	uint8_t miso = 0xFF;
+	for(auto &chip : chips)
+	{
+		if(chip.selected)
+		{
+			miso &= chip.flash->exchange(mosi);
+		}
+	}
+	return miso;
+}
+
+uint8_t FtdiEmulator::pins(void) const
+{
+	// Undriven pins (including MISO) read high
+	return (lowValue & lowDirection) | (~lowDirection & 0xFF);
+}
+
+size_t FtdiEmulator::txSpace(void) const
+{
+	size_t space = timing.txBufferSize - std::min(timing.txBufferSize, txBuffer.size());
+	if(readBuf and txBuffer.empty())
+	{
+		space += readLen - readGot;
+	}
+	return space;
+}
+
+bool FtdiEmulator::push(uint8_t byte)
+{
+	if(txSpace() == 0)
+	{
+		return false;
+	}
+	if(readBuf and txBuffer.empty() and readGot < readLen)
+	{
+		readBuf[readGot++] = byte;
+	} else {
+		txBuffer.push_back(byte);
+	}
+	readyUs = deviceUs;
+	return true;
+}
+
+void FtdiEmulator::run(void)
+{
+	if(!mpsse)
+	{
+		// Not our problem what other modes do with the data
+		commands.clear();
+		return;
+	}
+
+	size_t pos = 0;
+	deviceUs = std::max(deviceUs, arrivalUs);
+	while(pos < commands.size())
+	{
+		uint8_t cmd = commands[pos];
+		size_t avail = commands.size() - pos;
+
+		if((cmd & 0x80) == 0)
+		{
+			if(cmd & (DATA_BITS | DATA_TMS))
+			{
+				size_t need = 2 + ((cmd & (DATA_OUT | DATA_TMS)) ? 1 : 0);
+				if(avail < need)
+				{
+					break;
+				}
+				emuStats.unsupportedCommands++;
+				pos += need;
+				continue;
+			}
+
+			if(avail < 3)
+			{
+				break;
+			}
+			size_t len = (commands[pos+1] | (commands[pos+2] << 8)) + 1;
+			bool out = cmd & DATA_OUT;
+			bool in = cmd & DATA_IN;
+			// Bytes are clocked as they arrive, so a command can span several USB transfers
+			while(commandProgress < len)
+			{
+				if(out and 3 + commandProgress >= avail)
+				{
+					break;
+				}
+				if(in and txSpace() == 0)
+				{
+					if(!stalled)
+					{
+						emuStats.stalls++;
+					}
+					stalled = true;
+					break;
+				}
+				stalled = false;
+				uint8_t mosi = out ? commands[pos + 3 + commandProgress] : 0xFF;
+				uint8_t miso = loopback ? mosi : exchange(mosi);
+				deviceUs += clockUs(1);
+				emuStats.spiBytes++;
+				if(in)
+				{
+					push(miso);
+				}
+				commandProgress++;
+			}
+			if(commandProgress < len)
+			{
+				break;
+			}
+			pos += 3 + (out ? len : 0);
+			commandProgress = 0;
+			continue;
+		}
+
+		size_t need = 1;
+		size_t response = 0;
+		switch(cmd)
+		{
+			case SETB_LOW: case SETB_HIGH: case SET_CLK_DIV: case CLK_N8: case TRI: need = 3; break;
+			case CLK_N: need = 2; break;
+			case READB_LOW: case READB_HIGH: response = 1; break;
+			case LOOPBACK_EN: case LOOPBACK_DIS: case FLUSH: case TCK_X5: case TCK_D5:
+			case EN_3PH_CLK: case DIS_3PH_CLK: case EN_ADPT_CLK: case DIS_ADPT_CLK: break;
+			default: response = 2; break;
+		}
+		if(avail < need)
+		{
+			break;
+		}
+		if(txSpace() < response)
+		{
+			if(!stalled)
+			{
+				emuStats.stalls++;
+			}
+			stalled = true;
+			break;
+		}
+		stalled = false;
+
+		switch(cmd)
+		{
+			case SETB_LOW: setLow(commands[pos+1], commands[pos+2]); break;
+			case SETB_HIGH: highValue = commands[pos+1]; highDirection = commands[pos+2]; updateSelects(); break;
+			case READB_LOW: push(pins()); break;
+			case READB_HIGH: push((highValue & highDirection) | (~highDirection & 0xFF)); break;
+			case LOOPBACK_EN: loopback = true; break;
+			case LOOPBACK_DIS: loopback = false; break;
+			case SET_CLK_DIV: clockDivider = commands[pos+1] | (commands[pos+2] << 8); break;
+			case FLUSH: flushed = true; break;
+			case TCK_X5: divideBy5 = false; break;
+			case TCK_D5: divideBy5 = true; break;
+			case EN_3PH_CLK: case DIS_3PH_CLK: case EN_ADPT_CLK: case DIS_ADPT_CLK: case TRI: break;
+			case CLK_N: deviceUs += clockUs(1)*(commands[pos+1] + 1)/8; break;
+			case CLK_N8: deviceUs += clockUs((commands[pos+1] | (commands[pos+2] << 8)) + 1); break;
+			default:
+				emuStats.badCommands++;
+				push(BAD_COMMAND);
+				push(cmd);
+				break;
+		}
+		pos += need;
+	}
+	commands.erase(commands.begin(), commands.begin() + pos);
+}
+
+bool FtdiEmulator::write(const uint8_t *data, size_t len)
+{
+	completeWrite(submitWrite(data, len));
+	if(commands.size() > timing.rxBufferSize)
+	{
+		// The device would NAK until the host timed out. Whatever did not fit is lost
+		commands.resize(timing.rxBufferSize);
+		return false;
+	}
+	return true;
+}
+
+double FtdiEmulator::submitWrite(const uint8_t *data, size_t len)
+{
+	emuStats.writeTransfers++;
+	emuStats.bytesWritten += len;
+	double start = std::max(hostUs, busUs);
+	busUs = start + transferUs(len);
+	arrivalUs = busUs;
+
+	commands.insert(commands.end(), data, data + len);
+	run();
+	return busUs;
+}
+
+void FtdiEmulator::completeWrite(double handle)
+{
+	hostUs = std::max(hostUs, handle);
+}
+
+int FtdiEmulator::read(uint8_t *data, size_t len)
+{
+	emuStats.readTransfers++;
+	run();
+	if(txBuffer.empty())
+	{
+		// Only the two status bytes, once the latency timer expires
+		emuStats.emptyReads++;
+		hostUs = std::max(hostUs, busUs) + latencyTimer*1000.0 + transferUs(2);
+		if(++emptyReadsInARow > maxEmptyReads)
+		{
+			return -1;
+		}
+		return 0;
+	}
+	emptyReadsInARow = 0;
+
+	size_t payload = timing.packetSize - 2;
+	double ready = readyUs;
+	if(!flushed and txBuffer.size() < payload)
+	{
+		ready += latencyTimer*1000.0;
+		emuStats.latencyWaits++;
+	}
+	size_t n = std::min(len, txBuffer.size());
+	hostUs = std::max({hostUs, busUs, ready}) + transferUs(n + 2*((n + payload - 1)/payload));
+	busUs = hostUs;
+
+	std::copy(txBuffer.begin(), txBuffer.begin() + n, data);
+	txBuffer.erase(txBuffer.begin(), txBuffer.begin() + n);
+	emuStats.bytesRead += n;
+	if(txBuffer.empty())
+	{
+		flushed = false;
+	}
+	// Space has been made, so a stalled MPSSE can carry on
+	arrivalUs = hostUs;
+	run();
+	return n;
+}
+
+void FtdiEmulator::submitRead(uint8_t *data, size_t len)
+{
+	readBuf = data;
+	readLen = len;
+	readGot = 0;
+
+	// Anything already waiting comes first
+	size_t n = std::min(len, txBuffer.size());
+	std::copy(txBuffer.begin(), txBuffer.begin() + n, data);
+	txBuffer.erase(txBuffer.begin(), txBuffer.begin() + n);
+	readGot = n;
+	run();
+}
+
+int FtdiEmulator::completeRead(void)
+{
+	run();
+	size_t payload = timing.packetSize - 2;
+	size_t transfers = std::max<size_t>(1, (readGot + timing.txBufferSize - 1)/timing.txBufferSize);
+	emuStats.readTransfers += transfers;
+	emuStats.bytesRead += readGot;
+
+	double ready = readyUs;
+	if(!flushed and (readGot % payload) != 0)
+	{
+		// The last partial packet waits for the latency timer
+		ready += latencyTimer*1000.0;
+		emuStats.latencyWaits++;
+	}
+	// Earlier packets were moved while the MPSSE was still running, so only the last one adds to the time
+	hostUs = std::max({hostUs, busUs, ready}) + transferUs(std::min(readGot, payload) + 2);
+	busUs = hostUs;
+	if(txBuffer.empty())
+	{
+		flushed = false;
+	}
+
+	int ret = readGot;
+	readBuf = nullptr;
+	readLen = readGot = 0;
+	return ret;
+}
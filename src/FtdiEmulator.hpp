@@ -0,0 +1,142 @@
+#ifndef FTDI_EMULATOR_HPP
+#define FTDI_EMULATOR_HPP
+
+// Software model of one channel of an FT2232H in MPSSE mode, with an emulated flash attached
+// Pinout is as used by SpiWrapper: SCK ADBUS0, MOSI ADBUS1, MISO ADBUS2, CS ADBUS4 (pulled up when not driven)
+// More flash chips can be attached with their chip selects on other ADBUS or ACBUS pins
+//
+// The MPSSE command stream is interpreted as the chip would, including commands split across USB transfers,
+// invalid commands (answered with 0xFA and the command) and loopback. Bit mode and TMS shifts are not supported,
+// and are skipped and counted
+//
+// USB behaviour is modelled closely enough to find bugs and compare strategies:
+//   - Responses are held in a transmit buffer until read. If it fills with no read outstanding, the MPSSE stalls,
+//     and once the receive buffer is also full writes time out, as on the real chip
+//   - A blocking read gets data once a packet's worth is ready, after MC_FLUSH, or otherwise when the latency timer expires
+//   - Simulated time advances with USB transfers, control requests, SPI clocking and latency timer waits
+// Real hardware would keep returning empty reads when no response is coming. After many in a row, read() reports an
+// error instead, so that a bug does not hang a test
+
+#include <vector>
+#include <deque>
+#include <ostream>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "FlashEmulator.hpp"
+
+class FtdiEmulator
+{
+	public:
+		// Rough FT2232H on a high speed USB bus
+		struct Timing
+		{
+			double usbBytesPerUs = 35; // Bulk transfer throughput
+			double transferUs = 125; // Per bulk transfer (one microframe)
+			double controlUs = 250; // Per control request (reset, latency timer etc.)
+			size_t packetSize = 512; // Bulk in packets carry two status bytes each
+			size_t txBufferSize = 4096; // Device to host
+			size_t rxBufferSize = 4096; // Host to device
+		};
+
+		struct Stats
+		{
+			uint64_t writeTransfers = 0;
+			uint64_t readTransfers = 0;
+			uint64_t emptyReads = 0; // Reads which returned no data
+			uint64_t controlRequests = 0;
+			uint64_t bytesWritten = 0;
+			uint64_t bytesRead = 0;
+			uint64_t spiBytes = 0;
+			uint64_t latencyWaits = 0; // Reads which waited for the latency timer
+			uint64_t badCommands = 0;
+			uint64_t unsupportedCommands = 0;
+			uint64_t stalls = 0; // Times the MPSSE stopped because the transmit buffer was full
+			double simulatedUs = 0;
+
+			void print(std::ostream &os) const;
+		};
+
+		// flash must outlive the emulator
+		FtdiEmulator(FlashEmulator *flash);
+		// Another flash on the same bus, selected by csPin (4-7 for ADBUS4-7, 8-15 for ACBUS0-7)
+		void attach(FlashEmulator *flash, int csPin);
+
+		void setTiming(const Timing &t) { timing = t; };
+		const Stats &stats(void);
+		void resetStats(void) { emuStats = Stats(); statsStartUs = hostUs; };
+
+		// Control requests
+		void reset(void); // Leaves MPSSE mode, and clears both buffers
+		void purge(void);
+		void setBitmode(uint8_t mode);
+		void setLatencyTimer(uint8_t ms);
+		uint8_t getLatencyTimer(void);
+		bool inMpsse(void) const { return mpsse; };
+
+		// Blocking bulk transfers
+		// write returns false if the device could not take all the data, because the MPSSE is stalled
+		bool write(const uint8_t *data, size_t len);
+		// Returns the number of bytes read, which is 0 if none were ready, or -1 if none ever will be
+		int read(uint8_t *data, size_t len);
+
+		// Asynchronous bulk transfers. Only one read may be outstanding
+		// Writes are taken immediately, and return a handle to pass to completeWrite
+		double submitWrite(const uint8_t *data, size_t len);
+		void completeWrite(double handle);
+		// Responses go straight into data as they are produced. Returns bytes received
+		void submitRead(uint8_t *data, size_t len);
+		int completeRead(void);
+
+	private:
+		void run(void);
+		bool push(uint8_t byte);
+		size_t txSpace(void) const;
+		void setLow(uint8_t value, uint8_t direction);
+		void updateSelects(void);
+		uint8_t exchange(uint8_t mosi);
+		uint8_t pins(void) const;
+		double clockUs(size_t bytes) const;
+		double transferUs(size_t bytes) const;
+		void control(void);
+		void clearBuffers(void);
+
+		struct Chip
+		{
+			FlashEmulator *flash;
+			int csPin;
+			bool selected;
+		};
+		std::vector<Chip> chips;
+		Timing timing;
+		Stats emuStats;
+
+		// Simulated time: when the host is free, when the bus is free, and when the MPSSE has executed everything so far
+		double hostUs = 0;
+		double busUs = 0;
+		double deviceUs = 0;
+		double arrivalUs = 0; // When the data being executed reached the device
+		double statsStartUs = 0;
+
+		bool mpsse = false;
+		uint8_t latencyTimer = 16;
+		uint8_t lowValue = 0, lowDirection = 0;
+		uint8_t highValue = 0, highDirection = 0;
+		uint16_t clockDivider = 0;
+		bool divideBy5 = true;
+		bool loopback = false;
+
+		std::vector<uint8_t> commands; // Received but not yet executed
+		size_t commandProgress = 0; // Bytes already clocked of the data command at the front
+		std::deque<uint8_t> txBuffer;
+		double readyUs = 0; // When the last byte in txBuffer was produced
+		bool flushed = false; // MC_FLUSH since txBuffer was last empty
+		bool stalled = false;
+		int emptyReadsInARow = 0;
+
+		uint8_t *readBuf = nullptr;
+		size_t readLen = 0;
+		size_t readGot = 0;
+};
+
+#endif
@@ -0,0 +1,246 @@
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+
+#include "FtdiTuner.hpp"
+#include "FileUtility.h"
+#include "BufferUtility.h"
+
+static const std::string profileMagic = "spi_prog ftdi profile v1";
+
+static std::string profileFilename(std::string identity)
+{
+	return FileUtility::cacheDir() + "/" + FileUtility::sanitiseFilename(identity) + ".profile";
+}
+
+static double sckFrequency(uint16_t divider)
+{
+	return 12e6 / ((1 + static_cast<double>(divider)) * 2.0);
+}
+
+void FtdiProfile::apply(SpiWrapper &ftdi) const
+{
+	ftdi.setClockDivider(clockDivider);
+	ftdi.setLatencyTimer(latencyTimer);
+	ftdi.setWriteChunkSize(writeChunkSize);
+	ftdi.setQueueDepth(queueDepth);
+}
+
+std::optional<FtdiProfile> FtdiProfile::load(std::string identity)
+{
+	std::string filename = profileFilename(identity);
+	std::ifstream is(filename);
+	if(!is)
+	{
+		return std::nullopt;
+	}
+
+	std::string line;
+	if(!std::getline(is, line) or line != profileMagic)
+	{
+		throw FtdiTunerException("Corrupt profile file: " + filename);
+	}
+
+	FtdiProfile ret{};
+	int found = 0;
+	std::string name;
+	while(is >> name)
+	{
+		if(name == "divider") { unsigned int v; is >> v; ret.clockDivider = v; found++; }
+		else if(name == "latency") { is >> ret.latencyTimer; found++; }
+		else if(name == "chunksize") { is >> ret.writeChunkSize; found++; }
+		else if(name == "queuedepth") { is >> ret.queueDepth; found++; }
+		else if(name == "throughput") { is >> ret.bytesPerSecond; }
+		else { std::getline(is, line); } // Ignore anything added by later versions
+	}
+	if(found != 4 or ret.latencyTimer < 1 or ret.latencyTimer > 255 or ret.writeChunkSize == 0 or ret.queueDepth == 0)
+	{
+		throw FtdiTunerException("Corrupt profile file: " + filename);
+	}
+	return ret;
+}
+
+void FtdiProfile::save(std::string identity) const
+{
+	// Write to a temporary file then rename, so the profile is never left half written
+	std::string filename = profileFilename(identity);
+	std::string tmpName = filename + ".tmp";
+	{
+		std::ofstream os(tmpName, std::ios::out | std::ios::trunc);
+		os << profileMagic << "\n"
+			<< "divider " << clockDivider << "\n"
+			<< "latency " << latencyTimer << "\n"
+			<< "chunksize " << writeChunkSize << "\n"
+			<< "queuedepth " << queueDepth << "\n"
+			<< "throughput " << bytesPerSecond << "\n";
+		if(!os.flush())
+		{
+			throw FtdiTunerException("Could not write profile file: " + tmpName);
+		}
+	}
+	if(std::rename(tmpName.c_str(), filename.c_str()) != 0)
+	{
+		throw FtdiTunerException("Could not replace profile file: " + filename);
+	}
+}
+
+FtdiTuner::FtdiTuner(SpiWrapper *ftdi, SpiInterface *spi, int addr, int len)
+:ftdi(ftdi), spi(spi), addr(addr), len(len)
+{
+}
+
+FtdiProfile FtdiTuner::tune(void)
+{
+	// Establish what correct data looks like
+	ftdi->setClockDivider(referenceDivider);
+	refId = readId();
+	if(std::all_of(refId.begin(), refId.end(), [](uint8_t b) { return b == 0x00; }) or
+		std::all_of(refId.begin(), refId.end(), [](uint8_t b) { return b == 0xFF; }))
+	{
+		throw FtdiTunerException("No flash responding at reference speed");
+	}
+	auto ref = readRegion();
+	if(readRegion() != ref)
+	{
+		throw FtdiTunerException("Reads are inconsistent even at reference speed");
+	}
+	if(BufferUtility::isBlank(ref.data(), ref.size()))
+	{
+		std::cerr << "Warning. Tuning region is blank, so corruption to 0xFF would not be detected" << std::endl;
+	}
+	refCrc = BufferUtility::crc32c(ref.data(), ref.size());
+
+	// Fastest divider that passes. Reliability is assumed to improve monotonically as the clock slows
+	std::cout << "Searching for fastest reliable SPI clock" << std::endl;
+	uint16_t lo = 0, hi = referenceDivider;
+	while(lo < hi)
+	{
+		uint16_t mid = (lo + hi)/2;
+		bool ok = reliable(mid);
+		std::cout << "  " << sckFrequency(mid)/1e6 << "MHz: " << (ok ? "pass" : "FAIL") << std::endl;
+		if(ok)
+		{
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	// Confirm with a longer run, backing off if it is marginal
+	uint16_t divider = hi;
+	auto confirmed = [&](uint16_t d)
+	{
+		for(int i=0; i<4; i++)
+		{
+			if(!reliable(d))
+			{
+				return false;
+			}
+		}
+		return true;
+	};
+	while(divider < referenceDivider and !confirmed(divider))
+	{
+		std::cout << "  " << sckFrequency(divider)/1e6 << "MHz: marginal" << std::endl;
+		divider++;
+	}
+	ftdi->setClockDivider(divider);
+	std::cout << "Using " << sckFrequency(divider)/1e6 << "MHz (divider " << divider << ")" << std::endl;
+
+	// USB settings, one at a time
+	FtdiProfile best{divider, ftdi->getLatencyTimer(), ftdi->getWriteChunkSize(), ftdi->getQueueDepth(), measure()};
+	auto tryValues = [&](const char *name, auto values, auto set, auto &bestValue)
+	{
+		for(auto value : values)
+		{
+			set(value);
+			double rate = measure();
+			std::cout << "  " << std::setw(10) << std::left << name << std::setw(6) << value << std::right << ": "
+				<< (rate ? std::to_string(static_cast<int>(rate/1024)) + "KB/s" : "FAIL") << std::endl;
+			if(rate > best.bytesPerSecond)
+			{
+				best.bytesPerSecond = rate;
+				bestValue = value;
+			}
+		}
+		set(bestValue);
+	};
+	std::cout << "Measuring read throughput" << std::endl;
+	tryValues("chunksize", std::vector<size_t>{512, 1024, 4096, 16384, 65536},
+		[&](size_t v) { ftdi->setWriteChunkSize(v); }, best.writeChunkSize);
+	tryValues("latency", std::vector<unsigned int>{1, 2, 4, 8, 16},
+		[&](unsigned int v) { ftdi->setLatencyTimer(v); }, best.latencyTimer);
+	tryValues("queue", std::vector<unsigned int>{1, 2, 4, 8},
+		[&](unsigned int v) { ftdi->setQueueDepth(v); }, best.queueDepth);
+
+	if(best.bytesPerSecond == 0)
+	{
+		throw FtdiTunerException("Reads failed with every USB setting");
+	}
+	return best;
+}
+
+std::vector<uint8_t> FtdiTuner::readId(void)
+{
+	spi->setCs(false);
+	auto result = spi->transfer({0x9F, 0xFF, 0xFF, 0xFF});
+	spi->setCs(true);
+	return std::vector<uint8_t>(result.begin()+1, result.end());
+}
+
+std::vector<uint8_t> FtdiTuner::readRegion(void)
+{
+	std::vector<uint8_t> ret;
+	ret.reserve(len);
+	constexpr int chunkSize = 64*1024;
+	for(int offset = 0; offset < len; offset += chunkSize)
+	{
+		int chunkAddr = addr + offset;
+		spi->setCs(false);
+		spi->send({0x03, static_cast<uint8_t>(chunkAddr >> 16), static_cast<uint8_t>(chunkAddr >> 8), static_cast<uint8_t>(chunkAddr)});
+		auto chunk = spi->receive(std::min(chunkSize, len - offset));
+		spi->setCs(true);
+		ret.insert(ret.end(), chunk.begin(), chunk.end());
+	}
+	return ret;
+}
+
+bool FtdiTuner::reliable(uint16_t divider)
+{
+	ftdi->setClockDivider(divider);
+	for(int i=0; i<8; i++)
+	{
+		if(readId() != refId)
+		{
+			return false;
+		}
+	}
+	for(int i=0; i<2; i++)
+	{
+		auto data = readRegion();
+		if(BufferUtility::crc32c(data.data(), data.size()) != refCrc)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+double FtdiTuner::measure(void)
+{
+	constexpr int passes = 3;
+	auto start = std::chrono::steady_clock::now();
+	for(int i=0; i<passes; i++)
+	{
+		auto data = readRegion();
+		if(BufferUtility::crc32c(data.data(), data.size()) != refCrc)
+		{
+			return 0;
+		}
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return passes * len / elapsed.count();
+}
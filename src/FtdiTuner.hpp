@@ -0,0 +1,74 @@
+#ifndef FTDI_TUNER_HPP
+#define FTDI_TUNER_HPP
+
+// Finds the fastest reliable settings for a particular FTDI programmer and the board it is wired to
+//
+// The clock divider is binary searched between a slow reference speed and the maximum
+// At each step the JEDEC ID and a region of flash are read repeatedly, and must match what was read at the reference speed
+// The fastest divider which passed is then confirmed with a longer run, and slowed a step at a time until that passes
+// The USB write chunk size, latency timer and queue depth are then chosen in turn, by read throughput
+//
+// Only reads are used, so the flash contents are never changed
+// Commands are sent directly rather than via SpiFlash, so a corrupted busy bit can't cause a hang
+
+#include <string>
+#include <optional>
+#include <vector>
+#include <stdexcept>
+#include <stdint.h>
+
+#include "SpiWrapper.hpp"
+
+class FtdiTunerException : public std::runtime_error
+{
+	using std::runtime_error::runtime_error;
+};
+
+// Tuned settings, saved to FileUtility::cacheDir() keyed by the programmer identity
+//
+// File format is text:
+//   spi_prog ftdi profile v1
+//   Then one <name> <value> line per setting
+struct FtdiProfile
+{
+	uint16_t clockDivider;
+	unsigned int latencyTimer;
+	size_t writeChunkSize;
+	unsigned int queueDepth;
+	double bytesPerSecond; // Read throughput measured with these settings
+
+	void apply(SpiWrapper &ftdi) const;
+
+	static std::optional<FtdiProfile> load(std::string identity);
+	void save(std::string identity) const;
+};
+
+class FtdiTuner
+{
+	public:
+		// spi is normally ftdi itself, but may be a recorder wrapping it
+		// The region [addr, addr+len) is read to check integrity and measure throughput. It should not be blank
+		FtdiTuner(SpiWrapper *ftdi, SpiInterface *spi, int addr = 0, int len = 64*1024);
+
+		FtdiProfile tune(void);
+
+		// Slowest divider tried. Results are compared against reads made at this speed
+		static constexpr uint16_t referenceDivider = 11; // 500kHz
+
+	private:
+		std::vector<uint8_t> readId(void);
+		std::vector<uint8_t> readRegion(void);
+		bool reliable(uint16_t divider);
+		// Read throughput in bytes/second, or 0 if the data was not correct
+		double measure(void);
+
+		SpiWrapper *ftdi;
+		SpiInterface *spi;
+		int addr;
+		int len;
+
+		std::vector<uint8_t> refId;
+		uint32_t refCrc;
+};
+
+#endif
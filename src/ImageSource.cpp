@@ -0,0 +1,352 @@
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <climits>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+#ifdef SPI_PROG_ZSTD
+#include <zstd.h>
+#endif
+
+#include "ImageSource.hpp"
+#include "Timeline.hpp"
+
+namespace
+{
+	// gzip decompression, via zlib's gz* functions (which also handle concatenated members)
+	class GzipSource final : public ImageSource
+	{
+		public:
+			GzipSource(std::string filename)
+			:filename(filename)
+			{
+				// The last 4 bytes hold the size (mod 4GB) of the last member, which is usually the only one
+				// Deflate can't compress by more than about 1032:1, so a larger size is from something else
+				int fd = ::open(filename.c_str(), O_RDONLY);
+				struct stat st;
+				uint8_t trailer[4];
+				if(fd >= 0 and fstat(fd, &st) == 0 and st.st_size >= 18 and pread(fd, trailer, 4, st.st_size - 4) == 4)
+				{
+					size_t isize = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | (static_cast<size_t>(trailer[3]) << 24);
+					if(isize <= static_cast<size_t>(st.st_size)*1032)
+					{
+						sizeHint = isize;
+					}
+				}
+				if(fd >= 0)
+				{
+					close(fd);
+				}
+
+				file = gzopen(filename.c_str(), "rb");
+				if(!file)
+				{
+					throw ImageSourceException("Could not open " + filename + ": " + strerror(errno));
+				}
+				gzbuffer(file, 256*1024);
+			};
+			~GzipSource() { gzclose(file); };
+
+			size_t read(uint8_t *dest, size_t len) override
+			{
+				Timeline::Span span("decompress", "file");
+				size_t got = 0;
+				while(got < len)
+				{
+					int rc = gzread(file, dest + got, std::min<size_t>(len - got, INT_MAX));
+					if(rc <= 0)
+					{
+						// 0 is either the end, or a truncated file
+						int err;
+						const char *msg = gzerror(file, &err);
+						if(rc < 0 or err != Z_OK)
+						{
+							throw ImageSourceException("Could not decompress " + filename + ": " + msg);
+						}
+						break;
+					}
+					got += rc;
+				}
+				span.arg("bytes", got);
+				return got;
+			};
+
+			std::optional<size_t> size(void) const override { return sizeHint; };
+
+		private:
+			std::string filename;
+			gzFile file;
+			std::optional<size_t> sizeHint;
+	};
+
+#ifdef SPI_PROG_ZSTD
+	// zstd decompression, of one or more frames
+	class ZstdSource final : public ImageSource
+	{
+		public:
+			ZstdSource(std::string filename)
+			:filename(filename), inBuf(ZSTD_DStreamInSize())
+			{
+				file = fopen(filename.c_str(), "rb");
+				if(!file)
+				{
+					throw ImageSourceException("Could not open " + filename + ": " + strerror(errno));
+				}
+				dctx = ZSTD_createDCtx();
+
+				// The first frame's header may give its size
+				in.src = inBuf.data();
+				in.size = fread(inBuf.data(), 1, inBuf.size(), file);
+				in.pos = 0;
+				unsigned long long frameSize = ZSTD_getFrameContentSize(inBuf.data(), in.size);
+				if(frameSize != ZSTD_CONTENTSIZE_UNKNOWN and frameSize != ZSTD_CONTENTSIZE_ERROR)
+				{
+					sizeHint = frameSize;
+				}
+			};
+			~ZstdSource()
+			{
+				ZSTD_freeDCtx(dctx);
+				fclose(file);
+			};
+
+			size_t read(uint8_t *dest, size_t len) override
+			{
+				Timeline::Span span("decompress", "file");
+				ZSTD_outBuffer out = {dest, len, 0};
+				while(out.pos < out.size)
+				{
+					if(in.pos == in.size and !inputDone)
+					{
+						in.size = fread(inBuf.data(), 1, inBuf.size(), file);
+						in.pos = 0;
+						if(ferror(file))
+						{
+							throw ImageSourceException("Could not read " + filename + ": " + strerror(errno));
+						}
+						inputDone = (in.size == 0);
+					}
+					// Once the input is used up, this flushes anything the decoder still holds
+					size_t before = out.pos;
+					size_t rc = ZSTD_decompressStream(dctx, &out, &in);
+					if(ZSTD_isError(rc))
+					{
+						throw ImageSourceException("Could not decompress " + filename + ": " + ZSTD_getErrorName(rc));
+					}
+					frameDone = (rc == 0);
+					if(inputDone and out.pos == before)
+					{
+						if(!frameDone)
+						{
+							throw ImageSourceException("Could not decompress " + filename + ": unexpected end of file");
+						}
+						break;
+					}
+				}
+				span.arg("bytes", out.pos);
+				return out.pos;
+			};
+
+			std::optional<size_t> size(void) const override { return sizeHint; };
+
+		private:
+			std::string filename;
+			FILE *file;
+			ZSTD_DCtx *dctx;
+			std::vector<uint8_t> inBuf;
+			ZSTD_inBuffer in;
+			bool inputDone = false;
+			bool frameDone = true;
+			std::optional<size_t> sizeHint;
+	};
+#endif
+}
+
+ImageFormat ImageSource::detect(const std::string &filename)
+{
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if(fd < 0)
+	{
+		throw ImageSourceException("Could not open " + filename + ": " + strerror(errno));
+	}
+	uint8_t magic[4] = {};
+	ssize_t got = pread(fd, magic, sizeof(magic), 0);
+	close(fd);
+
+	if(got >= 2 and magic[0] == 0x1F and magic[1] == 0x8B)
+	{
+		return ImageFormat::gzip;
+	} else if(got == 4 and magic[0] == 0x28 and magic[1] == 0xB5 and magic[2] == 0x2F and magic[3] == 0xFD) {
+		return ImageFormat::zstd;
+	}
+	return ImageFormat::raw;
+}
+
+std::unique_ptr<ImageSource> ImageSource::open(const std::string &filename, bool prefetch)
+{
+	std::unique_ptr<ImageSource> source;
+	switch(detect(filename))
+	{
+		case ImageFormat::raw:
+			// Reading is already overlapped by the kernel's readahead
+			return std::make_unique<FileSource>(filename);
+		case ImageFormat::gzip:
+			source = std::make_unique<GzipSource>(filename);
+			break;
+		case ImageFormat::zstd:
+#ifdef SPI_PROG_ZSTD
+			source = std::make_unique<ZstdSource>(filename);
+			break;
+#else
+			throw ImageSourceException(filename + " is zstd compressed, but spi_prog was built without zstd support");
+#endif
+	}
+	if(prefetch)
+	{
+		source = std::make_unique<PrefetchSource>(std::move(source));
+	}
+	return source;
+}
+
+FileSource::FileSource(std::string filename)
+:filename(filename)
+{
+	fd = ::open(filename.c_str(), O_RDONLY);
+	if(fd < 0)
+	{
+		throw ImageSourceException("Could not open " + filename + ": " + strerror(errno));
+	}
+	struct stat st;
+	if(fstat(fd, &st) != 0)
+	{
+		int err = errno;
+		close(fd);
+		throw ImageSourceException("Could not stat " + filename + ": " + strerror(err));
+	}
+	fileSize = st.st_size;
+	// The whole file is read once, front to back
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+FileSource::~FileSource()
+{
+	close(fd);
+}
+
+size_t FileSource::read(uint8_t *dest, size_t len)
+{
+	Timeline::Span span("read file", "file");
+	size_t got = 0;
+	while(got < len)
+	{
+		ssize_t rc = ::read(fd, dest + got, len - got);
+		if(rc < 0 and errno == EINTR)
+		{
+			continue;
+		} else if(rc < 0) {
+			throw ImageSourceException("Could not read " + filename + ": " + strerror(errno));
+		} else if(rc == 0) {
+			break;
+		}
+		got += rc;
+	}
+	span.arg("bytes", got);
+	return got;
+}
+
+PrefetchSource::PrefetchSource(std::unique_ptr<ImageSource> source, size_t chunkSize, size_t depth)
+:source(std::move(source)), sourceSize(this->source->size()), chunkSize(chunkSize), ring(std::max<size_t>(depth, 1))
+{
+	worker = std::thread(&PrefetchSource::run, this);
+}
+
+PrefetchSource::~PrefetchSource()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	cv.notify_all();
+	worker.join();
+}
+
+void PrefetchSource::run(void)
+{
+	while(true)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [this] { return stopping or filled < ring.size(); });
+		if(stopping)
+		{
+			return;
+		}
+		// Only this thread touches ring[head] until filled is increased
+		Chunk &chunk = ring[head];
+		lock.unlock();
+
+		bool last;
+		try
+		{
+			chunk.data.resize(chunkSize);
+			chunk.len = source->read(chunk.data.data(), chunkSize);
+			last = chunk.len < chunkSize;
+		} catch (...) {
+			chunk.len = 0;
+			error = std::current_exception();
+			last = true;
+		}
+
+		lock.lock();
+		head = (head + 1) % ring.size();
+		filled++;
+		finished = last;
+		lock.unlock();
+		cv.notify_all();
+		if(last)
+		{
+			return;
+		}
+	}
+}
+
+size_t PrefetchSource::read(uint8_t *dest, size_t len)
+{
+	size_t got = 0;
+	std::unique_lock<std::mutex> lock(mutex);
+	while(got < len)
+	{
+		cv.wait(lock, [this] { return filled > 0; });
+		Chunk &chunk = ring[tail];
+		size_t n = std::min(len - got, chunk.len - readPos);
+		// The chunk stays ours until filled is decreased, so the copy can be done without the lock
+		lock.unlock();
+		std::memcpy(dest + got, chunk.data.data() + readPos, n);
+		lock.lock();
+		got += n;
+		readPos += n;
+
+		if(readPos == chunk.len)
+		{
+			bool last = finished and filled == 1;
+			if(last and chunk.len < chunkSize)
+			{
+				// Leave the last chunk in place, so later reads also find the end (or the error)
+				if(error)
+				{
+					std::rethrow_exception(error);
+				}
+				break;
+			}
+			readPos = 0;
+			tail = (tail + 1) % ring.size();
+			filled--;
+			cv.notify_all();
+		}
+	}
+	return got;
+}
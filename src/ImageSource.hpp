@@ -0,0 +1,107 @@
+#ifndef IMAGE_SOURCE_HPP
+#define IMAGE_SOURCE_HPP
+
+// Where image bytes come from, read a chunk at a time
+// Used with ImageTransform to load and transform an image in one pass, without a temporary copy of the whole file
+// Images may be gzip compressed, or zstd compressed if built with libzstd (SPI_PROG_ZSTD)
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <stdint.h>
+#include <stddef.h>
+
+class ImageSourceException : public std::runtime_error
+{
+	using std::runtime_error::runtime_error;
+};
+
+enum class ImageFormat
+{
+	raw,
+	gzip,
+	zstd
+};
+
+class ImageSource
+{
+	public:
+		virtual ~ImageSource() {};
+
+		// Copy up to len bytes to dest. Returns fewer than len only at the end of the image
+		virtual size_t read(uint8_t *dest, size_t len) = 0;
+		// Total bytes, if known before reading, so the image can be allocated once
+		// For compressed images this comes from the file's header or trailer, so is only a guide
+		virtual std::optional<size_t> size(void) const = 0;
+
+		// Found from the magic number at the start of the file
+		static ImageFormat detect(const std::string &filename);
+		// A source for whatever format filename is in
+		// With prefetch, compressed images are decompressed ahead of the reader on a background thread (see PrefetchSource)
+		static std::unique_ptr<ImageSource> open(const std::string &filename, bool prefetch = true);
+};
+
+// A plain file
+class FileSource final : public ImageSource
+{
+	public:
+		FileSource(std::string filename);
+		~FileSource();
+
+		size_t read(uint8_t *dest, size_t len) override;
+		std::optional<size_t> size(void) const override { return fileSize; };
+
+	private:
+		std::string filename;
+		int fd;
+		size_t fileSize;
+};
+
+// Runs another source on a background thread, keeping a bounded ring of chunks filled ahead of the reader
+// The reader only waits when it catches up, so (for example) decompression overlaps with whatever consumes the image,
+// and memory use is bounded by depth chunks however far ahead the source could get
+class PrefetchSource final : public ImageSource
+{
+	public:
+		PrefetchSource(std::unique_ptr<ImageSource> source, size_t chunkSize = 1024*1024, size_t depth = 4);
+		// Stops the background thread, even if the source has not been read to the end
+		~PrefetchSource();
+
+		// Errors from the source are thrown here, once the chunks before them have been read
+		size_t read(uint8_t *dest, size_t len) override;
+		std::optional<size_t> size(void) const override { return sourceSize; };
+
+	private:
+		struct Chunk
+		{
+			std::vector<uint8_t> data;
+			size_t len = 0;
+		};
+
+		void run(void);
+
+		std::unique_ptr<ImageSource> source;
+		std::optional<size_t> sourceSize;
+		const size_t chunkSize;
+
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::vector<Chunk> ring;
+		size_t head = 0; // Next chunk to fill
+		size_t tail = 0; // Chunk being read
+		size_t filled = 0; // Chunks ready to read
+		size_t readPos = 0; // Position in ring[tail]
+		bool finished = false; // The source has nothing more
+		bool stopping = false;
+		std::exception_ptr error;
+
+		std::thread worker; // Started last, once everything it uses is constructed
+};
+
+#endif
@@ -0,0 +1,209 @@
+#include <algorithm>
+#include <limits>
+#include <sstream>
+
+#include "ImageTransform.hpp"
+#include "ByteSwapUtility.h"
+#include "FileUtility.h"
+#include "ParseUtility.h"
+#include "Timeline.hpp"
+
+namespace
+{
+	// Every chunk boundary is aligned to the largest word size, so no word is split between chunks
+	constexpr size_t wordAlign = 8;
+
+	std::vector<std::string> split(const std::string &str, char delim)
+	{
+		std::vector<std::string> parts;
+		std::istringstream ss(str);
+		std::string part;
+		while(std::getline(ss, part, delim))
+		{
+			parts.push_back(part);
+		}
+		return parts;
+	}
+
+	std::vector<uint8_t> parsePattern(const std::string &str)
+	{
+		std::string lower = ParseUtility::toLower(str);
+		if(lower.size() < 4 or lower.substr(0, 2) != "0x" or (lower.size() % 2) != 0
+			or lower.find_first_not_of("0123456789abcdef", 2) != std::string::npos)
+		{
+			throw ImageTransformException("Invalid pattern: " + str + ". Use whole bytes in hex, e.g. 0xFF");
+		}
+		std::vector<uint8_t> pattern;
+		for(size_t i = 2; i < lower.size(); i += 2)
+		{
+			pattern.push_back(std::stoi(lower.substr(i, 2), nullptr, 16));
+		}
+		return pattern;
+	}
+}
+
+size_t ImageTransform::wordSize(StepType type)
+{
+	switch(type)
+	{
+		case StepType::bswap16: return 2;
+		case StepType::bswap32: return 4;
+		case StepType::bswap64: return 8;
+		default: return 1;
+	}
+}
+
+ImageTransform::ImageTransform(const std::string &spec)
+{
+	for(const auto &stepStr : split(spec, ','))
+	{
+		auto args = split(stepStr, ':');
+		std::string name = args.empty() ? "" : ParseUtility::toLower(args[0]);
+		if(name == "bitrev" and args.size() == 1)
+		{
+			steps.push_back({StepType::bitrev, {}, 0});
+		} else if(name == "bswap16" and args.size() == 1) {
+			steps.push_back({StepType::bswap16, {}, 0});
+		} else if(name == "bswap32" and args.size() == 1) {
+			steps.push_back({StepType::bswap32, {}, 0});
+		} else if(name == "bswap64" and args.size() == 1) {
+			steps.push_back({StepType::bswap64, {}, 0});
+		} else if((name == "pad" or name == "fill") and args.size() == 3) {
+			auto size = ParseUtility::parseSize(args[2]);
+			if(!size or *size == 0)
+			{
+				throw ImageTransformException("Invalid size in transform step: " + stepStr);
+			}
+			steps.push_back({(name == "pad") ? StepType::pad : StepType::fill, parsePattern(args[1]), *size});
+		} else {
+			throw ImageTransformException("Invalid transform step: " + stepStr);
+		}
+	}
+}
+
+std::vector<size_t> ImageTransform::stepSizes(size_t sourceSize) const
+{
+	std::vector<size_t> sizes = {sourceSize};
+	for(const auto &step : steps)
+	{
+		size_t size = sizes.back();
+		size_t word = wordSize(step.type);
+		if(step.type == StepType::pad)
+		{
+			size = ((size + step.size - 1)/step.size)*step.size;
+		} else if(step.type == StepType::fill) {
+			if(size > step.size)
+			{
+				throw ImageTransformException("Image is " + std::to_string(size) + " bytes, more than the fill size of " + std::to_string(step.size));
+			}
+			size = step.size;
+		} else if(size % word) {
+			throw ImageTransformException("Image is " + std::to_string(size) + " bytes, which is not a whole number of "
+				+ std::to_string(word) + " byte words. Pad it first");
+		}
+		sizes.push_back(size);
+	}
+	return sizes;
+}
+
+size_t ImageTransform::transformedSize(size_t sourceSize) const
+{
+	return stepSizes(sourceSize).back();
+}
+
+void ImageTransform::process(uint8_t *image, size_t start, size_t end, const std::vector<size_t> &sizes) const
+{
+	Timeline::Span span("transform", "file");
+	span.arg("bytes", end - start);
+	for(size_t i = 0; i < steps.size(); i++)
+	{
+		const Step &step = steps[i];
+		if(step.type == StepType::pad or step.type == StepType::fill)
+		{
+			// This step creates [sizes[i], sizes[i+1])
+			size_t from = std::max(start, sizes[i]);
+			size_t to = std::min(end, sizes[i+1]);
+			for(size_t pos = from; pos < to; pos++)
+			{
+				image[pos] = step.pattern[pos % step.pattern.size()];
+			}
+			continue;
+		}
+
+		// Other steps cover the image as it was when they were reached
+		size_t to = std::min(end, sizes[i]);
+		if(to <= start)
+		{
+			continue;
+		}
+		uint8_t *data = image + start;
+		size_t len = to - start;
+		switch(step.type)
+		{
+			case StepType::bitrev: ByteSwapUtility::reverseBits(data, data, len); break;
+			case StepType::bswap16: ByteSwapUtility::swap16(data, data, len/2); break;
+			case StepType::bswap32: ByteSwapUtility::swap32(data, data, len/4); break;
+			case StepType::bswap64: ByteSwapUtility::swap64(data, data, len/8); break;
+			default: break;
+		}
+	}
+}
+
+void ImageTransform::finish(std::vector<uint8_t> &image, size_t done, size_t chunkSize) const
+{
+	auto sizes = stepSizes(image.size());
+	image.resize(sizes.back());
+	for(size_t start = done; start < image.size(); start += chunkSize)
+	{
+		process(image.data(), start, std::min(image.size(), start + chunkSize), sizes);
+	}
+}
+
+std::vector<uint8_t> ImageTransform::load(ImageSource &source, size_t chunkSize) const
+{
+	chunkSize = std::max(wordAlign, chunkSize - chunkSize % wordAlign);
+	std::vector<uint8_t> image;
+	if(auto size = source.size())
+	{
+		// Room for the final read (which finds the end) too, so the image is rarely moved. Pages not written are never touched
+		// The size may only be a hint (e.g. a gzip trailer), so the steps are checked against the real size in finish() instead
+		image.reserve(*size + chunkSize);
+	}
+
+	// Until the end of the source is reached, nothing is padded, and every step covers everything read so far
+	const std::vector<size_t> unbounded(steps.size() + 1, std::numeric_limits<size_t>::max());
+	size_t done = 0;
+	while(true)
+	{
+		size_t pos = image.size();
+		image.resize(pos + chunkSize);
+		size_t got = source.read(image.data() + pos, chunkSize);
+		image.resize(pos + got);
+		if(got < chunkSize)
+		{
+			break;
+		}
+		process(image.data(), done, image.size(), unbounded);
+		done = image.size();
+	}
+
+	// The last chunk may end part way through a word, which padding can complete
+	finish(image, done, chunkSize);
+	return image;
+}
+
+std::vector<uint8_t> ImageTransform::load(const std::string &filename) const
+{
+	if(empty() and ImageSource::detect(filename) == ImageFormat::raw)
+	{
+		// Nothing to do to the bytes, so read them straight into place
+		return FileUtility::readToVector(filename);
+	}
+	return load(*ImageSource::open(filename));
+}
+
+void ImageTransform::apply(std::vector<uint8_t> &image, size_t chunkSize) const
+{
+	chunkSize = std::max(wordAlign, chunkSize - chunkSize % wordAlign);
+	finish(image, 0, chunkSize);
+}
@@ -0,0 +1,79 @@
+#ifndef IMAGE_TRANSFORM_HPP
+#define IMAGE_TRANSFORM_HPP
+
+// Changes applied to an image as it is loaded, from a comma separated list of steps (--transform):
+//   bitrev                   reverse the bits of each byte
+//   bswap16/bswap32/bswap64  reverse the bytes of each 16/32/64 bit word
+//   pad:<pattern>:<align>    append pattern until the size is a multiple of align
+//   fill:<pattern>:<size>    append pattern until the image is size bytes
+// e.g. "bitrev,bswap16,pad:0xFF:64K". Steps are applied in order, so a byte swap after a pad also swaps the padding
+// pattern is one or more bytes in hex (0xFF, 0xDEADBEEF), repeated from the start of the image so that it lines up with
+// words. Sizes take a K, M or G suffix
+//
+// Padding only appends, so each step covers a prefix of the final image. The image is processed a chunk at a time, with
+// every step applied to one chunk (while it is still in cache) before the next chunk is read
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ImageSource.hpp"
+
+class ImageTransformException : public std::runtime_error
+{
+	using std::runtime_error::runtime_error;
+};
+
+class ImageTransform
+{
+	public:
+		// An empty spec does nothing
+		ImageTransform(const std::string &spec = "");
+
+		bool empty(void) const { return steps.empty(); };
+
+		// Size of the transformed image, from sourceSize bytes of source
+		size_t transformedSize(size_t sourceSize) const;
+
+		// Read all of source, transforming it as it arrives
+		std::vector<uint8_t> load(ImageSource &source, size_t chunkSize = defaultChunkSize) const;
+		// Read and transform a file, decompressing it first if it is compressed (see ImageSource::open)
+		std::vector<uint8_t> load(const std::string &filename) const;
+		// Transform an image already in memory (e.g. from FileUtility::readSparse)
+		void apply(std::vector<uint8_t> &image, size_t chunkSize = defaultChunkSize) const;
+
+		// Small enough to stay in L2 while every step runs over it
+		static constexpr size_t defaultChunkSize = 256*1024;
+
+	private:
+		enum class StepType
+		{
+			bitrev,
+			bswap16,
+			bswap32,
+			bswap64,
+			pad,
+			fill
+		};
+
+		struct Step
+		{
+			StepType type;
+			std::vector<uint8_t> pattern;
+			size_t size; // Alignment for pad, total size for fill
+		};
+
+		static size_t wordSize(StepType type);
+		// Image size as each step sees it, then the final size
+		std::vector<size_t> stepSizes(size_t sourceSize) const;
+		// Transform [start, end) of image. Source bytes must already be in place. start must be 8 byte aligned
+		void process(uint8_t *image, size_t start, size_t end, const std::vector<size_t> &sizes) const;
+		// Transform everything from done onwards, now that the whole source is in image
+		void finish(std::vector<uint8_t> &image, size_t done, size_t chunkSize) const;
+
+		std::vector<Step> steps;
+};
+
+#endif
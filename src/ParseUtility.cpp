@@ -69,3 +69,29 @@
 		}
 		return ret;
 	}
+
+	std::optional<size_t> ParseUtility::parseSize(std::string str)
+	{
+		if(str.empty() or str.find('.') != std::string::npos)
+		{
+			return std::nullopt;
+		}
+		auto idx = findNonDigit(str);
+		if(!idx)
+		{
+			return std::stoull(str);
+		}
+		// Must be a whole number followed by a single multiplier character
+		if(*idx == 0 or *idx != str.size()-1)
+		{
+			return std::nullopt;
+		}
+		size_t num = std::stoull(str.substr(0,*idx));
+		switch(toupper(str.back()))
+		{
+			case 'K': return num << 10;
+			case 'M': return num << 20;
+			case 'G': return num << 30;
+			default: return std::nullopt;
+		}
+	}
@@ -15,6 +15,9 @@ namespace ParseUtility
 
 	std::optional<double> parseFreq(std::string str);
 
+	// Parse a size in bytes, with an optional binary multiplier: K, M or G (e.g. 64K = 65536)
+	std::optional<size_t> parseSize(std::string str);
+
 };
 
 #endif
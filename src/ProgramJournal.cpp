@@ -0,0 +1,120 @@
+#include <sstream>
+#include <iomanip>
+#include <filesystem>
+
+#include "ProgramJournal.hpp"
+#include "BufferUtility.h"
+
+static const std::string journalMagic = "spi_prog journal v1";
+
+static std::string imageLine(int addr, const std::vector<uint8_t> &data)
+{
+	std::ostringstream ss;
+	ss << "image 0x" << std::hex << addr << std::dec << " " << data.size()
+	   << " 0x" << std::hex << std::setfill('0') << std::setw(8) << BufferUtility::crc32c(data.data(), data.size());
+	return ss.str();
+}
+
+ProgramJournal::ProgramJournal(std::string filename, int addr, const std::vector<uint8_t> &data, bool resume)
+{
+	std::string expectedImage = imageLine(addr, data);
+
+	if(resume)
+	{
+		std::ifstream is(filename);
+		if(!is)
+		{
+			throw ProgramJournalException("Could not open journal to resume: " + filename);
+		}
+
+		std::string line;
+		if(!std::getline(is, line) or line != journalMagic)
+		{
+			throw ProgramJournalException("Not a program journal: " + filename);
+		}
+		if(!std::getline(is, line) or line != expectedImage)
+		{
+			throw ProgramJournalException("Journal was written for a different image or address (" + line + ")");
+		}
+
+		// End of the last complete line. Anything after it is torn, and is cut off before new records are appended
+		std::streamoff complete = is.tellg();
+		while(std::getline(is, line))
+		{
+			// getline() leaves eof set if the last line had no terminator, i.e. was torn
+			if(is.eof())
+			{
+				break;
+			}
+			complete = is.tellg();
+
+			// The whole line must be one record, so that nothing merged into it can be mistaken for one
+			std::istringstream ls(line);
+			char op;
+			int sectorAddr;
+			if(!(ls >> op >> std::hex >> sectorAddr) or !(ls >> std::ws).eof())
+			{
+				throw ProgramJournalException("Corrupt journal line: " + line);
+			}
+			switch(op)
+			{
+				case 'E' : sectors[sectorAddr] = SectorState::ERASED; break;
+				case 'P' : sectors[sectorAddr] = SectorState::PROGRAMMED; break;
+				case 'V' : sectors[sectorAddr] = SectorState::VERIFIED; break;
+				default : throw ProgramJournalException("Corrupt journal line: " + line);
+			}
+		}
+
+		for(auto &sector : sectors)
+		{
+			numResumed += (sector.second == SectorState::VERIFIED);
+		}
+
+		is.close();
+		std::error_code ec;
+		std::filesystem::resize_file(filename, complete, ec);
+		if(ec)
+		{
+			throw ProgramJournalException("Could not truncate journal " + filename + ": " + ec.message());
+		}
+		file.open(filename, std::ios::out | std::ios::app);
+	} else {
+		file.open(filename, std::ios::out | std::ios::trunc);
+		file << journalMagic << "\n" << expectedImage << std::endl;
+	}
+
+	if(!file)
+	{
+		throw ProgramJournalException("Could not open journal for writing: " + filename);
+	}
+}
+
+ProgramJournal::SectorState ProgramJournal::state(int sectorAddr) const
+{
+	auto it = sectors.find(sectorAddr);
+	if(it == sectors.end())
+	{
+		return SectorState::NONE;
+	}
+	return it->second;
+}
+
+void ProgramJournal::record(int sectorAddr, SectorState state)
+{
+	char op;
+	switch(state)
+	{
+		case SectorState::ERASED : op = 'E'; break;
+		case SectorState::PROGRAMMED : op = 'P'; break;
+		case SectorState::VERIFIED : op = 'V'; break;
+		default : return;
+	}
+	sectors[sectorAddr] = state;
+
+	// Flush every record, the process may not exit cleanly (e.g. losing power)
+	file << op << " 0x" << std::hex << sectorAddr << std::dec << std::endl;
+	if(!file)
+	{
+		throw ProgramJournalException("Failed to write to journal");
+	}
+}
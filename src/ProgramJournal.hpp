@@ -0,0 +1,61 @@
+#ifndef PROGRAM_JOURNAL_HPP
+#define PROGRAM_JOURNAL_HPP
+
+// On-disk record of progress through SpiFlash::program
+// Allows an interrupted program to be resumed without starting again from a full erase
+//
+// The journal is a text file:
+//   spi_prog journal v1
+//   image <address> <size> <crc32c>
+//   Then one line per sector state change, each flushed as it happens:
+//   E <address>  sector erased
+//   P <address>  sector programmed
+//   V <address>  sector read back and verified
+// A partial final line (e.g. from losing power while writing it) is ignored, and removed on resume before anything is
+// appended. Any other line which is not exactly one record is an error
+
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <stdexcept>
+#include <stdint.h>
+
+class ProgramJournalException : public std::runtime_error
+{
+	using std::runtime_error::runtime_error;
+};
+
+class ProgramJournal
+{
+	public:
+		enum class SectorState
+		{
+			NONE,
+			ERASED,
+			PROGRAMMED,
+			VERIFIED
+		};
+
+		// If resume is false, a new journal is started, overwriting any existing file
+		// If resume is true, the existing journal is loaded and must describe the same image
+		ProgramJournal(std::string filename, int addr, const std::vector<uint8_t> &data, bool resume);
+
+		SectorState state(int sectorAddr) const;
+
+		void erased(int sectorAddr) { record(sectorAddr, SectorState::ERASED); };
+		void programmed(int sectorAddr) { record(sectorAddr, SectorState::PROGRAMMED); };
+		void verified(int sectorAddr) { record(sectorAddr, SectorState::VERIFIED); };
+
+		// Number of sectors already verified when the journal was opened
+		int resumedSectors(void) const { return numResumed; };
+
+	private:
+		void record(int sectorAddr, SectorState state);
+
+		std::ofstream file;
+		std::map<int, SectorState> sectors;
+		int numResumed = 0;
+};
+
+#endif
@@ -0,0 +1,134 @@
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <set>
+
+#include "SampleVerifier.hpp"
+#include "SpiFlash.hpp"
+#include "BufferUtility.h"
+
+double SampleVerifier::confidence(size_t totalPages, size_t numPages, double defectRate)
+{
+	// Sampling without replacement. Chance of missing every damaged page is C(N-k, n)/C(N, n)
+	size_t damaged = std::max<size_t>(1, static_cast<size_t>(std::ceil(defectRate*totalPages)));
+	if(numPages + damaged > totalPages)
+	{
+		return 1.0;
+	}
+	double miss = 1.0;
+	for(size_t i = 0; i < numPages; i++)
+	{
+		miss *= static_cast<double>(totalPages - damaged - i)/(totalPages - i);
+	}
+	return 1.0 - miss;
+}
+
+size_t SampleVerifier::pagesForConfidence(size_t totalPages, double confidence, double defectRate)
+{
+	size_t damaged = std::max<size_t>(1, static_cast<size_t>(std::ceil(defectRate*totalPages)));
+	double miss = 1.0;
+	for(size_t n = 0; n < totalPages; n++)
+	{
+		if(1.0 - miss >= confidence or n + damaged > totalPages)
+		{
+			return n;
+		}
+		miss *= static_cast<double>(totalPages - damaged - n)/(totalPages - n);
+	}
+	return totalPages;
+}
+
+size_t SampleVerifier::countPages(const std::vector<Extent> &extents, int pageSize)
+{
+	size_t ret = 0;
+	for(auto &extent : extents)
+	{
+		ret += (extent.len + pageSize - 1)/pageSize;
+	}
+	return ret;
+}
+
+std::vector<size_t> SampleVerifier::choosePages(const std::vector<Extent> &extents, int pageSize, size_t numPages, uint32_t seed)
+{
+	// Index i of the sample space is page i of the extents laid end to end
+	std::vector<size_t> firstIndex;
+	size_t totalPages = 0;
+	for(auto &extent : extents)
+	{
+		firstIndex.push_back(totalPages);
+		totalPages += (extent.len + pageSize - 1)/pageSize;
+	}
+	auto pageOffset = [&](size_t index)
+	{
+		size_t e = std::upper_bound(firstIndex.begin(), firstIndex.end(), index) - firstIndex.begin() - 1;
+		return extents[e].offset + (index - firstIndex[e])*pageSize;
+	};
+
+	std::set<size_t> chosen;
+	if(numPages >= totalPages)
+	{
+		for(size_t i = 0; i < totalPages; i++)
+		{
+			chosen.insert(pageOffset(i));
+		}
+		return std::vector<size_t>(chosen.begin(), chosen.end());
+	}
+
+	for(size_t e = 0; e < extents.size(); e++)
+	{
+		if(extents[e].len)
+		{
+			chosen.insert(extents[e].offset);
+			chosen.insert(extents[e].offset + ((extents[e].len - 1)/pageSize)*pageSize);
+		}
+	}
+
+	std::mt19937 rng(seed);
+	size_t strata = (numPages > chosen.size()) ? numPages - chosen.size() : 0;
+	for(size_t s = 0; s < strata; s++)
+	{
+		size_t lo = s*totalPages/strata;
+		size_t hi = (s+1)*totalPages/strata;
+		chosen.insert(pageOffset(std::uniform_int_distribution<size_t>(lo, hi-1)(rng)));
+	}
+	// A stratum may have picked an end page, so top up with pages from anywhere
+	std::uniform_int_distribution<size_t> anyPage(0, totalPages-1);
+	while(chosen.size() < numPages)
+	{
+		chosen.insert(pageOffset(anyPage(rng)));
+	}
+	return std::vector<size_t>(chosen.begin(), chosen.end());
+}
+
+SampleVerifier::Result SampleVerifier::verify(SpiFlash &flash, int addr, const std::vector<uint8_t> &data, const std::vector<size_t> &pages, size_t totalPages)
+{
+	Result ret;
+	ret.totalPages = totalPages;
+	const size_t pageSize = flash.getPageSize();
+
+	for(size_t first = 0; first < pages.size(); )
+	{
+		// Read runs of adjacent pages at once
+		size_t last = first;
+		while(last+1 < pages.size() and pages[last+1] == pages[last] + pageSize)
+		{
+			last++;
+		}
+		size_t start = pages[first];
+		size_t end = std::min(data.size(), pages[last] + pageSize);
+		auto readback = flash.read(addr + start, end - start);
+
+		for(size_t i = first; i <= last; i++)
+		{
+			size_t offset = pages[i] - start;
+			size_t len = std::min(pageSize, readback.size() - offset);
+			if(BufferUtility::findFirstMismatch(readback.data() + offset, data.data() + pages[i], len))
+			{
+				ret.mismatches.push_back(pages[i]);
+			}
+			ret.pagesChecked++;
+		}
+		first = last+1;
+	}
+	return ret;
+}
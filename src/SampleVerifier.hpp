@@ -0,0 +1,47 @@
+#ifndef SAMPLE_VERIFIER_HPP
+#define SAMPLE_VERIFIER_HPP
+
+// Verifies a sample of pages instead of reading back a whole image
+// The sample is stratified: each extent contributes its first and last page, and the rest are spread evenly over the
+// image by picking one random page from each of a number of equal sized strata
+// A sample can't prove an image is correct, but catches anything which damages a large enough fraction of pages
+
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+class SpiFlash;
+
+class SampleVerifier
+{
+	public:
+		// Range of the image, in bytes
+		struct Extent
+		{
+			size_t offset;
+			size_t len;
+		};
+
+		struct Result
+		{
+			size_t pagesChecked = 0;
+			size_t totalPages = 0;
+			std::vector<size_t> mismatches; // Image offsets of pages which differ
+			bool ok(void) const { return mismatches.empty(); };
+			double coverage(void) const { return totalPages ? static_cast<double>(pagesChecked)/totalPages : 1.0; };
+		};
+
+		// Pages to sample so that damage to at least defectRate of them is found with the given probability
+		static size_t pagesForConfidence(size_t totalPages, double confidence, double defectRate);
+		// Probability that a sample of numPages finds damage to defectRate of pages
+		static double confidence(size_t totalPages, size_t numPages, double defectRate);
+
+		// Image offsets of the pages to check, in order. At least the first and last page of each extent are included
+		static std::vector<size_t> choosePages(const std::vector<Extent> &extents, int pageSize, size_t numPages, uint32_t seed);
+		static size_t countPages(const std::vector<Extent> &extents, int pageSize);
+
+		// Read back the chosen pages of data, written at addr. Adjacent pages are read together
+		static Result verify(SpiFlash &flash, int addr, const std::vector<uint8_t> &data, const std::vector<size_t> &pages, size_t totalPages);
+};
+
+#endif
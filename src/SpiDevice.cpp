@@ -0,0 +1,49 @@
+#include "SpiDevice.hpp"
+
+std::unique_ptr<SpiDevice> SpiDevice::openFtdi(std::string devstr, enum ftdi_interface iface, uint16_t clockDivider, bool fastAttach)
+{
+	std::unique_ptr<SpiDevice> dev(new SpiDevice());
+	auto ftdi = std::make_unique<SpiWrapper>(devstr, iface, clockDivider, fastAttach);
+	std::string serial = ftdi->serialNumber();
+	std::string ifaceName = (iface == INTERFACE_ANY) ? "any" : std::string(1, 'A' + (iface - INTERFACE_A));
+	dev->deviceIdentity = "ftdi-" + (serial.empty() ? devstr : serial) + "-" + ifaceName;
+	dev->ftdi = ftdi.get();
+	dev->backend = std::move(ftdi);
+	return dev;
+}
+
+std::unique_ptr<SpiDevice> SpiDevice::openWbUart(std::string uartDev, uint32_t baud, uintptr_t compAddr, bool fastAttach)
+{
+	std::unique_ptr<SpiDevice> dev(new SpiDevice());
+	dev->uart = std::make_unique<WbUart<uint8_t,8>>(uartDev, baud, false, fastAttach);
+	dev->backend = std::make_unique<WbSpiWrapper>(dev->uart.get(), compAddr);
+	dev->deviceIdentity = "wbuart-" + uartDev + "-" + std::to_string(compAddr);
+	return dev;
+}
+
+std::unique_ptr<SpiDevice> SpiDevice::openReplay(std::string traceFile)
+{
+	std::unique_ptr<SpiDevice> dev(new SpiDevice());
+	auto replay = std::make_unique<SpiReplay>(traceFile);
+	dev->replay = replay.get();
+	dev->backend = std::move(replay);
+	dev->deviceIdentity = "replay-" + traceFile;
+	return dev;
+}
+
+std::unique_ptr<SpiDevice> SpiDevice::openDryRun(std::unique_ptr<SpiCostModel> model, size_t flashSize)
+{
+	std::unique_ptr<SpiDevice> dev(new SpiDevice());
+	dev->deviceIdentity = "dryrun-" + model->describe();
+	dev->costModel = std::move(model);
+	dev->dryRunFlash = std::make_unique<FlashEmulator>(flashSize);
+	auto dryRun = std::make_unique<DryRunSpi>(dev->dryRunFlash.get(), dev->costModel.get());
+	dev->dryRun = dryRun.get();
+	dev->backend = std::move(dryRun);
+	return dev;
+}
+
+void SpiDevice::record(std::string traceFile)
+{
+	recorder = std::make_unique<SpiRecorder>(backend.get(), traceFile);
+}
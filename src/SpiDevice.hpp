@@ -0,0 +1,60 @@
+#ifndef SPI_DEVICE_HPP
+#define SPI_DEVICE_HPP
+
+// An opened programmer, ready to be handed to SpiFlash or FlashSession
+// Owns everything needed to keep the SPI interface alive (e.g. the UART underneath a WbSpiWrapper)
+
+#include <memory>
+#include <string>
+#include <ftdi.h>
+
+#include "SpiInterface.hpp"
+#include "SpiWrapper.hpp"
+#include "WbSpiWrapper.hpp"
+#include "WbUart.hpp"
+#include "SpiRecorder.hpp"
+#include "SpiReplay.hpp"
+#include "DryRun.hpp"
+
+class SpiDevice
+{
+	public:
+		// fastAttach skips resets and settling delays where the device is known to be in a good state. See SpiWrapper and WbUart
+		static std::unique_ptr<SpiDevice> openFtdi(std::string devstr, enum ftdi_interface iface, uint16_t clockDivider, bool fastAttach = false);
+		static std::unique_ptr<SpiDevice> openWbUart(std::string uartDev, uint32_t baud, uintptr_t compAddr, bool fastAttach = false);
+		static std::unique_ptr<SpiDevice> openReplay(std::string traceFile);
+		// Nothing is opened. Traffic goes to an emulated flash of flashSize bytes, and is timed by model
+		static std::unique_ptr<SpiDevice> openDryRun(std::unique_ptr<SpiCostModel> model, size_t flashSize);
+
+		// Record all subsequent traffic through spi() to a trace file
+		void record(std::string traceFile);
+
+		// Interface to use for all SPI traffic. This is the recorder if recording
+		SpiInterface *spi(void) { return recorder ? recorder.get() : backend.get(); };
+
+		// Identifies the programmer/board, e.g. for keying FlashCache. Can be overridden by the user
+		const std::string &identity(void) const { return deviceIdentity; };
+		void setIdentity(std::string id) { deviceIdentity = id; };
+
+		SpiRecorder *getRecorder(void) { return recorder.get(); };
+		SpiReplay *getReplay(void) { return replay; };
+		SpiWrapper *getFtdi(void) { return ftdi; };
+		WbUart<uint8_t,8> *getWbUart(void) { return uart.get(); };
+		DryRunSpi *getDryRun(void) { return dryRun; };
+		FlashEmulator *getDryRunFlash(void) { return dryRunFlash.get(); };
+
+	private:
+		SpiDevice() {};
+
+		std::unique_ptr<WbUart<uint8_t,8>> uart;
+		std::unique_ptr<SpiCostModel> costModel;
+		std::unique_ptr<FlashEmulator> dryRunFlash;
+		std::unique_ptr<SpiInterface> backend;
+		std::unique_ptr<SpiRecorder> recorder;
+		SpiReplay *replay = nullptr; // Owned by backend
+		SpiWrapper *ftdi = nullptr; // Owned by backend
+		DryRunSpi *dryRun = nullptr; // Owned by backend
+		std::string deviceIdentity;
+};
+
+#endif
@@ -1,13 +1,20 @@
 // Wrapper to contain all the commands needed to write to the SPI Flash
+// The commands themselves are in SpiFlashT, which is specialised for each backend. SpiFlash picks the right one at runtime
 
 #ifndef SPI_FLASH_HPP
 #define SPI_FLASH_HPP
 
 
 #include <vector>
+#include <string>
 #include <exception>
+#include <functional>
+#include <memory>
+#include <atomic>
 
 #include "SpiWrapper.hpp"
+#include "ProgramJournal.hpp"
+#include "ErasePlanner.hpp"
 
 class SpiFlashException : public std::exception
 {
@@ -20,45 +27,103 @@ class SpiFlashException : public std::exception
 		std::string s;
 };
 
+// Thrown when an operation is stopped by the cancel flag
+class SpiFlashCancelled : public SpiFlashException
+{
+	public:
+		SpiFlashCancelled() : SpiFlashException("Operation cancelled") {}
+};
+
+// Everything SpiFlash can do. Implemented by SpiFlashT for each backend
+// Only whole operations go through these virtual calls. Everything inside an operation is bound at compile time
+class SpiFlashEngine
+{
+	public:
+		virtual ~SpiFlashEngine() {};
+
+		virtual std::vector<uint8_t> read(int addr, int num) = 0;
+		virtual std::vector<uint8_t> readId(void) = 0;
+		virtual void write(int addr, std::vector<uint8_t>::const_iterator start, std::vector<uint8_t>::const_iterator end) = 0;
+		virtual void chipErase(void) = 0;
+		virtual void sectorErase(int addr) = 0;
+		// Erase a 4K, 32K or 64K block. addr must be aligned to size
+		virtual void blockErase(int addr, int size) = 0;
+		// skipSectors is indexed by sector from addr. Sectors marked true are left untouched
+		// Without a journal or skipSectors, addr and length need not be aligned. Only the 4K blocks covering data are erased,
+		// and anything else in them is preserved. Otherwise addr must be sector aligned, and the rest of the last sector is erased
+		virtual void program(int addr, const std::vector<uint8_t> &data, const std::vector<bool> &skipSectors = {}) = 0;
+		// Write data with as few erases as possible, using ErasePlanner
+		// previous is what flash is believed to hold at [addr, addr+previous->size()) beforehand
+		// Anything else the plan needs to know (including the rest of partially written 4K blocks) is read back
+		// addr does not need to be aligned, and data outside [addr, addr+data.size()) is preserved
+		virtual ErasePlanner::Plan update(int addr, const std::vector<uint8_t> &data, const std::vector<uint8_t> *previous = nullptr) = 0;
+		virtual void releasePowerDown(void) = 0;
+		virtual uint8_t readStatusRegister(int reg=1) = 0;
+
+		// Start an erase and return straight away, for interleaving work across chips (see FlashScheduler)
+		// Like write(), the flash must not be busy beforehand, and stays busy afterwards until isBusy() returns false
+		virtual void startBlockErase(int addr, int size) = 0;
+		virtual bool isBusy(void) = 0;
+
+		// When set, program() records its progress in the journal and skips sectors it says are complete
+		// Each sector is also read back and verified before it is marked complete
+		virtual void setJournal(ProgramJournal *j) = 0;
+
+		// When enabled, program() reads back each sector straight after writing it
+		// Pages which differ are rewritten, up to retries times. This is done in place if only bits which are still 1 need clearing
+		// Otherwise the sector is erased and rewritten. Sectors skipped via skipSectors are also read back, and written if they differ
+		virtual void setVerify(bool enable, int retries = 2) = 0;
+		// Number of page rewrites needed to pass verification during the last program()
+		virtual int getRetriedPages(void) const = 0;
+
+		// Called with bytes done and bytes total as program() and read() proceed
+		// If not set, program() shows a progress bar on stderr instead
+		typedef std::function<void(size_t done, size_t total)> ProgressCallback;
+		virtual void setProgressCallback(ProgressCallback cb) = 0;
+
+		// Checked between pages and read chunks. Once it is set, the current operation throws SpiFlashCancelled
+		virtual void setCancelFlag(const std::atomic<bool> *flag) = 0;
+
+		virtual int getPageSize(void) const = 0;
+		virtual int getSectorSize(void) const = 0;
+};
+
+// Runtime polymorphic flash, for any SpiInterface. See SpiFlashEngine for what each call does
+// Known backends (e.g. SpiWrapper, WbSpiWrapper) get a SpiFlashT of their own, so SPI calls within an operation are direct
 class SpiFlash
 {
 	public:
-		SpiFlash(SpiInterface *spi) :spi(spi) {};
+		SpiFlash(SpiInterface *spi) :engine(makeEngine(spi)) {};
 		~SpiFlash() {};
 
-		std::vector<uint8_t> read(int addr, int num);
-		std::vector<uint8_t> readId(void);
-		void write(int addr, std::vector<uint8_t>::iterator start, std::vector<uint8_t>::iterator end);
-		void chipErase(void);
-		void sectorErase(int addr);
-		void program(int addr, std::vector<uint8_t> data);
-		void releasePowerDown(void);
-		uint8_t readStatusRegister(int reg=1);
+		std::vector<uint8_t> read(int addr, int num) { return engine->read(addr, num); };
+		std::vector<uint8_t> readId(void) { return engine->readId(); };
+		void write(int addr, std::vector<uint8_t>::const_iterator start, std::vector<uint8_t>::const_iterator end) { engine->write(addr, start, end); };
+		void chipErase(void) { engine->chipErase(); };
+		void sectorErase(int addr) { engine->sectorErase(addr); };
+		void blockErase(int addr, int size) { engine->blockErase(addr, size); };
+		void program(int addr, const std::vector<uint8_t> &data, const std::vector<bool> &skipSectors = {}) { engine->program(addr, data, skipSectors); };
+		ErasePlanner::Plan update(int addr, const std::vector<uint8_t> &data, const std::vector<uint8_t> *previous = nullptr) { return engine->update(addr, data, previous); };
+		void releasePowerDown(void) { engine->releasePowerDown(); };
+		uint8_t readStatusRegister(int reg=1) { return engine->readStatusRegister(reg); };
+		void startBlockErase(int addr, int size) { engine->startBlockErase(addr, size); };
+		bool isBusy(void) { return engine->isBusy(); };
+
+		void setJournal(ProgramJournal *j) { engine->setJournal(j); };
+		void setVerify(bool enable, int retries = 2) { engine->setVerify(enable, retries); };
+		int getRetriedPages(void) const { return engine->getRetriedPages(); };
+
+		typedef SpiFlashEngine::ProgressCallback ProgressCallback;
+		void setProgressCallback(ProgressCallback cb) { engine->setProgressCallback(cb); };
+		void setCancelFlag(const std::atomic<bool> *flag) { engine->setCancelFlag(flag); };
+
+		int getPageSize(void) const { return engine->getPageSize(); };
+		int getSectorSize(void) const { return engine->getSectorSize(); };
 
 	private:
-		void waitUntilReady(void);
-		void enableWriting(void);
-		void checkAndDisableWriteProection(void);
-
-		SpiInterface *spi;
-
-		const int pageSize = 256; //Page size in bytes
-		const int sectorSize = 64*1024; //Sector size in bytes
-
-		enum class SpiCmd : uint8_t
-		{
-			read = 0x03,
-			chipErase = 0xC7,
-			byteProgram = 0x02,
-			readStatusRegister1 = 0x05,
-			readStatusRegister2 = 0x35,
-			readStatusRegister3 = 0x15,
-			enableWriteStatusRegister = 0x50,
-			writeStatusRegister = 0x01,
-			writeEnable = 0x06,
-			readId = 0x9F,
-			sectorErase = 0xD8
-		};
+		static std::unique_ptr<SpiFlashEngine> makeEngine(SpiInterface *spi);
+
+		std::unique_ptr<SpiFlashEngine> engine;
 };
 
 #endif
@@ -0,0 +1,710 @@
+// SpiFlash commands, for one particular SPI backend
+// Backend is any class with the SpiInterface methods. Calls to it are bound at compile time, so for a final class
+// (or a backend defined inline) command building and the backend's own buffering can be optimised together
+// SpiFlashT<SpiInterface> works with any backend, via virtual calls
+//
+// Normally used through SpiFlash, which chooses the specialisation at runtime. Code which knows its backend can use this directly
+
+#ifndef SPI_FLASH_T_HPP
+#define SPI_FLASH_T_HPP
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <memory>
+#include <atomic>
+
+#include <boost/version.hpp>
+// progress_display moved to boost/timer in 1.72
+#if (((BOOST_VERSION / 100000) == 1) && (BOOST_VERSION / 100 % 1000) >= 72)
+	#include<boost/timer/progress_display.hpp>
+	typedef boost::timer::progress_display display_t;
+#else
+	#include<boost/progress.hpp>
+	typedef boost::progress_display display_t;
+#endif
+
+#include "SpiFlash.hpp"
+#include "BufferUtility.h"
+#include "Timeline.hpp"
+
+template<class Backend> class SpiFlashT final : public SpiFlashEngine
+{
+	public:
+		SpiFlashT(Backend *spi) :spi(spi) {};
+		~SpiFlashT() {};
+
+		std::vector<uint8_t> read(int addr, int num) override;
+		std::vector<uint8_t> readId(void) override;
+		void write(int addr, std::vector<uint8_t>::const_iterator start, std::vector<uint8_t>::const_iterator end) override;
+		void chipErase(void) override;
+		void sectorErase(int addr) override;
+		void blockErase(int addr, int size) override;
+		void program(int addr, const std::vector<uint8_t> &data, const std::vector<bool> &skipSectors = {}) override;
+		ErasePlanner::Plan update(int addr, const std::vector<uint8_t> &data, const std::vector<uint8_t> *previous = nullptr) override;
+		void releasePowerDown(void) override;
+		uint8_t readStatusRegister(int reg=1) override;
+		void startBlockErase(int addr, int size) override;
+		bool isBusy(void) override { return readStatusRegister() & 0x01; };
+
+		void setJournal(ProgramJournal *j) override { journal = j; };
+		void setVerify(bool enable, int retries = 2) override { verifyEnabled = enable; verifyRetries = retries; };
+		int getRetriedPages(void) const override { return retriedPages; };
+		void setProgressCallback(ProgressCallback cb) override { progressCallback = cb; };
+		void setCancelFlag(const std::atomic<bool> *flag) override { cancelFlag = flag; };
+
+		int getPageSize(void) const override { return pageSize; };
+		int getSectorSize(void) const override { return sectorSize; };
+
+	private:
+		std::vector<uint8_t> readRange(int addr, int num, bool reportProgress);
+		void programPages(int addr, std::vector<uint8_t>::const_iterator start, std::vector<uint8_t>::const_iterator end, bool reportProgress = true);
+		bool verifySector(int addr, std::vector<uint8_t>::const_iterator start, std::vector<uint8_t>::const_iterator end);
+		void verifyAndRepair(int addr, std::vector<uint8_t>::const_iterator start, std::vector<uint8_t>::const_iterator end, int retries, int eraseSize);
+		void executePlan(int regionStart, const std::vector<uint8_t> &newData, const ErasePlanner::Plan &plan);
+		void programUnaligned(int addr, const std::vector<uint8_t> &data);
+		void startProgress(size_t total, bool showBar);
+		void advanceProgress(size_t bytes);
+		void checkCancelled(void);
+		void waitUntilReady(void);
+		void enableWriting(void);
+		void checkAndDisableWriteProection(void);
+
+		Backend *spi;
+		ProgramJournal *journal = nullptr;
+		bool verifyEnabled = false;
+		int verifyRetries = 0;
+		int retriedPages = 0;
+		ProgressCallback progressCallback;
+		const std::atomic<bool> *cancelFlag = nullptr;
+		std::unique_ptr<display_t> progressDisplay;
+		size_t progressDone = 0;
+		size_t progressTotal = 0;
+
+		const int pageSize = 256; //Page size in bytes
+		const int sectorSize = 64*1024; //Sector size in bytes
+		const int readChunkSize = 64*1024; // Reads are split up to allow progress reporting and cancellation
+
+		enum class SpiCmd : uint8_t
+		{
+			read = 0x03,
+			chipErase = 0xC7,
+			byteProgram = 0x02,
+			readStatusRegister1 = 0x05,
+			readStatusRegister2 = 0x35,
+			readStatusRegister3 = 0x15,
+			enableWriteStatusRegister = 0x50,
+			writeStatusRegister = 0x01,
+			writeEnable = 0x06,
+			readId = 0x9F,
+			sectorErase = 0xD8,
+			blockErase4k = 0x20,
+			blockErase32k = 0x52
+		};
+};
+
+template<class Backend> std::vector<uint8_t> SpiFlashT<Backend>::read(int addr, int num)
+{
+	return readRange(addr, num, true);
+}
+
+// Progress is not reported for reads within another operation (e.g. verifying during program)
+template<class Backend> std::vector<uint8_t> SpiFlashT<Backend>::readRange(int addr, int num, bool reportProgress)
+{
+	Timeline::Span span("read", "flash");
+	span.arg("bytes", num);
+	waitUntilReady();
+
+	std::vector<uint8_t> ret;
+	ret.reserve(num);
+	if(reportProgress)
+	{
+		startProgress(num, false);
+	}
+	for(int offset = 0; offset < num; offset += readChunkSize)
+	{
+		checkCancelled();
+		int len = std::min(readChunkSize, num - offset);
+		int chunkAddr = addr + offset;
+
+		spi->setCs(false);
+		std::vector<uint8_t> transmit(4, 0xFF);
+		transmit[0] = static_cast<uint8_t>(SpiCmd::read);
+		transmit[1] = (chunkAddr >> 16) & 0xFF;
+		transmit[2] = (chunkAddr >> 8)  & 0xFF;
+		transmit[3] = (chunkAddr >> 0)  & 0xFF;
+
+		spi->send(std::move(transmit));
+
+		auto chunk = spi->receive(len);
+		spi->setCs(true);
+
+		ret.insert(ret.end(), chunk.begin(), chunk.end());
+		if(reportProgress)
+		{
+			advanceProgress(len);
+		}
+	}
+
+	return ret;
+}
+
+
+template<class Backend> std::vector<uint8_t> SpiFlashT<Backend>::readId(void)
+{
+	waitUntilReady();
+
+	std::vector<uint8_t> transmit(10, 0xFF);
+	transmit[0] = static_cast<uint8_t>(SpiCmd::readId);
+
+	spi->setCs(false);
+	std::vector<uint8_t> result = spi->transfer(std::move(transmit));
+	spi->setCs(true);
+
+	// Remove first element as this is the ID
+	result.erase(result.begin(), result.begin()+1);
+
+	return result;
+}
+
+template<class Backend> void SpiFlashT<Backend>::releasePowerDown(void)
+{
+	std::vector<uint8_t> transmit = {0xAB,0xFF,0xFF,0xFF,0xFF};
+	spi->setCs(false);
+	spi->send(std::move(transmit));
+	spi->setCs(true);
+}
+
+// Writes in page program mode
+// Takes iterator to first byte to Program
+// Returns iterator to last byte programmed
+template<class Backend> void SpiFlashT<Backend>::write(int addr, std::vector<uint8_t>::const_iterator start, std::vector<uint8_t>::const_iterator end)
+{
+	if(std::distance(start,end) > pageSize)
+	{
+		throw SpiFlashException("Attempt to write more than page size: " + std::to_string(std::distance(start,end)));
+	}
+	Timeline::Span span("write", "flash");
+	span.arg("bytes", std::distance(start,end));
+	enableWriting();
+
+	// Command, address and data go in a single allocation, which is moved (not copied) into the backend
+	std::vector<uint8_t> transmit;
+	transmit.reserve(4 + std::distance(start,end));
+	transmit.push_back(static_cast<uint8_t>(SpiCmd::byteProgram));
+	transmit.push_back((addr >> 16) & 0xFF);
+	transmit.push_back((addr >> 8)  & 0xFF);
+	transmit.push_back((addr >> 0)  & 0xFF);
+	transmit.insert(transmit.end(), start, end);
+
+	//std::cout << "Write to " << addr << ". Size: " << (transmit.size()-4) << std::endl;
+
+	spi->setCs(false);
+	spi->send(std::move(transmit));
+	spi->setCs(true);
+}
+
+template<class Backend> void SpiFlashT<Backend>::chipErase(void)
+{
+	Timeline::Span span("chipErase", "flash");
+	waitUntilReady();
+	enableWriting();
+
+	std::vector<uint8_t> transmit = {static_cast<uint8_t>(SpiCmd::chipErase)};
+
+	spi->setCs(false);
+	spi->send(std::move(transmit));
+	spi->setCs(true);
+}
+
+
+
+template<class Backend> uint8_t SpiFlashT<Backend>::readStatusRegister(int reg)
+{
+	SpiCmd cmd;
+	switch(reg)
+	{
+		case 1 : cmd = SpiCmd::readStatusRegister1; break;
+		case 2 : cmd = SpiCmd::readStatusRegister2; break;
+		case 3 : cmd = SpiCmd::readStatusRegister3; break;
+		default : throw SpiFlashException("Attempt to read invalid status register");
+	}
+
+	std::vector<uint8_t> transmit = {static_cast<uint8_t>(cmd), 0xFF};
+
+	spi->setCs(false);
+	std::vector<uint8_t> result = spi->transfer(std::move(transmit));
+	spi->setCs(true);
+
+	return result[1];
+}
+
+template<class Backend> void SpiFlashT<Backend>::waitUntilReady(void)
+{
+	Timeline::Span span("waitUntilReady", "flash");
+	uint8_t busy;
+	int polls = 0;
+	do
+	{
+		busy = readStatusRegister();
+		polls++;
+		//std::cout << "Waiting: " << std::hex << (int)busy << std::dec << std::endl;
+
+		busy = busy & 0x01;
+	} while (busy);
+	span.arg("polls", polls);
+}
+
+template<class Backend> void SpiFlashT<Backend>::checkAndDisableWriteProection(void)
+{
+	uint8_t status = readStatusRegister();
+	// Check for block write protection
+	if((status & 0x0C) != 0)
+	{
+		{
+			std::vector<uint8_t> transmit = {static_cast<uint8_t>(SpiCmd::enableWriteStatusRegister)};
+			spi->setCs(false);
+			spi->send(std::move(transmit));
+			spi->setCs(true);
+		}
+
+		{
+			std::vector<uint8_t> transmit = {static_cast<uint8_t>(SpiCmd::writeStatusRegister), 0x00};
+			spi->setCs(false);
+			spi->send(std::move(transmit));
+			spi->setCs(true);
+		}
+	}
+}
+
+template<class Backend> void SpiFlashT<Backend>::enableWriting(void)
+{
+
+	std::vector<uint8_t> transmit = {static_cast<uint8_t>(SpiCmd::writeEnable)};
+	spi->setCs(false);
+	spi->send(std::move(transmit));
+	spi->setCs(true);
+}
+
+template<class Backend> void SpiFlashT<Backend>::sectorErase(int addr)
+{
+	Timeline::Span span("sectorErase", "flash");
+	span.arg("bytes", sectorSize);
+	waitUntilReady();
+	enableWriting();
+
+	std::vector<uint8_t> transmit(4, 0xFF);
+	transmit[0] = static_cast<uint8_t>(SpiCmd::sectorErase);
+	transmit[1] = (addr >> 16) & 0xFF;
+	transmit[2] = (addr >> 8)  & 0xFF;
+	transmit[3] = (addr >> 0)  & 0xFF;
+
+	spi->setCs(false);
+	spi->send(std::move(transmit));
+	spi->setCs(true);
+
+	//sleep(4);
+
+	waitUntilReady();
+}
+
+template<class Backend> void SpiFlashT<Backend>::blockErase(int addr, int size)
+{
+	Timeline::Span span("blockErase", "flash");
+	span.arg("bytes", size);
+	waitUntilReady();
+	startBlockErase(addr, size);
+	waitUntilReady();
+}
+
+template<class Backend> void SpiFlashT<Backend>::startBlockErase(int addr, int size)
+{
+	SpiCmd cmd;
+	switch(size)
+	{
+		case 4*1024 : cmd = SpiCmd::blockErase4k; break;
+		case 32*1024 : cmd = SpiCmd::blockErase32k; break;
+		case 64*1024 : cmd = SpiCmd::sectorErase; break;
+		default : throw SpiFlashException("Invalid erase size: " + std::to_string(size));
+	}
+	if((addr % size) != 0)
+	{
+		throw SpiFlashException("Erase address not aligned with erase size");
+	}
+
+	enableWriting();
+
+	std::vector<uint8_t> transmit(4, 0xFF);
+	transmit[0] = static_cast<uint8_t>(cmd);
+	transmit[1] = (addr >> 16) & 0xFF;
+	transmit[2] = (addr >> 8)  & 0xFF;
+	transmit[3] = (addr >> 0)  & 0xFF;
+
+	spi->setCs(false);
+	spi->send(std::move(transmit));
+	spi->setCs(true);
+}
+
+template<class Backend> ErasePlanner::Plan SpiFlashT<Backend>::update(int addr, const std::vector<uint8_t> &data, const std::vector<uint8_t> *previous)
+{
+	Timeline::Span span("update", "flash");
+	span.arg("bytes", data.size());
+	// The plan covers whole erase blocks
+	const int block = ErasePlanner::blockSize;
+	const int regionStart = addr - (addr % block);
+	const int regionEnd = ((addr + data.size() + block - 1)/block)*block;
+	const int regionLen = regionEnd - regionStart;
+
+	// What flash holds now. Only the parts not covered by previous are read
+	std::vector<uint8_t> oldData(regionLen);
+	const int knownStart = addr;
+	const int knownEnd = addr + (previous ? std::min(previous->size(), data.size()) : 0);
+	if(knownStart > regionStart)
+	{
+		auto head = readRange(regionStart, knownStart - regionStart, false);
+		std::copy(head.begin(), head.end(), oldData.begin());
+	}
+	if(previous)
+	{
+		std::copy(previous->begin(), previous->begin() + (knownEnd - knownStart), oldData.begin() + (knownStart - regionStart));
+	}
+	if(regionEnd > knownEnd)
+	{
+		if(regionEnd - knownEnd > 2*block)
+		{
+			std::cout << "Reading current contents" << std::endl;
+		}
+		auto tail = readRange(knownEnd, regionEnd - knownEnd, false);
+		std::copy(tail.begin(), tail.end(), oldData.begin() + (knownEnd - regionStart));
+	}
+
+	// What flash should hold afterwards. Anything outside data is preserved
+	std::vector<uint8_t> newData(oldData);
+	std::copy(data.begin(), data.end(), newData.begin() + (addr - regionStart));
+
+	auto plan = ErasePlanner::plan(regionStart, oldData.data(), newData.data(), regionLen, pageSize);
+
+	size_t erases[3] = {0, 0, 0};
+	for(auto &erase : plan.erases)
+	{
+		erases[(erase.size == ErasePlanner::blockSize) ? 0 : (erase.size == 32*1024) ? 1 : 2]++;
+	}
+	std::cout << "Update plan: " << plan.unchangedPages << " pages unchanged, " << plan.inPlacePages << " programmed in place, "
+		<< plan.erasePages << " need erasing" << std::endl;
+	std::cout << "Erasing " << erases[0] << "x4K, " << erases[1] << "x32K, " << erases[2] << "x64K. Programming "
+		<< plan.pages.size() << " pages (" << plan.preservedPages << " preserved). Estimated " << static_cast<int>(plan.estimatedMs) << "ms" << std::endl;
+
+	executePlan(regionStart, newData, plan);
+	return plan;
+}
+
+// Carry out an ErasePlanner plan. newData covers the plan's whole region, starting at regionStart
+// With verification on, each block is verified (and repaired) as soon as its last page is written, while its data is
+// still in cache, rather than reading the whole region back at the end
+template<class Backend> void SpiFlashT<Backend>::executePlan(int regionStart, const std::vector<uint8_t> &newData, const ErasePlanner::Plan &plan)
+{
+	const int block = ErasePlanner::blockSize;
+	const int regionLen = newData.size();
+
+	// Pages are written in address order, so every block below limit is finished
+	int verifiedTo = 0;
+	auto verifyUpTo = [&](int limit)
+	{
+		if(!verifyEnabled)
+		{
+			return;
+		}
+		for(; verifiedTo + block <= limit; verifiedTo += block)
+		{
+			checkCancelled();
+			auto start = newData.cbegin() + verifiedTo;
+			verifyAndRepair(regionStart + verifiedTo, start, start + block, verifyRetries, block);
+		}
+	};
+
+	startProgress(plan.pages.size() * pageSize, true);
+	retriedPages = 0;
+	auto nextErase = plan.erases.begin();
+	for(auto pageAddr : plan.pages)
+	{
+		// Erase each block just before its first page is programmed
+		while(nextErase != plan.erases.end() and nextErase->addr <= pageAddr)
+		{
+			verifyUpTo(nextErase->addr - regionStart);
+			checkCancelled();
+			blockErase(nextErase->addr, nextErase->size);
+			nextErase++;
+		}
+		// Everything before this page's block has had its erase and all its pages
+		verifyUpTo(pageAddr - regionStart - (pageAddr - regionStart) % block);
+		checkCancelled();
+		auto start = newData.cbegin() + (pageAddr - regionStart);
+		waitUntilReady();
+		write(pageAddr, start, start + pageSize);
+		advanceProgress(pageSize);
+	}
+	// Blocks whose new contents are entirely blank
+	for(; nextErase != plan.erases.end(); nextErase++)
+	{
+		verifyUpTo(nextErase->addr - regionStart);
+		checkCancelled();
+		blockErase(nextErase->addr, nextErase->size);
+	}
+	waitUntilReady();
+	verifyUpTo(regionLen);
+
+	if(retriedPages)
+	{
+		std::cout << "Recovered " << retriedPages << " pages which failed verification" << std::endl;
+	}
+}
+
+// Program anywhere, by erasing the 4K blocks covering data. Only the parts of the first and last block outside data are read
+// back, and they are written back along with data
+template<class Backend> void SpiFlashT<Backend>::programUnaligned(int addr, const std::vector<uint8_t> &data)
+{
+	const int block = ErasePlanner::blockSize;
+	const int end = addr + data.size();
+	const int regionStart = addr - (addr % block);
+	const int regionEnd = ((end + block - 1)/block)*block;
+
+	std::vector<uint8_t> newData(regionEnd - regionStart);
+	if(addr > regionStart)
+	{
+		auto head = readRange(regionStart, addr - regionStart, false);
+		std::copy(head.begin(), head.end(), newData.begin());
+	}
+	std::copy(data.begin(), data.end(), newData.begin() + (addr - regionStart));
+	if(regionEnd > end)
+	{
+		auto tail = readRange(end, regionEnd - end, false);
+		std::copy(tail.begin(), tail.end(), newData.begin() + (end - regionStart));
+	}
+
+	auto plan = ErasePlanner::overwrite(regionStart, newData.data(), newData.size(), pageSize);
+	std::cout << "Erasing " << plan.erases.size() << " blocks from 0x" << std::hex << regionStart << std::dec << " and programming "
+		<< plan.pages.size() << " pages. " << (newData.size() - data.size()) << " bytes either side preserved" << std::endl;
+
+	executePlan(regionStart, newData, plan);
+}
+
+template<class Backend> void SpiFlashT<Backend>::program(int addr, const std::vector<uint8_t> &data, const std::vector<bool> &skipSectors)
+{
+	Timeline::Span span("program", "flash");
+	span.arg("bytes", data.size());
+	const bool aligned = (addr % sectorSize) == 0 and ((addr+data.size()) % sectorSize) == 0;
+	// The cache may give a full list with nothing to skip, which is no reason to work in whole sectors
+	if(!aligned and !journal and std::none_of(skipSectors.begin(), skipSectors.end(), [](bool skip) { return skip; }))
+	{
+		programUnaligned(addr, data);
+		return;
+	}
+
+	// The journal and skipped sectors work in whole sectors
+	if((addr % sectorSize) != 0)
+	{
+		throw SpiFlashException("Address not aligned with sector size");
+	}
+
+	if(((addr+data.size()) % sectorSize) != 0)
+	{
+		std::cerr << "Warning. Length not aligned with sector size. Data at end of sector will be erased" << std::endl;
+	}
+
+	// Each sector is erased then programmed in turn
+	int numSectors = (data.size() + sectorSize - 1)/sectorSize;
+	int numSkipped = std::count(skipSectors.begin(), skipSectors.begin() + std::min<size_t>(skipSectors.size(), numSectors), true);
+	std::cout << "Erasing and programming " << numSectors-numSkipped << " sectors from 0x" << std::hex << addr << std::dec;
+	if(numSkipped)
+	{
+		std::cout << " (" << numSkipped << " unchanged sectors skipped)";
+	}
+	std::cout << std::endl;
+	if(journal and journal->resumedSectors())
+	{
+		std::cout << "Resuming. " << journal->resumedSectors() << " sectors already complete" << std::endl;
+	}
+
+	startProgress(data.size(), true);
+	retriedPages = 0;
+
+	for(size_t offset = 0; offset < data.size(); offset += sectorSize)
+	{
+		int sectorAddr = addr + offset;
+		auto start = data.begin() + offset;
+		auto end = (data.size() - offset > static_cast<size_t>(sectorSize)) ? start + sectorSize : data.end();
+		size_t sectorBytes = std::distance(start, end);
+
+		size_t sectorIdx = offset/sectorSize;
+		if(sectorIdx < skipSectors.size() and skipSectors[sectorIdx] and (!verifyEnabled or verifySector(sectorAddr, start, end)))
+		{
+			advanceProgress(sectorBytes);
+			continue;
+		}
+
+		if(journal)
+		{
+			auto state = journal->state(sectorAddr);
+			if(state == ProgramJournal::SectorState::VERIFIED)
+			{
+				advanceProgress(sectorBytes);
+				continue;
+			}
+			// This sector was in progress when we were interrupted. If it is actually complete, don't redo it
+			if(state != ProgramJournal::SectorState::NONE and verifySector(sectorAddr, start, end))
+			{
+				journal->verified(sectorAddr);
+				advanceProgress(sectorBytes);
+				continue;
+			}
+		}
+
+		sectorErase(sectorAddr);
+		if(journal)
+		{
+			journal->erased(sectorAddr);
+		}
+
+		programPages(sectorAddr, start, end);
+
+		if(journal)
+		{
+			journal->programmed(sectorAddr);
+		}
+		// The journal only marks a sector complete once it is known to be good
+		if(journal or verifyEnabled)
+		{
+			verifyAndRepair(sectorAddr, start, end, verifyEnabled ? verifyRetries : 0, sectorSize);
+		}
+		if(journal)
+		{
+			journal->verified(sectorAddr);
+		}
+	}
+	waitUntilReady();
+
+	if(retriedPages)
+	{
+		std::cout << "Recovered " << retriedPages << " pages which failed verification" << std::endl;
+	}
+}
+
+// Program a range within a single erased sector, one page at a time
+template<class Backend> void SpiFlashT<Backend>::programPages(int addr, std::vector<uint8_t>::const_iterator start, std::vector<uint8_t>::const_iterator end, bool reportProgress)
+{
+	while(start != end)
+	{
+		checkCancelled();
+		auto pageEnd = (std::distance(start, end) > pageSize) ? start + pageSize : end;
+		// Pages which are entirely 0xFF are already in that state after the erase
+		if(!BufferUtility::isBlank(&*start, std::distance(start, pageEnd)))
+		{
+			waitUntilReady();
+			write(addr, start, pageEnd);
+		}
+		if(reportProgress)
+		{
+			advanceProgress(std::distance(start, pageEnd));
+		}
+		addr += pageSize;
+		start = pageEnd;
+	}
+}
+
+template<class Backend> bool SpiFlashT<Backend>::verifySector(int addr, std::vector<uint8_t>::const_iterator start, std::vector<uint8_t>::const_iterator end)
+{
+	auto len = std::distance(start, end);
+	auto readback = readRange(addr, len, false);
+	return !BufferUtility::findFirstMismatch(readback.data(), &*start, len);
+}
+
+// Read back a freshly programmed erase block, and rewrite any pages which differ
+// Throws if the block still differs after the given number of retries
+template<class Backend> void SpiFlashT<Backend>::verifyAndRepair(int addr, std::vector<uint8_t>::const_iterator start, std::vector<uint8_t>::const_iterator end, int retries, int eraseSize)
+{
+	const size_t len = std::distance(start, end);
+	const uint8_t *expected = &*start;
+	for(int attempt = 0; ; attempt++)
+	{
+		auto readback = readRange(addr, len, false);
+
+		std::vector<size_t> badPages;
+		bool eraseNeeded = false;
+		for(size_t offset = 0; offset < len; offset += pageSize)
+		{
+			size_t pageLen = std::min(len - offset, static_cast<size_t>(pageSize));
+			if(BufferUtility::findFirstMismatch(readback.data() + offset, expected + offset, pageLen))
+			{
+				badPages.push_back(offset);
+				eraseNeeded |= !BufferUtility::canProgramWithoutErase(readback.data() + offset, expected + offset, pageLen);
+			}
+		}
+
+		if(badPages.empty())
+		{
+			return;
+		}
+		if(attempt >= retries)
+		{
+			std::ostringstream ss;
+			ss << "Verification failed for " << badPages.size() << " pages in block at 0x" << std::hex << addr;
+			if(retries)
+			{
+				ss << std::dec << " after " << retries << " retries";
+			}
+			throw SpiFlashException(ss.str());
+		}
+
+		retriedPages += badPages.size();
+		if(eraseNeeded)
+		{
+			blockErase(addr, eraseSize);
+			programPages(addr, start, end, false);
+		} else {
+			for(auto offset : badPages)
+			{
+				auto pageStart = start + offset;
+				auto pageEnd = (len - offset > static_cast<size_t>(pageSize)) ? pageStart + pageSize : end;
+				waitUntilReady();
+				write(addr + offset, pageStart, pageEnd);
+			}
+		}
+		waitUntilReady();
+	}
+}
+
+template<class Backend> void SpiFlashT<Backend>::startProgress(size_t total, bool showBar)
+{
+	progressDone = 0;
+	progressTotal = total;
+	progressDisplay.reset();
+	if(progressCallback)
+	{
+		progressCallback(0, total);
+	} else if(showBar) {
+		progressDisplay = std::make_unique<display_t>(total, std::cerr, "");
+	}
+}
+
+template<class Backend> void SpiFlashT<Backend>::advanceProgress(size_t bytes)
+{
+	progressDone += bytes;
+	if(progressCallback)
+	{
+		progressCallback(progressDone, progressTotal);
+	} else if(progressDisplay) {
+		*progressDisplay += bytes;
+	}
+}
+
+template<class Backend> void SpiFlashT<Backend>::checkCancelled(void)
+{
+	if(cancelFlag and cancelFlag->load())
+	{
+		throw SpiFlashCancelled();
+	}
+}
+
+#endif
@@ -3,6 +3,9 @@
 
 // Interface for SPI
 
+#include <vector>
+#include <stdint.h>
+
 class SpiInterface
 {
 public:
@@ -0,0 +1,81 @@
+#include "SpiRecorder.hpp"
+
+SpiRecorder::SpiRecorder(SpiInterface *spi, std::string filename)
+:spi(spi), file(filename, std::ios::out | std::ios::binary)
+{
+	if(!file)
+	{
+		throw SpiTraceException("Could not open trace file for writing: " + filename);
+	}
+	file.write(SpiTrace::magic, sizeof(SpiTrace::magic));
+
+	startTime = clock_t::now();
+	lastTime = startTime;
+}
+
+SpiRecorder::~SpiRecorder()
+{
+	file.flush();
+}
+
+std::vector<uint8_t> SpiRecorder::transfer(std::vector<uint8_t> data)
+{
+	auto ret = spi->transfer(data);
+	writeRecord(SpiTrace::RecordType::TRANSFER, &data, &ret);
+	return ret;
+}
+
+void SpiRecorder::setCs(bool val)
+{
+	spi->setCs(val);
+	writeRecord(val ? SpiTrace::RecordType::CS_HIGH : SpiTrace::RecordType::CS_LOW, nullptr, nullptr);
+}
+
+void SpiRecorder::send(std::vector<uint8_t> data)
+{
+	spi->send(data);
+	writeRecord(SpiTrace::RecordType::SEND, &data, nullptr);
+}
+
+std::vector<uint8_t> SpiRecorder::receive(int num)
+{
+	auto ret = spi->receive(num);
+	writeRecord(SpiTrace::RecordType::RECEIVE, nullptr, &ret);
+	return ret;
+}
+
+void SpiRecorder::writeRecord(SpiTrace::RecordType type, const std::vector<uint8_t> *tx, const std::vector<uint8_t> *rx)
+{
+	auto now = clock_t::now();
+	auto delta = std::chrono::duration_cast<std::chrono::microseconds>(now - lastTime).count();
+	lastTime = now;
+
+	buf.clear();
+	buf.push_back(static_cast<uint8_t>(type));
+	SpiTrace::putVarint(buf, delta);
+
+	if(tx or rx)
+	{
+		traceStats.calls++;
+	}
+	if(tx)
+	{
+		SpiTrace::putVarint(buf, tx->size());
+		buf.insert(buf.end(), tx->begin(), tx->end());
+		traceStats.txBytes += tx->size();
+	}
+	if(rx)
+	{
+		SpiTrace::putVarint(buf, rx->size());
+		buf.insert(buf.end(), rx->begin(), rx->end());
+		traceStats.rxBytes += rx->size();
+	}
+
+	if(type == SpiTrace::RecordType::CS_LOW)
+	{
+		traceStats.csCycles++;
+	}
+	traceStats.durationUs = std::chrono::duration_cast<std::chrono::microseconds>(now - startTime).count();
+
+	file.write(reinterpret_cast<const char *>(buf.data()), buf.size());
+}
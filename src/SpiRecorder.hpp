@@ -0,0 +1,40 @@
+#ifndef SPI_RECORDER_HPP
+#define SPI_RECORDER_HPP
+
+// Wraps any SpiInterface, passing calls through unchanged
+// Every CS edge and all transmitted/received bytes are written to a trace file (see SpiTrace.hpp)
+
+#include <fstream>
+#include <chrono>
+
+#include "SpiInterface.hpp"
+#include "SpiTrace.hpp"
+
+class SpiRecorder : public SpiInterface
+{
+	public:
+		SpiRecorder(SpiInterface *spi, std::string filename);
+		~SpiRecorder();
+
+		std::vector<uint8_t> transfer(std::vector<uint8_t> data) override;
+		void setCs(bool val) override;
+		void send(std::vector<uint8_t> data) override;
+		std::vector<uint8_t> receive(int num) override;
+
+		const SpiTrace::Stats &stats(void) const { return traceStats; };
+
+	private:
+		void writeRecord(SpiTrace::RecordType type, const std::vector<uint8_t> *tx, const std::vector<uint8_t> *rx);
+
+		SpiInterface *spi;
+		std::ofstream file;
+		std::vector<uint8_t> buf; // Records are built up here, then written out in one go
+
+		typedef std::chrono::steady_clock clock_t;
+		clock_t::time_point startTime;
+		clock_t::time_point lastTime;
+
+		SpiTrace::Stats traceStats;
+};
+
+#endif
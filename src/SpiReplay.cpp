@@ -0,0 +1,159 @@
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+
+#include "SpiReplay.hpp"
+
+static const char *recordName(SpiTrace::RecordType type)
+{
+	switch(type)
+	{
+		case SpiTrace::RecordType::CS_LOW : return "CS low";
+		case SpiTrace::RecordType::CS_HIGH : return "CS high";
+		case SpiTrace::RecordType::SEND : return "send";
+		case SpiTrace::RecordType::RECEIVE : return "receive";
+		case SpiTrace::RecordType::TRANSFER : return "transfer";
+	}
+	return "unknown";
+}
+
+SpiReplay::SpiReplay(std::string filename)
+{
+	std::ifstream is(filename, std::ios::binary);
+	if(!is)
+	{
+		throw SpiTraceException("Could not open trace file: " + filename);
+	}
+	std::vector<uint8_t> buf((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+
+	if(buf.size() < sizeof(SpiTrace::magic) or !std::equal(std::begin(SpiTrace::magic), std::end(SpiTrace::magic), buf.begin()))
+	{
+		throw SpiTraceException("Not a SPI trace file: " + filename);
+	}
+
+	// Read a length prefixed payload. Returns false if truncated
+	auto getPayload = [&buf](size_t &pos, std::vector<uint8_t> &dest)
+	{
+		uint64_t len;
+		if(!SpiTrace::getVarint(buf, pos, len) or len > buf.size() - pos)
+		{
+			return false;
+		}
+		dest.assign(buf.begin()+pos, buf.begin()+pos+len);
+		pos += len;
+		return true;
+	};
+
+	size_t pos = sizeof(SpiTrace::magic);
+	uint64_t timeUs = 0;
+	while(pos < buf.size())
+	{
+		Record rec;
+		rec.type = static_cast<SpiTrace::RecordType>(buf[pos++]);
+		if(rec.type > SpiTrace::RecordType::TRANSFER)
+		{
+			throw SpiTraceException("Corrupt trace, unknown record type at offset " + std::to_string(pos-1));
+		}
+
+		uint64_t delta;
+		if(!SpiTrace::getVarint(buf, pos, delta))
+		{
+			break;
+		}
+		timeUs += delta;
+		rec.timeUs = timeUs;
+
+		bool hasTx = (rec.type == SpiTrace::RecordType::SEND or rec.type == SpiTrace::RecordType::TRANSFER);
+		bool hasRx = (rec.type == SpiTrace::RecordType::RECEIVE or rec.type == SpiTrace::RecordType::TRANSFER);
+		if(hasTx and !getPayload(pos, rec.tx))
+		{
+			break;
+		}
+		if(hasRx and !getPayload(pos, rec.rx))
+		{
+			break;
+		}
+
+		if(hasTx or hasRx)
+		{
+			traceStats.calls++;
+		}
+		traceStats.txBytes += rec.tx.size();
+		traceStats.rxBytes += rec.rx.size();
+		if(rec.type == SpiTrace::RecordType::CS_LOW)
+		{
+			traceStats.csCycles++;
+		}
+		traceStats.durationUs = timeUs;
+
+		records.push_back(std::move(rec));
+	}
+
+	startTime = std::chrono::steady_clock::now();
+}
+
+std::vector<uint8_t> SpiReplay::transfer(std::vector<uint8_t> data)
+{
+	const Record &rec = expect(SpiTrace::RecordType::TRANSFER);
+	if(data != rec.tx)
+	{
+		diverged("transfer data differs from recording");
+	}
+	replayStats.calls++;
+	replayStats.txBytes += data.size();
+	replayStats.rxBytes += rec.rx.size();
+	return rec.rx;
+}
+
+void SpiReplay::setCs(bool val)
+{
+	expect(val ? SpiTrace::RecordType::CS_HIGH : SpiTrace::RecordType::CS_LOW);
+	if(!val)
+	{
+		replayStats.csCycles++;
+	}
+}
+
+void SpiReplay::send(std::vector<uint8_t> data)
+{
+	const Record &rec = expect(SpiTrace::RecordType::SEND);
+	if(data != rec.tx)
+	{
+		diverged("sent data differs from recording");
+	}
+	replayStats.calls++;
+	replayStats.txBytes += data.size();
+}
+
+std::vector<uint8_t> SpiReplay::receive(int num)
+{
+	const Record &rec = expect(SpiTrace::RecordType::RECEIVE);
+	if(static_cast<size_t>(num) != rec.rx.size())
+	{
+		diverged("receive of " + std::to_string(num) + " bytes, recording has " + std::to_string(rec.rx.size()));
+	}
+	replayStats.calls++;
+	replayStats.rxBytes += rec.rx.size();
+	return rec.rx;
+}
+
+const SpiReplay::Record &SpiReplay::expect(SpiTrace::RecordType type)
+{
+	if(finished())
+	{
+		diverged(std::string(recordName(type)) + " requested after end of trace");
+	}
+	const Record &rec = records[nextRecord];
+	if(rec.type != type)
+	{
+		diverged(std::string(recordName(type)) + " requested, recording has " + recordName(rec.type));
+	}
+	nextRecord++;
+	replayStats.durationUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+	return rec;
+}
+
+void SpiReplay::diverged(std::string what)
+{
+	throw SpiTraceException("Replay diverged from trace at record " + std::to_string(nextRecord) + ": " + what);
+}
@@ -0,0 +1,53 @@
+#ifndef SPI_REPLAY_HPP
+#define SPI_REPLAY_HPP
+
+// Serves a trace written by SpiRecorder back as if it were a real SPI device
+// Calls must arrive in the same order with the same transmitted data as when recorded
+// Any divergence throws a SpiTraceException naming the offending record
+// Timestamps are not honoured, the trace is served back as fast as it is requested
+
+#include <string>
+#include <chrono>
+
+#include "SpiInterface.hpp"
+#include "SpiTrace.hpp"
+
+class SpiReplay : public SpiInterface
+{
+	public:
+		SpiReplay(std::string filename);
+
+		std::vector<uint8_t> transfer(std::vector<uint8_t> data) override;
+		void setCs(bool val) override;
+		void send(std::vector<uint8_t> data) override;
+		std::vector<uint8_t> receive(int num) override;
+
+		// True once every record in the trace has been consumed
+		bool finished(void) const { return nextRecord == records.size(); };
+		size_t remaining(void) const { return records.size() - nextRecord; };
+
+		// Statistics of the trace as recorded, and of what has been served so far
+		const SpiTrace::Stats &recordedStats(void) const { return traceStats; };
+		const SpiTrace::Stats &replayedStats(void) const { return replayStats; };
+
+	private:
+		struct Record
+		{
+			SpiTrace::RecordType type;
+			uint64_t timeUs; // Since start of trace
+			std::vector<uint8_t> tx;
+			std::vector<uint8_t> rx;
+		};
+
+		const Record &expect(SpiTrace::RecordType type);
+		[[noreturn]] void diverged(std::string what);
+
+		std::vector<Record> records;
+		size_t nextRecord = 0;
+
+		SpiTrace::Stats traceStats;
+		SpiTrace::Stats replayStats;
+		std::chrono::steady_clock::time_point startTime;
+};
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef SPI_TRACE_HPP
+#define SPI_TRACE_HPP
+
+// Binary trace format shared by SpiRecorder and SpiReplay
+//
+// File layout:
+//   8 byte magic "SPITRC01"
+//   Then records until end of file. Each record is:
+//     1 byte record type
+//     varint: microseconds since previous record
+//     SEND/TRANSFER: varint byte count, then transmitted bytes
+//     RECEIVE/TRANSFER: varint byte count, then received bytes
+//
+// varints are unsigned LEB128 (7 bits per byte, LSB group first, MSB set if more follow)
+// A truncated final record (e.g. if the recording process exited uncleanly) is ignored on load
+
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <iostream>
+#include <iomanip>
+
+class SpiTraceException : public std::runtime_error
+{
+	using std::runtime_error::runtime_error;
+};
+
+namespace SpiTrace
+{
+	constexpr char magic[8] = {'S','P','I','T','R','C','0','1'};
+
+	enum class RecordType : uint8_t
+	{
+		CS_LOW = 0,
+		CS_HIGH = 1,
+		SEND = 2,
+		RECEIVE = 3,
+		TRANSFER = 4
+	};
+
+	// Counters gathered while recording or replaying
+	// Comparing these between two runs shows how many transactions a change saves
+	struct Stats
+	{
+		uint64_t csCycles = 0; // Number of times CS was asserted
+		uint64_t calls = 0; // Number of send/receive/transfer calls
+		uint64_t txBytes = 0;
+		uint64_t rxBytes = 0;
+		uint64_t durationUs = 0; // Wall clock time covered by the trace
+
+		void print(std::ostream &os) const
+		{
+			std::ios_base::fmtflags flags(os.flags());
+			os << std::dec
+			   << "CS cycles: " << csCycles
+			   << ", calls: " << calls
+			   << ", tx bytes: " << txBytes
+			   << ", rx bytes: " << rxBytes
+			   << ", duration: " << std::fixed << std::setprecision(3) << durationUs/1e6 << "s";
+			os.flags(flags);
+		}
+	};
+
+	inline void putVarint(std::vector<uint8_t> &buf, uint64_t val)
+	{
+		do
+		{
+			uint8_t byte = val & 0x7F;
+			val >>= 7;
+			if(val)
+			{
+				byte |= 0x80;
+			}
+			buf.push_back(byte);
+		} while(val);
+	}
+
+	// Returns false if the buffer ends before the varint is complete
+	inline bool getVarint(const std::vector<uint8_t> &buf, size_t &pos, uint64_t &val)
+	{
+		val = 0;
+		for(int shift = 0; shift < 64; shift += 7)
+		{
+			if(pos >= buf.size())
+			{
+				return false;
+			}
+			uint8_t byte = buf[pos++];
+			val |= static_cast<uint64_t>(byte & 0x7F) << shift;
+			if(!(byte & 0x80))
+			{
+				return true;
+			}
+		}
+		throw SpiTraceException("Corrupt varint in trace");
+	}
+};
+
+#endif
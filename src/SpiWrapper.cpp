@@ -5,54 +5,66 @@
 #include <vector>
 #include <string>
 #include <iostream>
+#include <algorithm>
+#include <fstream>
 
-SpiWrapper::SpiWrapper(std::string devstr, enum ftdi_interface ifnum, uint16_t clockDivider)
+#include "FileUtility.h"
+#include "Timeline.hpp"
+
+SpiWrapper::SpiWrapper(std::string devstr, enum ftdi_interface ifnum, uint16_t clockDivider, bool fastAttach)
+:clockDivider(clockDivider), fastAttach(fastAttach)
 {
 	ftdi_init(&ftdic);
 	ftdi_set_interface(&ftdic, ifnum);
 
-	if (devstr.c_str() != NULL) {
-		if (int val = ftdi_usb_open_string(&ftdic, devstr.c_str())) {
-			fprintf(stderr, "Can't find iCE FTDI USB device (device string %s).\n", devstr.c_str());
-			std::cerr << "Return value: " << val << std::endl;
-			error(2);
-		}
-	} else {
-		if (ftdi_usb_open(&ftdic, 0x0403, 0x6010) && ftdi_usb_open(&ftdic, 0x0403, 0x6014)) {
-			fprintf(stderr, "Can't find iCE FTDI USB device (vendor_id 0x0403, device_id 0x6010 or 0x6014).\n");
-			error(2);
+	bool attached = false;
+	if (fastAttach) {
+		attachFile = FileUtility::cacheDir() + "/" + FileUtility::sanitiseFilename("attach-" + devstr + "-" + std::to_string(ifnum));
+		attached = openCached();
+	}
+
+	if (!attached) {
+		if (devstr.c_str() != NULL) {
+			if (int val = ftdi_usb_open_string(&ftdic, devstr.c_str())) {
+				error("Can't find iCE FTDI USB device (device string " + devstr + ", return value " + std::to_string(val) + ")");
+			}
+		} else {
+			if (ftdi_usb_open(&ftdic, 0x0403, 0x6010) && ftdi_usb_open(&ftdic, 0x0403, 0x6014)) {
+				error("Can't find iCE FTDI USB device (vendor_id 0x0403, device_id 0x6010 or 0x6014)");
+			}
 		}
 	}
 
 	ftdic_open = true;
 
-	if (ftdi_usb_reset(&ftdic)) {
-		fprintf(stderr, "Failed to reset iCE FTDI USB device.\n");
-		error(2);
-	}
+	if (attached and probeMpsse()) {
+		// Still in MPSSE mode from the last run, so the reset and mode change can be skipped
+		// The latency timer is left at whatever that run used, so set it in case it differs
+		ftdi_latency = latencyTimer;
+	} else {
+		if (ftdi_usb_reset(&ftdic)) {
+			error("Failed to reset iCE FTDI USB device");
+		}
 
-	if (ftdi_usb_purge_buffers(&ftdic)) {
-		fprintf(stderr, "Failed to purge buffers on iCE FTDI USB device.\n");
-		error(2);
-	}
+		if (ftdi_usb_purge_buffers(&ftdic)) {
+			error("Failed to purge buffers on iCE FTDI USB device");
+		}
 
-	if (ftdi_get_latency_timer(&ftdic, &ftdi_latency) < 0) {
-		fprintf(stderr, "Failed to get latency timer (%s).\n", ftdi_get_error_string(&ftdic));
-		error(2);
+		if (ftdi_get_latency_timer(&ftdic, &ftdi_latency) < 0) {
+			error(std::string("Failed to get latency timer (") + ftdi_get_error_string(&ftdic) + ")");
+		}
 	}
 
 	/* 1 is the fastest polling, it means 1 kHz polling */
-	if (ftdi_set_latency_timer(&ftdic, 1) < 0) {
-		fprintf(stderr, "Failed to set latency timer (%s).\n", ftdi_get_error_string(&ftdic));
-		error(2);
+	if (ftdi_set_latency_timer(&ftdic, latencyTimer) < 0) {
+		error(std::string("Failed to set latency timer (") + ftdi_get_error_string(&ftdic) + ")");
 	}
 
 	ftdic_latency_set = true;
 
 	/* Enter MPSSE (Multi-Protocol Synchronous Serial Engine) mode. Set all pins to output. */
-	if (ftdi_set_bitmode(&ftdic, 0xff, BITMODE_MPSSE) < 0) {
-		fprintf(stderr, "Failed to set BITMODE_MPSSE on iCE FTDI USB device.\n");
-		error(2);
+	if (!mpsseActive and ftdi_set_bitmode(&ftdic, 0xff, BITMODE_MPSSE) < 0) {
+		error("Failed to set BITMODE_MPSSE on iCE FTDI USB device");
 	}
 
 	// enable clock divide by 5
@@ -62,6 +74,7 @@ SpiWrapper::SpiWrapper(std::string devstr, enum ftdi_interface ifnum, uint16_t c
 	// FT2232D is based around 12MHz clock
 	// FT2232H/FT4232H is based around 60MHz clock
 	// data speed = [xtal speed] / ((1+Divisor)*2)
+	// Always set, even after a fast attach, as the last run may have used a different clock
 	sendByte(MC_SET_CLK_DIV);
 	sendByte(clockDivider & 0xFF); //LSB
 	sendByte((clockDivider >> 8) & 0xFF); //MSB
@@ -69,17 +82,130 @@ SpiWrapper::SpiWrapper(std::string devstr, enum ftdi_interface ifnum, uint16_t c
 	gpio_data = 0x20; // Power on SCK low
 	setCs(true); // Make slave select high
 
-	ftdi_write_data_set_chunksize(&ftdic, 1024*10);
+	ftdi_write_data_set_chunksize(&ftdic, writeChunkSize);
+	flush(0);
+}
+
+bool SpiWrapper::openCached(void)
+{
+	// bus, address and serial number of the device this device string opened last time
+	std::ifstream is(attachFile);
+	int bus, addr;
+	std::string serial;
+	if(!(is >> bus >> addr) or ftdi_usb_open_bus_addr(&ftdic, bus, addr) != 0)
+	{
+		return false;
+	}
+	std::getline(is >> std::ws, serial);
+	// Addresses are reused when devices are plugged in again, so make sure it is the same one
+	if(serialNumber() != serial)
+	{
+		ftdi_usb_close(&ftdic);
+		return false;
+	}
+	return true;
+}
+
+bool SpiWrapper::probeMpsse(void)
+{
+	// Drain anything left over from an interrupted run
+	if (ftdi_usb_purge_buffers(&ftdic)) {
+		return false;
+	}
+	uint8_t stale[512];
+	for(int i = 0; i < 16 and ftdi_read_data(&ftdic, stale, sizeof(stale)) > 0; i++);
+
+	// MPSSE answers an invalid command with 0xFA followed by the command. The flush avoids waiting for the latency timer
+	// If a normal run has since taken the device out of MPSSE mode, this goes out as UART data with CS (DTR) high, so is harmless
+	uint8_t probe[] = {0xAA, MC_FLUSH};
+	if(ftdi_write_data(&ftdic, probe, sizeof(probe)) != sizeof(probe))
+	{
+		return false;
+	}
+	uint8_t reply[2];
+	int got = 0;
+	for(int i = 0; i < 16 and got < 2; i++)
+	{
+		int rc = ftdi_read_data(&ftdic, reply + got, 2 - got);
+		if(rc < 0)
+		{
+			return false;
+		}
+		got += rc;
+	}
+	mpsseActive = (got == 2 and reply[0] == 0xFA and reply[1] == probe[0]);
+	return mpsseActive;
+}
+
+void SpiWrapper::setClockDivider(uint16_t divider)
+{
+	clockDivider = divider;
+	cmdBuf.push_back(MC_SET_CLK_DIV);
+	cmdBuf.push_back(divider & 0xFF); //LSB
+	cmdBuf.push_back((divider >> 8) & 0xFF); //MSB
+	flush(0);
+}
+
+void SpiWrapper::setLatencyTimer(unsigned char ms)
+{
+	flush(0);
+	if (ftdi_set_latency_timer(&ftdic, ms) < 0) {
+		error(std::string("Failed to set latency timer (") + ftdi_get_error_string(&ftdic) + ")");
+	}
+	latencyTimer = ms;
+}
+
+void SpiWrapper::setWriteChunkSize(size_t size)
+{
+	flush(0);
+	writeChunkSize = size;
+	ftdi_write_data_set_chunksize(&ftdic, size);
 }
 
 SpiWrapper::~SpiWrapper()
 {
 	fprintf(stderr, "Bye.\n");
+	if(failed)
+	{
+		// Already closed by error()
+		return;
+	}
 	gpio_data = 0; // All lines off
-	setCs(false);
+	cmdBuf.push_back(MC_SETB_LOW);
+	cmdBuf.push_back(0x00); /* Value */
+	cmdBuf.push_back(0x83 | csLowMask); /* Direction */
+	if(csHighMask)
+	{
+		cmdBuf.push_back(MC_SETB_HIGH);
+		cmdBuf.push_back(0x00); /* Value */
+		cmdBuf.push_back(fastAttach ? 0x00 : csHighMask); /* Direction */
+	}
+	if(fastAttach)
+	{
+		// MPSSE mode is kept, so release the pins instead (e.g. to let an FPGA configure from the flash)
+		cmdBuf.push_back(MC_SETB_LOW);
+		cmdBuf.push_back(0x00); /* Value */
+		cmdBuf.push_back(0x00); /* Direction */
+	}
+	try
+	{
+		flush(0);
+	} catch (const SpiWrapperException &e) {
+		// The device is gone (e.g. unplugged), and error() has closed it
+		std::cerr << "ERROR: " << e.what() << std::endl;
+		return;
+	}
 
-	ftdi_set_latency_timer(&ftdic, ftdi_latency);
-	ftdi_disable_bitbang(&ftdic);
+	if(fastAttach)
+	{
+		// Remember where the device is, so the next run can attach quickly
+		std::ofstream os(attachFile, std::ios::out | std::ios::trunc);
+		libusb_device *dev = libusb_get_device(ftdic.usb_dev);
+		os << static_cast<int>(libusb_get_bus_number(dev)) << " " << static_cast<int>(libusb_get_device_address(dev)) << " " << serialNumber() << "\n";
+	} else {
+		ftdi_set_latency_timer(&ftdic, ftdi_latency);
+		ftdi_disable_bitbang(&ftdic);
+	}
 	ftdi_usb_close(&ftdic);
 	ftdi_deinit(&ftdic);
 }
@@ -88,98 +214,295 @@ void SpiWrapper::sendByte(uint8_t data)
 {
 	int rc = ftdi_write_data(&ftdic, &data, 1);
 	if (rc != 1) {
-		fprintf(stderr, "Write error (single byte, rc=%d, expected %d).\n", rc, 1);
-		error(2);
+		error("Write error (single byte, rc=" + std::to_string(rc) + ", expected 1)");
 	}
 }
 
-uint8_t SpiWrapper::recvByte(void)
+void SpiWrapper::setCs(bool val)
 {
-	uint8_t data;
-	while (1) {
-		int rc = ftdi_read_data(&ftdic, &data, 1);
-		if (rc < 0) {
-			fprintf(stderr, "Read error.\n");
-			error(2);
+	// All chip selects high, then the selected one low if asserting
+	uint8_t gpio = gpio_data | csLowMask;
+	uint8_t gpioHigh = csHighMask;
+
+	if(!val)
+	{
+		int pin = csPins[selectedChip];
+		if(pin < 8)
+		{
+			gpio &= ~(1 << pin);
+		} else {
+			gpioHigh &= ~(1 << (pin - 8));
 		}
-		if (rc == 1)
-			break;
-//		usleep(100);
 	}
-	return data;
+	//std::cout << "Setting GPIO: " << std::hex <<(int)gpio << std::endl;
+	cmdBuf.push_back(MC_SETB_LOW);
+	cmdBuf.push_back(gpio); /* Value */
+	cmdBuf.push_back(0x83 | csLowMask); /* Direction */
+	if(csHighMask)
+	{
+		cmdBuf.push_back(MC_SETB_HIGH);
+		cmdBuf.push_back(gpioHigh); /* Value */
+		cmdBuf.push_back(csHighMask); /* Direction */
+	}
 }
 
-void SpiWrapper::setCs(bool val)
+void SpiWrapper::setChipSelects(const std::vector<int> &pins)
 {
-	uint8_t gpio = gpio_data;
+	if(pins.empty())
+	{
+		throw std::invalid_argument("No chip select pins given");
+	}
+	uint8_t lowMask = 0, highMask = 0;
+	for(int pin : pins)
+	{
+		if(!validChipSelect(pin))
+		{
+			throw std::invalid_argument("Invalid chip select pin: " + std::to_string(pin));
+		}
+		if(pin < 8)
+		{
+			lowMask |= 1 << pin;
+		} else {
+			highMask |= 1 << (pin - 8);
+		}
+	}
 
-	if(val)
+	// ACBUS pins no longer used are released
+	if(highMask != csHighMask and csHighMask)
 	{
-		// ADBUS4 (GPIOL0)
-		gpio |= 0x10;
+		cmdBuf.push_back(MC_SETB_HIGH);
+		cmdBuf.push_back(0x00); /* Value */
+		cmdBuf.push_back(0x00); /* Direction */
 	}
-	//std::cout << "Setting GPIO: " << std::hex <<(int)gpio << std::endl;
-	sendByte(MC_SETB_LOW);
-	sendByte(gpio); /* Value */
-	sendByte(0x93); /* Direction */
+	csPins = pins;
+	csLowMask = lowMask;
+	csHighMask = highMask;
+	selectedChip = 0;
+	setCs(true);
+}
+
+void SpiWrapper::selectChip(size_t index)
+{
+	if(index >= csPins.size())
+	{
+		throw std::out_of_range("No chip select " + std::to_string(index));
+	}
+	selectedChip = index;
 }
 
 std::vector<uint8_t> SpiWrapper::transfer(std::vector<uint8_t> data)
+{
+	return clock(data, true);
+}
+
+void SpiWrapper::send(std::vector<uint8_t> data)
+{
+	clock(data, false);
+}
+
+std::vector<uint8_t> SpiWrapper::receive(int num)
+{
+	std::vector<uint8_t> dummy(num,0);
+	return clock(dummy, true);
+}
+
+std::vector<uint8_t> SpiWrapper::clock(const std::vector<uint8_t> &data, bool readBack)
 {
 	std::vector<uint8_t> retVal;
+	retVal.reserve(readBack ? data.size() : 0);
+
+	bool async = queueDepth > 1;
+	size_t segment = (readBack and not async) ? blockingSegment : maxSegment;
 
-	if (data.size() > 0)
+	for(size_t offset = 0; offset < data.size(); offset += segment)
 	{
+		size_t len = std::min(segment, data.size() - offset);
 
-		/* Input and output, update data on negative edge read on positive. */
-		sendByte(MC_DATA_IN | MC_DATA_OUT | MC_DATA_OCN);
-		sendByte(data.size() - 1);
-		sendByte((data.size() - 1) >> 8);
+		/* Update data on negative edge, read on positive. Send only commands don't return any data */
+		cmdBuf.push_back(MC_DATA_OUT | MC_DATA_OCN | (readBack ? MC_DATA_IN : 0));
+		cmdBuf.push_back((len - 1) & 0xFF);
+		cmdBuf.push_back(((len - 1) >> 8) & 0xFF);
+		cmdBuf.insert(cmdBuf.end(), data.begin() + offset, data.begin() + offset + len);
 
-		// For some reason ftdi_write_data seems to fail if xfer size is > 1024?!
-		int to_transfer = data.size();
-		int offset = 0;
-		while(to_transfer > 0)
+		if(readBack and not async)
 		{
-			int this_transfer = (to_transfer > 1024) ? 1024 : to_transfer;
+			auto rx = flush(len);
+			retVal.insert(retVal.end(), rx.begin(), rx.end());
+		}
+	}
 
-			int rc = ftdi_write_data(&ftdic, data.data() + offset, this_transfer);
-			if (rc != this_transfer) {
-				fprintf(stderr, "Write error (chunk, rc=%d, expected %d).\n", rc, (int)data.size());
-				error(2);
+	if(readBack and async)
+	{
+		retVal = flush(data.size());
+	} else if(cmdBuf.size() >= maxSegment) {
+		flush(0);
+	}
+	return retVal;
+}
+
+// Send all buffered commands, and collect expectedRx bytes of response
+std::vector<uint8_t> SpiWrapper::flush(size_t expectedRx)
+{
+	std::vector<uint8_t> rx(expectedRx);
+	if(expectedRx)
+	{
+		// Return the response immediately, rather than waiting for the latency timer
+		cmdBuf.push_back(MC_FLUSH);
+	}
+
+	if(queueDepth > 1)
+	{
+		// Transfers overlap, so the whole exchange is one span
+		Timeline::Span span("bulk exchange", "usb");
+		span.arg("bytesWritten", cmdBuf.size());
+		span.arg("bytesRead", expectedRx);
+		// libftdi reads into a buffer in the context, so only one read may be outstanding. It is queued first
+		struct ftdi_transfer_control *readTc = nullptr;
+		if(expectedRx)
+		{
+			readTc = ftdi_read_data_submit(&ftdic, rx.data(), expectedRx);
+			if(!readTc)
+			{
+				error(std::string("Read submit error (") + ftdi_get_error_string(&ftdic) + ")");
 			}
-			for (auto i = 0; i < this_transfer; i++)
-				retVal.push_back(recvByte());
+		}
 
-			offset += this_transfer;
-			to_transfer -= this_transfer;
+		// Each write is at most one USB transfer, so that queued writes cannot be reordered
+		std::deque<std::pair<struct ftdi_transfer_control *, int>> pending;
+		auto completeWrite = [&]()
+		{
+			int rc = ftdi_transfer_data_done(pending.front().first);
+			if(rc != pending.front().second)
+			{
+				error("Write error (async, rc=" + std::to_string(rc) + ", expected " + std::to_string(pending.front().second) + ")");
+			}
+			pending.pop_front();
+		};
+		for(size_t offset = 0; offset < cmdBuf.size(); offset += writeChunkSize)
+		{
+			if(pending.size() >= queueDepth)
+			{
+				completeWrite();
+			}
+			int len = std::min(writeChunkSize, cmdBuf.size() - offset);
+			auto tc = ftdi_write_data_submit(&ftdic, cmdBuf.data() + offset, len);
+			if(!tc)
+			{
+				error(std::string("Write submit error (") + ftdi_get_error_string(&ftdic) + ")");
+			}
+			pending.emplace_back(tc, len);
+		}
+		while(!pending.empty())
+		{
+			completeWrite();
 		}
+
+		if(readTc)
+		{
+			int rc = ftdi_transfer_data_done(readTc);
+			if(rc != static_cast<int>(expectedRx))
+			{
+				error("Read error (async, rc=" + std::to_string(rc) + ", expected " + std::to_string(expectedRx) + ")");
+			}
+		}
+	} else {
+		writeBlocking(cmdBuf.data(), cmdBuf.size());
+		readBlocking(rx.data(), expectedRx);
 	}
-	return retVal;
+
+	cmdBuf.clear();
+	return rx;
 }
 
-void SpiWrapper::send(std::vector<uint8_t> data)
+void SpiWrapper::writeBlocking(const uint8_t *data, size_t len)
 {
-	transfer(data);
+	while(len)
+	{
+		int this_transfer = std::min(len, writeChunkSize);
+		Timeline::Span span("bulk write", "usb");
+		span.arg("bytes", this_transfer);
+		int rc = ftdi_write_data(&ftdic, data, this_transfer);
+		if (rc != this_transfer) {
+			error("Write error (chunk, rc=" + std::to_string(rc) + ", expected " + std::to_string(this_transfer) + ")");
+		}
+		data += this_transfer;
+		len -= this_transfer;
+	}
 }
 
-std::vector<uint8_t> SpiWrapper::receive(int num)
+void SpiWrapper::readBlocking(uint8_t *data, size_t len)
 {
-	std::vector<uint8_t> dummy(num,0);
-	return transfer(dummy);
+	while(len)
+	{
+		Timeline::Span span("bulk read", "usb");
+		int rc = ftdi_read_data(&ftdic, data, len);
+		if (rc < 0) {
+			error("Read error (rc=" + std::to_string(rc) + ")");
+		}
+		span.arg("bytes", rc);
+		data += rc;
+		len -= rc;
+	}
 }
 
-void SpiWrapper::error(int status)
+uint16_t SpiWrapper::calculateClockDivider(double xtalFreq, double progFreq, double &actualFreq)
 {
-	checkRx();
-	fprintf(stderr, "ABORT.\n");
-	if (ftdic_open) {
-		if (ftdic_latency_set)
-			ftdi_set_latency_timer(&ftdic, ftdi_latency);
-		ftdi_usb_close(&ftdic);
+	uint16_t freqDivider; //Frequency divider for SPI interface
+	// From FTDI MPSSE Basics p.9:
+	// data speed = [xtal speed] / ((1+Divisor)*2)
+	// divisor = ([xtal speed]/(2*[data speed]))-1
+	if(progFreq >= xtalFreq/2.0)
+	{
+		freqDivider = 0x0000;
+	} else {
+		double divider = (xtalFreq / (2.0*progFreq)) -1.0;
+
+		if(divider > (double)0xFFFF)
+		{
+			freqDivider = (double)0xFFFF;
+		} else {
+			freqDivider = (uint16_t)divider;
+		}
 	}
-	ftdi_deinit(&ftdic);
-	exit(status);
+
+	actualFreq = xtalFreq / ((1+ ((double)freqDivider))*2.0);
+	return freqDivider;
+}
+
+std::string SpiWrapper::serialNumber(void)
+{
+	// Go straight to libusb. ftdi_usb_get_strings() closes the device afterwards in some libftdi versions
+	struct libusb_device_descriptor desc;
+	if(libusb_get_device_descriptor(libusb_get_device(ftdic.usb_dev), &desc) < 0 or desc.iSerialNumber == 0)
+	{
+		return "";
+	}
+
+	unsigned char serial[128];
+	int len = libusb_get_string_descriptor_ascii(ftdic.usb_dev, desc.iSerialNumber, serial, sizeof(serial));
+	if(len <= 0)
+	{
+		return "";
+	}
+	return std::string(reinterpret_cast<char *>(serial), len);
+}
+
+// The device is closed, as nothing more can be done with it, and the error is left to the caller
+// (e.g. through a FlashSession future) rather than ending the process
+void SpiWrapper::error(const std::string &msg)
+{
+	if (!failed) {
+		failed = true;
+		if (ftdic_open) {
+			checkRx();
+			if (ftdic_latency_set)
+				ftdi_set_latency_timer(&ftdic, ftdi_latency);
+			ftdi_usb_close(&ftdic);
+			ftdic_open = false;
+		}
+		ftdi_deinit(&ftdic);
+	}
+	throw SpiWrapperException(msg);
 }
 
 void SpiWrapper::checkRx(void)
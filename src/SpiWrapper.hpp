@@ -7,6 +7,8 @@
 #include <ftdi.h>
 #include <string>
 #include <vector>
+#include <deque>
+#include <stdexcept>
 
 #include "SpiInterface.hpp"
 
@@ -50,28 +52,97 @@
 #define MC_DATA_BITS (0x02) /* When set count bits not bytes */
 #define MC_DATA_OCN  (0x01) /* When set update data on negative clock edge */
 
+// USB failures. The device is closed, and can't be used again
+class SpiWrapperException : public std::runtime_error
+{
+	using std::runtime_error::runtime_error;
+};
 
-class SpiWrapper : public SpiInterface
+class SpiWrapper final : public SpiInterface
 {
 	public:
-		SpiWrapper(std::string devstr, enum ftdi_interface ifnum, uint16_t clockDivider);
+		// With fastAttach, the device is left in MPSSE mode on exit and its USB bus and address are cached
+		// The next fast attach opens it directly, and skips the reset and mode change if it still answers as an MPSSE
+		SpiWrapper(std::string devstr, enum ftdi_interface ifnum, uint16_t clockDivider, bool fastAttach = false);
 		~SpiWrapper();
 		std::vector<uint8_t> transfer(std::vector<uint8_t> data) override;
 		void setCs(bool val) override;
 		void send(std::vector<uint8_t> data) override;
 		std::vector<uint8_t> receive(int num) override;
 
+		// USB serial number string of the FTDI device, or empty if it has none
+		std::string serialNumber(void);
+
+		// Calculate the clock divider for the requested SPI clock frequency
+		// xtalFreq is 12MHz for FT2232D, 60MHz for FT2232H/FT4232H
+		// actualFreq is set to the resulting SPI clock frequency
+		static uint16_t calculateClockDivider(double xtalFreq, double progFreq, double &actualFreq);
+
+		// Number of USB write transfers kept in flight
+		// 1 uses blocking libftdi calls. Above 1, writes are submitted asynchronously, and the read for
+		// each response is queued before the commands producing it, so the bus stays busy throughout
+		void setQueueDepth(unsigned int depth) { queueDepth = (depth < 1) ? 1 : depth; };
+		unsigned int getQueueDepth(void) const { return queueDepth; };
+
+		// Settings which can be changed while open (e.g. by FtdiTuner)
+		// SCK is 12MHz/((1+divider)*2), as the divide by 5 prescaler is always enabled
+		void setClockDivider(uint16_t divider);
+		uint16_t getClockDivider(void) const { return clockDivider; };
+		void setLatencyTimer(unsigned char ms);
+		unsigned char getLatencyTimer(void) const { return latencyTimer; };
+		// Size of each USB write transfer
+		void setWriteChunkSize(size_t size);
+		size_t getWriteChunkSize(void) const { return writeChunkSize; };
+
+		// Several flash chips can share the bus, each with its own chip select
+		// Pins 4-7 are ADBUS4-7 (GPIOL0-3), and 8-15 are ACBUS0-7. The default is ADBUS4 alone
+		// Every chip select is driven high, apart from the selected chip's while setCs(false)
+		// N.B. iCE40 boards use ADBUS7 as CRESET, which is otherwise held low
+		void setChipSelects(const std::vector<int> &pins);
+		// Which of the chip selects passed to setChipSelects() setCs() drives
+		void selectChip(size_t index);
+		size_t getChipCount(void) const { return csPins.size(); };
+		static bool validChipSelect(int pin) { return pin >= 4 and pin <= 15; };
+
 	private:
 		void sendByte(uint8_t byte);
-		uint8_t recvByte(void);
-		void error(int status);
+		[[noreturn]] void error(const std::string &msg);
 		void checkRx(void);
+		bool openCached(void);
+		bool probeMpsse(void);
+
+		// Commands are buffered in cmdBuf, and only sent to the device when a response is needed or the buffer is large
+		// This lets chip select changes and page programs go out in a few large USB transfers
+		std::vector<uint8_t> clock(const std::vector<uint8_t> &data, bool readBack);
+		std::vector<uint8_t> flush(size_t expectedRx);
+		void writeBlocking(const uint8_t *data, size_t len);
+		void readBlocking(uint8_t *data, size_t len);
+
 		uint8_t gpio_data;
+		std::vector<int> csPins = {4};
+		size_t selectedChip = 0;
+		uint8_t csLowMask = 0x10; // ADBUS pins used as chip selects
+		uint8_t csHighMask = 0x00; // ACBUS pins used as chip selects
+		std::vector<uint8_t> cmdBuf;
+		unsigned int queueDepth = 1;
+		uint16_t clockDivider;
+		unsigned char latencyTimer = 1;
+		size_t writeChunkSize = 4096;
+
+		// A single MPSSE clock command can move up to 64K
+		static constexpr size_t maxSegment = 65536;
+		// Without a read outstanding, the device's transmit buffer would fill (and stall) while we were still writing
+		// Blocking mode therefore alternates writing and reading in small segments
+		static constexpr size_t blockingSegment = 1024;
 
 		struct ftdi_context ftdic;
 		unsigned char ftdi_latency;
 		bool ftdic_latency_set = false;
 		bool ftdic_open = false;
+		bool failed = false; // error() has closed the device
+		bool fastAttach;
+		bool mpsseActive = false;
+		std::string attachFile;
 
 		enum mpsse_cmd
 		{
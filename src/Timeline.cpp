@@ -0,0 +1,121 @@
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+
+#include "Timeline.hpp"
+
+std::atomic<Timeline *> Timeline::current{nullptr};
+
+Timeline::Timeline(std::string filename)
+:filename(filename), startTime(std::chrono::steady_clock::now())
+{
+	current.store(this);
+}
+
+Timeline::~Timeline()
+{
+	current.store(nullptr);
+	try
+	{
+		save();
+	} catch (const TimelineException &e) {
+		std::cerr << "WARNING: " << e.what() << std::endl;
+	}
+}
+
+double Timeline::nowUs(void) const
+{
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+// Perfetto shows each thread as a track. Small numbers are easier to read than the OS thread id
+int Timeline::threadIndex(void)
+{
+	auto id = std::this_thread::get_id();
+	auto it = threads.find(id);
+	if(it == threads.end())
+	{
+		it = threads.emplace(id, threads.size() + 1).first;
+	}
+	return it->second;
+}
+
+void Timeline::add(const Event &e)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	events.push_back(e);
+	events.back().thread = threadIndex();
+}
+
+void Timeline::save(void)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if(saved)
+	{
+		return;
+	}
+	saved = true;
+
+	std::ofstream file(filename);
+	if(!file)
+	{
+		throw TimelineException("Could not open " + filename + " for writing");
+	}
+
+	// Spans are recorded as they end, but viewers expect them in start order
+	std::stable_sort(events.begin(), events.end(), [](const Event &a, const Event &b) { return a.startUs < b.startUs; });
+
+	file << std::fixed << std::setprecision(3);
+	file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << std::endl;
+	file << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"spi_prog\"}}";
+	for(const auto &e : events)
+	{
+		file << "," << std::endl << "{\"name\":\"" << e.name << "\",\"cat\":\"" << e.category << "\",\"ph\":\"X\""
+			<< ",\"ts\":" << e.startUs << ",\"dur\":" << e.durationUs << ",\"pid\":1,\"tid\":" << e.thread;
+		if(e.numArgs)
+		{
+			file << ",\"args\":{";
+			for(int i = 0; i < e.numArgs; i++)
+			{
+				file << (i ? "," : "") << "\"" << e.args[i].first << "\":" << e.args[i].second;
+			}
+			file << "}";
+		}
+		file << "}";
+	}
+	file << std::endl << "]}" << std::endl;
+
+	if(!file)
+	{
+		throw TimelineException("Could not write " + filename);
+	}
+}
+
+Timeline::Span::Span(const char *name, const char *category)
+:timeline(Timeline::active()), name(name), category(category)
+{
+	if(timeline)
+	{
+		startUs = timeline->nowUs();
+	}
+}
+
+Timeline::Span::~Span()
+{
+	if(!timeline)
+	{
+		return;
+	}
+	Event e{name, category, startUs, timeline->nowUs() - startUs, 0, {}, numArgs};
+	std::copy(args, args + numArgs, e.args);
+	timeline->add(e);
+}
+
+void Timeline::Span::arg(const char *key, uint64_t value)
+{
+	if(timeline and numArgs < maxArgs)
+	{
+		args[numArgs++] = {key, value};
+	}
+}
@@ -0,0 +1,88 @@
+#ifndef TIMELINE_HPP
+#define TIMELINE_HPP
+
+// Records timed spans, and saves them as a Chrome Trace Event file (for Perfetto or chrome://tracing)
+// There is at most one active timeline per process. Code anywhere can mark a span with a Timeline::Span on the stack,
+// which costs a single atomic load when no timeline is active
+//
+// Categories used:
+//   flash - SpiFlash operations
+//   usb   - USB bulk transfers in SpiWrapper
+//   uart  - wishbone UART packets in WbUart
+//   file  - image and output file I/O
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <stdexcept>
+#include <stdint.h>
+
+class TimelineException : public std::runtime_error
+{
+	using std::runtime_error::runtime_error;
+};
+
+class Timeline
+{
+	public:
+		// Becomes the active timeline until destroyed, when it is saved to filename
+		Timeline(std::string filename);
+		~Timeline();
+
+		static Timeline *active(void) { return current.load(std::memory_order_relaxed); };
+
+		// Written on destruction, but can be called earlier to check for errors
+		void save(void);
+
+		static constexpr int maxArgs = 3;
+
+		// Marks the time from construction to destruction. name and category must be string literals
+		class Span
+		{
+			public:
+				Span(const char *name, const char *category);
+				~Span();
+
+				// Shown with the span, e.g. bytes moved. Only the first maxArgs are kept
+				void arg(const char *key, uint64_t value);
+
+			private:
+				Timeline *timeline;
+				const char *name;
+				const char *category;
+				double startUs;
+				std::pair<const char *, uint64_t> args[maxArgs];
+				int numArgs = 0;
+		};
+
+	private:
+		struct Event
+		{
+			const char *name;
+			const char *category;
+			double startUs;
+			double durationUs;
+			int thread;
+			std::pair<const char *, uint64_t> args[maxArgs];
+			int numArgs;
+		};
+
+		double nowUs(void) const;
+		void add(const Event &e);
+		int threadIndex(void);
+
+		static std::atomic<Timeline *> current;
+
+		std::string filename;
+		std::chrono::steady_clock::time_point startTime;
+		std::mutex mutex;
+		std::vector<Event> events;
+		std::map<std::thread::id, int> threads;
+		bool saved = false;
+};
+
+#endif
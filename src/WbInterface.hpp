@@ -3,6 +3,7 @@
 // Interface to send data over a Wishbone bus
 
 #include <vector>
+#include <cstddef>
 #include <stdint.h>
 
 enum class AddressMode
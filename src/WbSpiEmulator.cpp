@@ -0,0 +1,107 @@
+#include "WbSpiEmulator.hpp"
+
+WbSpiEmulator::WbSpiEmulator(FlashEmulator *flash, uintptr_t base_addr)
+:flash(flash), base_addr(base_addr)
+{
+}
+
+void WbSpiEmulator::write(uintptr_t addr, AddressMode addr_mode, std::vector<uint8_t>::iterator begin, std::vector<uint8_t>::iterator end)
+{
+	for(auto it = begin; it != end; it++)
+	{
+		write_reg(addr, *it);
+		if(addr_mode == AddressMode::INCREMENT)
+		{
+			addr++;
+		}
+	}
+}
+
+std::vector<uint8_t> WbSpiEmulator::read(uintptr_t addr, AddressMode addr_mode, size_t num)
+{
+	std::vector<uint8_t> ret(num);
+	for(auto &word : ret)
+	{
+		word = read_reg(addr);
+		if(addr_mode == AddressMode::INCREMENT)
+		{
+			addr++;
+		}
+	}
+	return ret;
+}
+
+void WbSpiEmulator::write_reg(uintptr_t addr, uint8_t val)
+{
+	switch(addr - base_addr)
+	{
+		case 1: // Config
+		{
+			bool cs_was_high = config & 0x01;
+			bool cs_high = val & 0x01;
+			if(cs_was_high and !cs_high)
+			{
+				flash->select();
+			} else if(!cs_was_high and cs_high) {
+				flash->deselect();
+			}
+			config = val & 0x03;
+			break;
+		}
+		case 2: // Data
+			shift(val);
+			break;
+		case 3: // Inject dummy bytes
+			for(unsigned int i=0; i<val; i++)
+			{
+				shift(0xFF);
+			}
+			break;
+		default:
+			emu_stats.unmapped_accesses++;
+			break;
+	}
+}
+
+uint8_t WbSpiEmulator::read_reg(uintptr_t addr)
+{
+	switch(addr - base_addr)
+	{
+		case 0: // Reserved
+			return 0;
+		case 1:
+			return config;
+		case 2:
+		{
+			if(rx_fifo.empty())
+			{
+				emu_stats.fifo_underflows++;
+				return 0xFF;
+			}
+			uint8_t ret = rx_fifo.front();
+			rx_fifo.pop_front();
+			return ret;
+		}
+		case 3:
+			return 0;
+		default:
+			emu_stats.unmapped_accesses++;
+			return 0;
+	}
+}
+
+void WbSpiEmulator::shift(uint8_t mosi)
+{
+	emu_stats.spi_bytes++;
+	uint8_t miso = (config & 0x01) ? 0xFF : flash->exchange(mosi);
+	if(config & 0x02) // Discard RX
+	{
+		return;
+	}
+	if(rx_fifo.size() >= FIFO_DEPTH)
+	{
+		emu_stats.fifo_overflows++;
+		return;
+	}
+	rx_fifo.push_back(miso);
+}
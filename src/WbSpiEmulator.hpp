@@ -0,0 +1,44 @@
+#ifndef WB_SPI_EMULATOR_HPP
+#define WB_SPI_EMULATOR_HPP
+
+// Emulation of the wishbone SPI master (wb_to_spi_master), with an emulated flash attached
+// Register map is as described in WbSpiWrapper.hpp
+// The receive FIFO holds 255 bytes. Overflowing it, or reading it while empty, is counted (the hardware would misbehave)
+// Accesses outside the four registers are ignored (reads return 0) and counted
+
+#include <deque>
+
+#include "WbInterface.hpp"
+#include "FlashEmulator.hpp"
+
+class WbSpiEmulator : public WbInterface<uint8_t>
+{
+	public:
+		WbSpiEmulator(FlashEmulator *flash, uintptr_t base_addr);
+
+		void write(uintptr_t addr, AddressMode addr_mode, std::vector<uint8_t>::iterator begin, std::vector<uint8_t>::iterator end) override;
+		std::vector<uint8_t> read(uintptr_t addr, AddressMode addr_mode, size_t num) override;
+
+		struct Stats
+		{
+			uint64_t spi_bytes = 0;
+			uint64_t fifo_overflows = 0;
+			uint64_t fifo_underflows = 0;
+			uint64_t unmapped_accesses = 0;
+		};
+		const Stats &stats(void) const { return emu_stats; };
+
+	private:
+		static constexpr size_t FIFO_DEPTH = 255;
+
+		void write_reg(uintptr_t addr, uint8_t val);
+		uint8_t read_reg(uintptr_t addr);
+		void shift(uint8_t mosi);
+
+		FlashEmulator *flash;
+		uintptr_t base_addr;
+		uint8_t config = 0x01; // CS high (deselected), keep RX
+		std::deque<uint8_t> rx_fifo;
+		Stats emu_stats;
+};
+#endif
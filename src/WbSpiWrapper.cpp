@@ -23,7 +23,7 @@ std::vector<uint8_t> WbSpiWrapper::transfer(std::vector<uint8_t> data)
 	{
 		auto next_iter = VectorUtility::chunk<uint8_t>(cur_iter, data.end(),255);
 		auto len = next_iter-cur_iter;
-		iface->write(base_addr+2,AddressMode::FIXED, data.begin(), data.end());
+		iface->write(base_addr+2,AddressMode::FIXED, cur_iter, next_iter);
 		auto temp = iface->read(base_addr+2,AddressMode::FIXED,len);
 		ret.insert(ret.end(), temp.begin(), temp.end());
 		cur_iter = next_iter;
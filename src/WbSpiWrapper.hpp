@@ -16,7 +16,7 @@
 #include "WbInterface.hpp"
 #include "SpiInterface.hpp"
 
-class WbSpiWrapper : public SpiInterface
+class WbSpiWrapper final : public SpiInterface
 {
 	public:
 		WbSpiWrapper(WbInterface<uint8_t> *iface, uintptr_t base_addr);
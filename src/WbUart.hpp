@@ -8,12 +8,20 @@
 #include <exception>
 #include <thread>
 #include <chrono>
+#include <array>
+#include <cstring>
+#include <type_traits>
 
 #include <boost/endian/conversion.hpp>
 
 #include <boost/asio/serial_port.hpp>
 #include <boost/asio/write.hpp>
 #include <boost/asio/read.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
 
 #include <boost/version.hpp>
 // io_service changed to io_context in 1.66
@@ -24,57 +32,158 @@
 #endif
 
 #include "VectorUtility.h"
+#include "ByteSwapUtility.h"
 
 #include "WbInterface.hpp"
+#include "Timeline.hpp"
 
 class WbUartException : public std::runtime_error
 {
 	using std::runtime_error::runtime_error;
 };
 
+// A read response did not arrive in time, even after any retries
+class WbUartTimeout : public WbUartException
+{
+	using WbUartException::WbUartException;
+};
+
+// Packet framing and (de)serialisation for the serial_wb_master bridge
+// Everything here depends only on the template parameters, so the layout is fixed at compile time
+//
+// Each transaction is:
+//   One byte of flags (bit 0 !r/w, bit 1 address increment)
+//   Then address in big endian format, only as many bytes as needed for ADDR_BITS
+//   Then one byte of count (in words)
+//   Then data for tx (big endian words), or nothing for rx
+template<class DATA_T, int ADDR_BITS> struct WbUartFraming
+{
+	static_assert(std::is_unsigned<DATA_T>::value, "Wishbone data type must be unsigned");
+	static_assert(ADDR_BITS > 0 and ADDR_BITS <= 8*static_cast<int>(sizeof(uintptr_t)), "Invalid address width");
+
+	// This is ceil() for integers
+	static constexpr unsigned int ADDR_BYTES = ADDR_BITS/8 + (ADDR_BITS%8 != 0);
+	static constexpr unsigned int HEADER_BYTES = 1 + ADDR_BYTES + 1;
+	static constexpr unsigned int MAX_WORDS = 255; // Count is a single byte
+
+	typedef std::array<uint8_t, HEADER_BYTES> header_t;
+
+	static constexpr header_t format_transaction_metadata(bool write, uint8_t count, uintptr_t addr, AddressMode addr_mode)
+	{
+		header_t ret{};
+
+		// Operation
+		ret[0] = static_cast<uint8_t>(write) | ((addr_mode == AddressMode::INCREMENT) ? 0x2 : 0x0);
+
+		// Addr
+		for(unsigned int i=0; i<ADDR_BYTES; i++)
+		{
+			ret[1+i] = (addr >> (8*(ADDR_BYTES-1-i))) & 0xFF;
+		}
+
+		// Size
+		ret[HEADER_BYTES-1] = count;
+
+		return ret;
+	}
+
+	// Wire data is big endian, so only little endian hosts need to swap
+	static void data_to_uint8(const DATA_T *src, size_t num, uint8_t *dest)
+	{
+		if constexpr (sizeof(DATA_T) == 1 or boost::endian::order::native == boost::endian::order::big)
+		{
+			memcpy(dest, src, num*sizeof(DATA_T));
+		} else {
+			ByteSwapUtility::swap<sizeof(DATA_T)>(reinterpret_cast<const uint8_t *>(src), dest, num);
+		}
+	}
+
+	// num is in words. Any trailing partial word is ignored
+	static void uint8_to_data(const uint8_t *src, size_t num, DATA_T *dest)
+	{
+		if constexpr (sizeof(DATA_T) == 1 or boost::endian::order::native == boost::endian::order::big)
+		{
+			memcpy(dest, src, num*sizeof(DATA_T));
+		} else {
+			ByteSwapUtility::swap<sizeof(DATA_T)>(src, reinterpret_cast<uint8_t *>(dest), num);
+		}
+	}
+};
+
 template<class DATA_T, int ADDR_BITS> class WbUart : public WbInterface<DATA_T>
 {
 public:
-	WbUart(std::string dev_path, uint32_t baud, bool debug_prints=false)
-	:serial(io, dev_path), debug_prints(debug_prints)
+	typedef WbUartFraming<DATA_T, ADDR_BITS> framing_t;
+
+	// fast_attach skips waiting for garbage still in flight before flushing the input
+	// Only safe if the last user of the port left the bridge idle, e.g. a previous run which exited cleanly
+	WbUart(std::string dev_path, uint32_t baud, bool debug_prints=false, bool fast_attach=false)
+	:serial(io, dev_path), timer(io), baud(baud), debug_prints(debug_prints)
 	{
 		serial.set_option(boost::asio::serial_port_base::baud_rate(baud));
 		// Hardware flow control seems to be broken for the CH340 chips in the linux kernel driver :(
 		//serial.set_option(boost::asio::serial_port_base::flow_control(boost::asio::serial_port_base::flow_control::type::hardware));
+		configure_link();
 
 		// Flush the serial port to get rid of any garbage data
 		tcflush(serial.lowest_layer().native_handle(), TCOFLUSH);
-		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		if(!fast_attach)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		}
 		tcflush(serial.lowest_layer().native_handle(), TCIFLUSH);
 
 	};
 
+	// How long to wait for a read response, on top of the time its bytes take on the wire
+	void set_timeout(std::chrono::milliseconds t) { timeout = t; };
+	// Times to resend a read request whose response timed out. Only safe if reading the target has no side effects
+	// (a FIFO, such as the WbSpiWrapper data register, would lose data), so this is not offered by spi_prog
+	void set_retries(unsigned int r) { retries = r; };
+
+	struct Stats
+	{
+		uint64_t timeouts = 0;
+		uint64_t retries = 0;
+
+		void print(std::ostream &os) const
+		{
+			os << timeouts << " read timeouts, " << retries << " retried";
+		};
+	};
+	const Stats &stats(void) const { return link_stats; };
+
 	virtual void write(uintptr_t addr, AddressMode addr_mode, typename std::vector<DATA_T>::iterator begin, typename std::vector<DATA_T>::iterator end) override
 	{
 		auto cur_iter = begin;
 		while(cur_iter != end)
 		{
-			auto next_iter = VectorUtility::chunk<DATA_T>(cur_iter, end, 255);
+			auto next_iter = VectorUtility::chunk<DATA_T>(cur_iter, end, framing_t::MAX_WORDS);
 			auto len = next_iter-cur_iter;
-			auto meta = format_transaction_metadata(true, len, addr, addr_mode);
-			if(debug_prints)
-			{
-				std::cout << "(wr) Sending metadata: ";
-				VectorUtility::print(meta);
-				std::cout << std::endl;
-			}
-			boost::asio::write(serial, boost::asio::buffer(meta));
 
-			auto transmit_data = data_to_uint8(cur_iter,next_iter);
+			// Header and data are sent in a single write
+			auto meta = framing_t::format_transaction_metadata(true, len, addr, addr_mode);
+			packet.resize(framing_t::HEADER_BYTES + len*sizeof(DATA_T));
+			std::copy(meta.begin(), meta.end(), packet.begin());
+			framing_t::data_to_uint8(&*cur_iter, len, packet.data()+framing_t::HEADER_BYTES);
 
 			if(debug_prints)
 			{
+				std::cout << "(wr) Sending metadata: ";
+				VectorUtility::print(std::vector<uint8_t>(meta.begin(), meta.end()));
+				std::cout << std::endl;
 				std::cout << "(wr) Sending data: ";
-				VectorUtility::print(transmit_data);
+				VectorUtility::print(std::vector<uint8_t>(packet.begin()+framing_t::HEADER_BYTES, packet.end()));
 				std::cout << std::endl;
 			}
-			boost::asio::write(serial, boost::asio::buffer(transmit_data));
+			Timeline::Span span("write packet", "uart");
+			span.arg("bytes", packet.size());
+			boost::asio::write(serial, boost::asio::buffer(packet));
 
+			if(addr_mode == AddressMode::INCREMENT)
+			{
+				addr += len;
+			}
 			cur_iter = next_iter;
 		}
 	};
@@ -82,153 +191,158 @@ public:
 	virtual std::vector<DATA_T> read(uintptr_t addr, AddressMode addr_mode, size_t num) override
 	{
 
-		std::vector<DATA_T> ret;
-		ret.reserve(num);
+		std::vector<DATA_T> ret(num);
 
-		for(auto i=0u; i<num; i+=255)
+		for(auto i=0u; i<num; i+=framing_t::MAX_WORDS)
 		{
-			auto next_inc = num-i < 255? num-i : 255;
+			auto next_inc = num-i < framing_t::MAX_WORDS? num-i : framing_t::MAX_WORDS;
 
-			// Assume write to constant address
-			auto packet = format_transaction_metadata(false, next_inc, addr, addr_mode);
+			auto meta = framing_t::format_transaction_metadata(false, next_inc, addr, addr_mode);
 
-			if(debug_prints)
+			// Covers the request and the wait for its response
+			Timeline::Span span("read packet", "uart");
+			span.arg("bytes", next_inc*sizeof(DATA_T));
+			const size_t num_to_read = next_inc*sizeof(DATA_T);
+			packet.resize(num_to_read);
+			for(unsigned int attempt = 0; ; attempt++)
 			{
-				std::cout << "(rd) Sending metadata: ";
-				VectorUtility::print(packet);
-				std::cout << std::endl;
-			}
-			boost::asio::write(serial, boost::asio::buffer(packet));
+				if(debug_prints)
+				{
+					std::cout << "(rd) Sending metadata: ";
+					VectorUtility::print(std::vector<uint8_t>(meta.begin(), meta.end()));
+					std::cout << std::endl;
+				}
+				boost::asio::write(serial, boost::asio::buffer(meta));
 
-			// Get data back
-			const size_t num_to_read = num*sizeof(DATA_T);
-			if(debug_prints)
-			{
-				std::cout << "(rd) Trying to read:" << num_to_read << std::endl;
-			}
-			std::vector<uint8_t> buf(num_to_read);
-			auto num_read = boost::asio::read(serial, boost::asio::buffer(buf));
+				// Get data back
+				if(debug_prints)
+				{
+					std::cout << "(rd) Trying to read:" << num_to_read << std::endl;
+				}
+				auto num_read = read_with_deadline(packet.data(), num_to_read);
+				if(num_read == num_to_read)
+				{
+					break;
+				}
 
-			if(num_read != num_to_read)
-			{
-				throw WbUartException("Timed out when reading");
+				link_stats.timeouts++;
+				resync();
+				if(attempt >= retries)
+				{
+					throw WbUartTimeout("Timed out reading " + std::to_string(num_to_read) + " bytes from 0x" + to_hex(addr)
+						+ " (got " + std::to_string(num_read) + ")");
+				}
+				link_stats.retries++;
 			}
 
-			auto part = uint8_to_data(buf.begin(),buf.end());
+			framing_t::uint8_to_data(packet.data(), next_inc, ret.data()+i);
 
 			if(debug_prints)
 			{
 				std::cout << "(rd)Got packet. ";
-				VectorUtility::print(part);
+				VectorUtility::print(std::vector<DATA_T>(ret.begin()+i, ret.begin()+i+next_inc));
 				std::cout << std::endl;
 			}
 
-			ret.insert(ret.end(), part.begin(), part.end());
+			if(addr_mode == AddressMode::INCREMENT)
+			{
+				addr += next_inc;
+			}
 		}
 		return ret;
 	};
 
 private:
-	io_t io;
-	boost::asio::serial_port serial;
-	bool debug_prints;
-
-
-	std::vector<uint8_t> format_transaction_metadata(bool write, uint8_t count, uintptr_t addr, AddressMode addr_mode)
+	// Raw 8 bit mode, and ask the driver to pass on each byte as soon as it arrives
+	// For FTDI adapters, ASYNC_LOW_LATENCY sets the latency timer to 1ms (from 16ms), which dominates each round trip
+	void configure_link(void)
 	{
-		// First bit is !r/w
-		// Then address in big endian format (assume we are doing constant address access if we have to split)
-		// Then one byte of count
-		// Then data verbatim for tx, or nothing for rx
-
-		// This probably isn't the most efficient way of doing it
-		// Many of these things are constants we know at compile time
-		// At the very least we could preallocate the vector
-		// But I'm tired
-		// And the data is going over a UART, so really who cares...
-		// If the answer turns out to be "me", I'll refactor
-
-		std::vector<uint8_t> ret;
-
-		// Operation
-		uint8_t flags = write;
-		if(addr_mode == AddressMode::INCREMENT)
+		int fd = serial.lowest_layer().native_handle();
+		struct termios tio;
+		if(tcgetattr(fd, &tio) == 0)
 		{
-			flags |= 0x2;
+			speed_t ispeed = cfgetispeed(&tio);
+			speed_t ospeed = cfgetospeed(&tio);
+			cfmakeraw(&tio);
+			cfsetispeed(&tio, ispeed);
+			cfsetospeed(&tio, ospeed);
+			tio.c_cflag |= CLOCAL | CREAD;
+			// Wake on the first byte. Reads are non-blocking underneath asio, so deadlines come from the timer, not VTIME
+			tio.c_cc[VMIN] = 1;
+			tio.c_cc[VTIME] = 0;
+			tcsetattr(fd, TCSANOW, &tio);
 		}
-		ret.push_back(flags);
-
-		// Addr
-		boost::endian::native_to_big_inplace(addr);
-		//Only send enough bytes to store the address
-		// This is ceil() for integers
-		constexpr unsigned int ADDR_BYTES = ADDR_BITS/8 + (ADDR_BITS%8 != 0);
-		constexpr unsigned int START_IDX = sizeof(addr)-ADDR_BYTES;
 
-		for(auto i=START_IDX; i< sizeof(addr); i++)
+		// Not every driver supports this (e.g. pseudo-terminals), and it is only an optimisation
+		struct serial_struct ser;
+		if(ioctl(fd, TIOCGSERIAL, &ser) == 0)
 		{
-			//N.B. No endianness conversion
-			ret.push_back(reinterpret_cast<uint8_t*>(&addr)[i]);
+			ser.flags |= ASYNC_LOW_LATENCY;
+			ioctl(fd, TIOCSSERIAL, &ser);
 		}
+	};
 
-		// Size
-		ret.push_back(count);
-
-		return ret;
-
-	}
-
-	std::vector<uint8_t> data_to_uint8(typename std::vector<DATA_T>::iterator begin, typename std::vector<DATA_T>::iterator end)
+	// Returns the number of bytes read, which is less than len if the deadline passed first
+	size_t read_with_deadline(uint8_t *data, size_t len)
 	{
-		std::vector<uint8_t> data;
-		data.reserve(((end-begin)*sizeof(DATA_T)));
-		if(sizeof(DATA_T) == 1)
+		// 10 bits per byte on the wire (8n1)
+		auto wire_time = std::chrono::microseconds(static_cast<uint64_t>(len*10e6/baud));
+		size_t got = 0;
+		bool read_done = false;
+
+		boost::asio::async_read(serial, boost::asio::buffer(data, len), [&](const boost::system::error_code &, size_t n)
 		{
-			// We can bypass the complex logic for the special case of size 1
-			std::copy(begin,end,std::back_inserter(data));
-		} else {
-			for(auto iter = begin; iter != end; iter++)
+			got = n;
+			read_done = true;
+			timer.cancel();
+		});
+#if (((BOOST_VERSION / 100000) == 1) && (BOOST_VERSION / 100 % 1000) >=66)
+		timer.expires_after(timeout + wire_time);
+#else
+		timer.expires_from_now(timeout + wire_time);
+#endif
+		timer.async_wait([&](const boost::system::error_code &ec)
+		{
+			if(!ec and !read_done)
 			{
-				auto datum = boost::endian::big_to_native(*iter);
-				for(auto i=0u; i<sizeof(datum); i++)
-				{
-					data.push_back(reinterpret_cast<uint8_t*>(&datum)[i]);
-				}
+				serial.cancel();
 			}
-		}
-		return data;
-	}
+		});
+
+#if (((BOOST_VERSION / 100000) == 1) && (BOOST_VERSION / 100 % 1000) >=66)
+		io.restart();
+#else
+		io.reset();
+#endif
+		io.run();
+		return got;
+	};
 
-	std::vector<DATA_T> uint8_to_data(typename std::vector<uint8_t>::iterator begin, typename std::vector<uint8_t>::iterator end)
+	// The bridge drops a partial transaction once the line has been quiet for a while
+	// Wait that long, then throw away anything which arrived late, so the next request starts clean
+	void resync(void)
 	{
-		std::vector<DATA_T> data;
+		std::this_thread::sleep_for(resync_gap);
+		tcflush(serial.lowest_layer().native_handle(), TCIOFLUSH);
+	};
 
-		size_t size_data_words = (end-begin)/sizeof(DATA_T) + ((end-begin)%sizeof(DATA_T) != 0);
-		data.reserve(size_data_words);
-		if(sizeof(DATA_T) == 1)
-		{
-			// We can bypass the complex logic for the special case of size 1
-			std::copy(begin,end,std::back_inserter(data));
-		} else {
-			auto iter = begin;
-			while(iter != end)
-			{
-				DATA_T datum(0);
-				for(auto i=0u; i<sizeof(DATA_T); i++)
-				{
-					datum |= (static_cast<DATA_T>(*iter) << 8*i);
-					iter++;
-					if(iter == end)
-					{
-						break;
-					}
-				}
+	static std::string to_hex(uintptr_t val)
+	{
+		char buf[2*sizeof(uintptr_t) + 1];
+		snprintf(buf, sizeof(buf), "%lx", static_cast<unsigned long>(val));
+		return buf;
+	};
 
-				boost::endian::native_to_big_inplace(datum);
-				data.push_back(datum);
-			}
-		}
-		return data;
-	}
+	io_t io;
+	boost::asio::serial_port serial;
+	boost::asio::steady_timer timer;
+	uint32_t baud;
+	std::chrono::milliseconds timeout{500};
+	// How long the line must be quiet before the bridge drops a partial transaction
+	static constexpr std::chrono::milliseconds resync_gap{200};
+	unsigned int retries = 0;
+	Stats link_stats;
+	bool debug_prints;
+	std::vector<uint8_t> packet; // Reused between transactions to avoid reallocating
 };
 #endif
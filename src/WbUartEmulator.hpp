@@ -0,0 +1,93 @@
+#ifndef WB_UART_EMULATOR_HPP
+#define WB_UART_EMULATOR_HPP
+// Emulation of the serial_wb_master UART bridge
+// Decodes the byte stream sent by WbUart (see WbUartFraming) and performs each transaction on a wishbone target
+// Bytes may be fed in arbitrarily sized pieces. Read data is appended to the response for the caller to send back
+
+#include <vector>
+#include <cstdint>
+
+#include "WbUart.hpp"
+#include "WbInterface.hpp"
+
+template<class DATA_T, int ADDR_BITS> class WbUartEmulator
+{
+public:
+	typedef WbUartFraming<DATA_T, ADDR_BITS> framing_t;
+
+	WbUartEmulator(WbInterface<DATA_T> *target)
+	:target(target)
+	{
+		packet.reserve(framing_t::HEADER_BYTES + framing_t::MAX_WORDS*sizeof(DATA_T));
+	};
+
+	void receive(const uint8_t *data, size_t len, std::vector<uint8_t> &response)
+	{
+		for(size_t i=0; i<len; i++)
+		{
+			packet.push_back(data[i]);
+			if(packet.size() == framing_t::HEADER_BYTES and !is_write())
+			{
+				execute_read(response);
+			} else if(packet.size() > framing_t::HEADER_BYTES and packet.size() == framing_t::HEADER_BYTES + count()*sizeof(DATA_T)) {
+				execute_write();
+			} else if(packet.size() == framing_t::HEADER_BYTES and count() == 0) {
+				// Nothing to transfer
+				packet.clear();
+			}
+		}
+	};
+
+	// Drop any partially received transaction, e.g. after the host went quiet mid-packet
+	void reset(void) { packet.clear(); };
+	bool idle(void) const { return packet.empty(); };
+
+	struct Stats
+	{
+		uint64_t reads = 0;
+		uint64_t writes = 0;
+		uint64_t words_read = 0;
+		uint64_t words_written = 0;
+	};
+	const Stats &stats(void) const { return emu_stats; };
+
+private:
+	bool is_write(void) const { return packet[0] & 0x1; };
+	AddressMode addr_mode(void) const { return (packet[0] & 0x2) ? AddressMode::INCREMENT : AddressMode::FIXED; };
+	size_t count(void) const { return packet[framing_t::HEADER_BYTES-1]; };
+	uintptr_t address(void) const
+	{
+		uintptr_t addr = 0;
+		for(unsigned int i=0; i<framing_t::ADDR_BYTES; i++)
+		{
+			addr = (addr << 8) | packet[1+i];
+		}
+		return addr;
+	};
+
+	void execute_read(std::vector<uint8_t> &response)
+	{
+		auto words = target->read(address(), addr_mode(), count());
+		size_t start = response.size();
+		response.resize(start + words.size()*sizeof(DATA_T));
+		framing_t::data_to_uint8(words.data(), words.size(), response.data()+start);
+		emu_stats.reads++;
+		emu_stats.words_read += words.size();
+		packet.clear();
+	};
+
+	void execute_write(void)
+	{
+		std::vector<DATA_T> words(count());
+		framing_t::uint8_to_data(packet.data()+framing_t::HEADER_BYTES, words.size(), words.data());
+		target->write(address(), addr_mode(), words.begin(), words.end());
+		emu_stats.writes++;
+		emu_stats.words_written += words.size();
+		packet.clear();
+	};
+
+	WbInterface<DATA_T> *target;
+	std::vector<uint8_t> packet; // Transaction currently being received
+	Stats emu_stats;
+};
+#endif
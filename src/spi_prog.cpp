@@ -3,12 +3,17 @@
 // Requires : libftdi1, cxxopts, boost (for progress.hpp)
 
 #include <fstream>
+#include <sstream>
 #include <iostream>
 #include <iomanip>
 #include <string>
 #include <bitset>
 #include <array>
 #include <utility> //pair
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <chrono>
 #include <ctype.h>
 
 #include <cxxopts.hpp>
@@ -18,11 +23,23 @@
 #include "ParseUtility.h"
 #include "FileUtility.h"
 #include "VectorUtility.h"
+#include "BufferUtility.h"
 
 #include "SpiWrapper.hpp"
 #include "SpiFlash.hpp"
-#include "WbUart.hpp"
-#include "WbSpiWrapper.hpp"
+#include "SampleVerifier.hpp"
+#include "SpiDevice.hpp"
+#include "FlashSession.hpp"
+#include "FlashScheduler.hpp"
+#include "FlashCache.hpp"
+#include "FtdiTuner.hpp"
+#include "Daemon.hpp"
+#include "Timeline.hpp"
+#include "ImageSource.hpp"
+#include "ImageTransform.hpp"
+#ifdef SPI_PROG_FAKE_FTDI
+#include "FakeFtdi.hpp"
+#endif
 
 template<int N> void print_bits(const unsigned long long val, const std::array<std::pair<std::string, std::string>,N> explanations)
 {
@@ -102,27 +119,90 @@ enum ftdi_interface parseFtdiInterface(std::string str)
 	return ret;
 }
 
+// Write and/or verify the same image on every chip select, with erase and program time interleaved across chips
+int programChips(FlashSession &session, SpiWrapper *ftdi, int address, ImagePtr image, bool write, bool verify)
+{
+	const int numChips = ftdi->getChipCount();
+	return session.submit([&](SpiFlash &f)
+	{
+		FlashScheduler scheduler(&f, numChips, [ftdi](int chip) { ftdi->selectChip(chip); });
+		for(int chip = 0; chip < numChips; chip++)
+		{
+			// Release powerdown in case chip is asleep
+			ftdi->selectChip(chip);
+			f.releasePowerDown();
+			scheduler.add(chip, address, image);
+		}
+
+		int ret = 0;
+		if(write)
+		{
+			std::cout << "Write to " << address << " on " << numChips << " chips" << std::endl;
+			auto start = std::chrono::steady_clock::now();
+			auto stats = scheduler.run();
+			auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+			std::cout << "Wrote " << image->size() << " bytes to each chip in " << ms << "ms: " << stats.erases << " erases, "
+				<< stats.pages << " page programs, " << stats.polls << " status polls" << std::endl;
+		}
+		if(verify)
+		{
+			auto mismatches = scheduler.verify();
+			if(mismatches.empty())
+			{
+				std::cout << "Data verified correctly on all chips (CRC32C 0x" << std::hex << BufferUtility::crc32c(image->data(), image->size()) << std::dec << ")" << std::endl;
+			} else {
+				std::cout << "WARNING: Verifcation error" << std::endl;
+				for(const auto &m : mismatches)
+				{
+					std::cout << std::hex << "Chip " << m.chip << ": mismatches between 0x" << m.first << " and 0x" << m.last << std::dec << std::endl;
+				}
+				ret = -1;
+			}
+		}
+		ftdi->selectChip(0);
+		return ret;
+	}).get();
+}
+
 int main(int argc, char* argv[])
 {
 	//Parse arguments
 	// N.B. for simple verification arguments are constructed/pasesed in order
 
-	std::vector<std::string> optionGroups = {"", "FTDI mode. Use with -t FTDI", "wbuart mode. Use with -m wbuart"};
+	std::vector<std::string> optionGroups = {"", "FTDI mode. Use with -t FTDI", "wbuart mode. Use with -m wbuart", "replay mode. Use with -m replay"};
 	try {
 		cxxopts::Options options(argv[0], "Simple programmer for SPI flash. Multiple operations are supported, and are executed in the order listed in -h");
 		options.add_options(optionGroups[0])
 			("h,help",         "Print help")
-			("m,mode",         "Which device will do the programming. FTDI or wbuart",cxxopts::value<std::string>())
+			("m,mode",         "Which device will do the programming. FTDI, wbuart or replay",cxxopts::value<std::string>())
 			("d,readid",       "Read the ID bytes of the flash")
 			("s,readstatregs", "Read the status registers")
 			("c,customcmd",    "Execute a custom command (comma separated values, no whitespace)",cxxopts::value<std::vector<uint8_t>>())
 			("w,write",        "Write a file to the flash")
 			("r,read",         "Read flash to file")
 			("v,verify",       "Verify against a file")
-			("a,address",      "Address to read from/write to. Must be aligned with sector size",cxxopts::value<int>()->default_value("0"))
-			("i,infile",       "File to write to flash/verify against (use with -w or -v)", cxxopts::value<std::string>())
+			("a,address",      "Address to read from/write to. Must be aligned with sector size for --journal",cxxopts::value<int>()->default_value("0"))
+			("i,infile",       "File to write to flash/verify against (use with -w or -v). May be gzip or zstd compressed", cxxopts::value<std::string>())
 			("o,outfile",      "File to save data read from flash to (use with -r)", cxxopts::value<std::string>())
 			("l,readlen",      "Length to read back from flash. (use with -r, but not -w or -v. In these cases lengh is implicit)", cxxopts::value<int>())
+			("record",         "Record all SPI traffic to a binary trace file", cxxopts::value<std::string>())
+			("journal",        "Record write progress to this file, so that an interrupted write can be resumed (use with -w)", cxxopts::value<std::string>())
+			("resume",         "Resume an interrupted write from the file given with --journal")
+			("cache",          "Skip writing sectors which a local cache says are unchanged since the last write to this chip (use with -w)")
+			("boardid",        "Board identity used to key the cache. Defaults to the FTDI serial number or serial port", cxxopts::value<std::string>())
+			("spotchecks",     "Number of pages to read back to confirm the cache is still valid", cxxopts::value<int>()->default_value("4"))
+			("retries",        "With -w and -v, times to rewrite a page which fails verification before giving up", cxxopts::value<int>()->default_value("2"))
+			("verify-sample",  "Verify this percentage of pages, chosen at random, instead of the whole image", cxxopts::value<double>())
+			("sample-confidence", "Instead of a fixed percentage, sample enough pages to find damage to --sample-defects percent of pages with this confidence, in percent", cxxopts::value<double>())
+			("sample-defects", "Smallest percentage of damaged pages --sample-confidence must find", cxxopts::value<double>()->default_value("1"))
+			("update",         "Only erase the blocks which need it, by comparing with the current flash contents (use with -w)")
+			("previous",       "File holding the current flash contents, used by --update instead of reading them back", cxxopts::value<std::string>())
+			("fastattach",     "Skip resetting the programmer if the last run left it ready, and remember where it is for next time")
+			("daemon",         "Keep the programmer open and serve jobs on this Unix socket instead of running actions", cxxopts::value<std::string>())
+			("dry-run",        "Estimate how long the actions would take with the selected programmer and settings, without opening it")
+			("sparse",         "Holes in -i and --previous files are erased flash, and are not read. Erased blocks are left as holes in -o files")
+			("trace",          "Write a timeline of flash operations, transfers and file I/O to this file, in Chrome trace event format", cxxopts::value<std::string>())
+			("transform",      "Transform -i as it is loaded: bitrev, bswap16, bswap32, bswap64, pad:<pattern>:<align> or fill:<pattern>:<size>, applied in order (e.g. bitrev,pad:0xFF:64K)", cxxopts::value<std::string>())
 			;
 
 		options.add_options(optionGroups[1])
@@ -130,12 +210,20 @@ int main(int argc, char* argv[])
 			("iface",     "Used for mult-interface FTDI chips: A,B,C or D",cxxopts::value<std::string>()->default_value("A"))
 			("xtalfreq",  "FTDI IC crystal frequency either 60MHz or 12MHz. Used for clock divider calculation",cxxopts::value<std::string>()->default_value("12MHz"))
 			("progfreq",  "Desired programming frequency. Max 6MHz for 12MHz clock. Max 30MHz for 60MHz clock",cxxopts::value<std::string>()->default_value("6MHz"))
+			("usbqueue",  "Number of USB writes to keep in flight. 1 uses blocking transfers",cxxopts::value<int>()->default_value("1"))
+			("autotune",  "Find the fastest reliable clock and USB settings for this programmer and board, and save them for later runs")
+			("cs",        "Chip select pins (comma separated). 4-7 for ADBUS4-7, 8-15 for ACBUS0-7. With more than one, -w and -v act on every chip, and their erase and program time is interleaved",cxxopts::value<std::vector<int>>()->default_value("4"))
 			;
 
 		options.add_options(optionGroups[2])
 			("uartdev",   "Serial port device string", cxxopts::value<std::string>())
 			("baud",      "Serial port baud rate", cxxopts::value<int>())
 			("compaddr",  "Address of wishbone SPI component", cxxopts::value<int>())
+			("uarttimeout", "Milliseconds to wait for a read response, on top of its time on the wire", cxxopts::value<int>()->default_value("500"))
+			;
+
+		options.add_options(optionGroups[3])
+			("tracefile", "Trace file previously written with --record", cxxopts::value<std::string>())
 			;
 
 		auto result = options.parse(argc, argv);
@@ -162,24 +250,130 @@ int main(int argc, char* argv[])
 		bool read         = result.count("read");
 		bool verify       = result.count("verify");
 
-		int address = tryParse<int>(result, "address", read or write or verify);
+		std::optional<double> sampleCoverage;
+		std::optional<double> sampleConfidence;
+		if(result.count("verify-sample"))
+		{
+			sampleCoverage = result["verify-sample"].as<double>()/100;
+		}
+		if(result.count("sample-confidence"))
+		{
+			sampleConfidence = result["sample-confidence"].as<double>()/100;
+		}
+		double sampleDefects = tryParse<double>(result, "sample-defects")/100;
+		bool verifySample = sampleCoverage or sampleConfidence;
+		if(verifySample)
+		{
+			if(verify)
+			{
+				throw cxxopts::OptionException("--verify-sample and --sample-confidence replace -v, so cannot be used with it");
+			}
+			if((sampleCoverage and (*sampleCoverage <= 0 or *sampleCoverage > 1))
+				or (sampleConfidence and (*sampleConfidence <= 0 or *sampleConfidence >= 1))
+				or sampleDefects <= 0 or sampleDefects > 1)
+			{
+				throw cxxopts::OptionException("Invalid sample verify percentage");
+			}
+		}
+
+		int address = tryParse<int>(result, "address", read or write or verify or verifySample);
 
-		std::string inFile = tryParse<std::string>(result, "infile", write or verify);
+		std::string inFile = tryParse<std::string>(result, "infile", write or verify or verifySample);
 		std::string outFile = tryParse<std::string>(result, "outfile", read);
 		int readLen = tryParse<int>(result, "readlen", read and (not(write or verify)));
 
-		if(not (readId or readStatRegs or result.count("customcmd") or write or read or verify))
+		bool resume = result.count("resume");
+		std::string journalFile = tryParse<std::string>(result, "journal", resume);
+
+		bool useCache = result.count("cache");
+		int spotChecks = tryParse<int>(result, "spotchecks");
+		int retries = tryParse<int>(result, "retries");
+		if(retries < 0)
+		{
+			throw cxxopts::OptionException("Invalid number of retries");
+		}
+
+		bool update = result.count("update");
+		std::string previousFile = tryParse<std::string>(result, "previous", false);
+		if(update and (useCache or !journalFile.empty()))
+		{
+			throw cxxopts::OptionException("--update cannot be used with --cache or --journal");
+		}
+
+		bool fastAttach = result.count("fastattach");
+		bool daemon = result.count("daemon");
+		bool autotune = result.count("autotune");
+		bool dryRun = result.count("dry-run");
+		bool sparse = result.count("sparse");
+		ImageTransform transform(tryParse<std::string>(result, "transform", false));
+		if(dryRun and (useCache or !journalFile.empty() or daemon or autotune or result.count("record")))
+		{
+			throw cxxopts::OptionException("--dry-run cannot be used with --cache, --journal, --daemon, --autotune or --record");
+		}
+
+		if(not (readId or readStatRegs or result.count("customcmd") or write or read or verify or verifySample or daemon or autotune))
 		{
 			throw cxxopts::OptionException("No action selected");
 		}
 
+		// Declared before the device and session, so that it outlives anything which adds spans
+		std::unique_ptr<Timeline> timeline;
+		if(result.count("trace"))
+		{
+			timeline = std::make_unique<Timeline>(tryParse<std::string>(result, "trace"));
+		}
+
 		// Convert target to all lower case for more tolerant parsing
 		mode = ParseUtility::toLower(mode);
 
-		// Pointers are constructed here so they have correct scope
-		std::unique_ptr<SpiInterface> spi = NULL;
-		std::unique_ptr<WbUart<uint8_t,8>> uart = NULL;
-		std::unique_ptr<SpiFlash> prog = NULL;
+		// Images are loaded before the device is opened, so that a dry run's emulated flash can be sized to hold them
+		// --previous is what the flash holds, so it is never transformed
+		auto loadImage = [sparse](const std::string &filename, const ImageTransform &transform)
+		{
+			auto format = ImageSource::detect(filename);
+			if(!sparse)
+			{
+				auto data = std::make_shared<const std::vector<uint8_t>>(transform.load(filename));
+				if(format != ImageFormat::raw)
+				{
+					std::cout << "Decompressed " << filename << " to " << data->size() << " bytes" << std::endl;
+				}
+				return data;
+			} else if(format != ImageFormat::raw) {
+				throw cxxopts::OptionException("--sparse cannot be used with compressed images");
+			}
+			size_t allocated;
+			auto data = FileUtility::readSparse(filename, &allocated);
+			std::cout << "Read " << allocated << " of " << data.size() << " bytes from " << filename << ". The rest is holes" << std::endl;
+			transform.apply(data);
+			return std::make_shared<const std::vector<uint8_t>>(std::move(data));
+		};
+		ImagePtr image;
+		if((write or verify or verifySample) and !daemon)
+		{
+			image = loadImage(inFile, transform);
+			if(!transform.empty())
+			{
+				std::cout << "Transformed " << inFile << " to " << image->size() << " bytes" << std::endl;
+			}
+		}
+		ImagePtr previousImage;
+		if(update and !previousFile.empty() and !daemon)
+		{
+			previousImage = loadImage(previousFile, ImageTransform());
+		}
+
+		// The emulated flash behind a dry run must hold everything the actions touch
+		size_t dryRunFlashSize = 16*1024*1024;
+		if(dryRun)
+		{
+			size_t len = std::max({image ? image->size() : 0, previousImage ? previousImage->size() : 0, read ? static_cast<size_t>(readLen) : 0});
+			size_t blocks = (address + len + 65535)/65536;
+			dryRunFlashSize = std::max(dryRunFlashSize, blocks*65536);
+		}
+
+		std::unique_ptr<SpiDevice> device;
+		std::vector<int> csPins;
 		// Perform target specific arument parsing
 		if(mode == "ftdi")
 		{
@@ -195,7 +389,7 @@ int main(int argc, char* argv[])
 			}
 			double progFreq;
 			auto maybeProgFreq = ParseUtility::parseFreq(tryParse<std::string>(result, "progfreq"));
-			if(maybeXtalFreq)
+			if(maybeProgFreq)
 			{
 				progFreq = *maybeProgFreq;
 			} else {
@@ -212,62 +406,156 @@ int main(int argc, char* argv[])
 			{
 				throw cxxopts::OptionException("Invalid programming frequency.");
 			}
-			uint16_t freqDivider; //Frequency divider for SPI interface
-			// From FTDI MPSSE Basics p.9:
-			// data speed = [xtal speed] / ((1+Divisor)*2)
-			// divisor = ([xtal speed]/(2*[data speed]))-1
-			if(progFreq >= xtalFreq/2.0)
-			{
-				freqDivider = 0x0000;
-			} else {
-				double divider = (xtalFreq / (2.0*progFreq)) -1.0;
-
-				if(divider > (double)0xFFFF)
-				{
-					freqDivider = (double)0xFFFF;
-				} else {
-					freqDivider = (uint16_t)divider;
-				}
-		}
 
-			double actualFreq = xtalFreq / ((1+ ((double)freqDivider))*2.0);
+			double actualFreq;
+			uint16_t freqDivider = SpiWrapper::calculateClockDivider(xtalFreq, progFreq, actualFreq);
 			if(actualFreq != progFreq)
 			{
 				std::cerr << "WARNING: Could not calculate divider for requested frequency. Using " << actualFreq/1e6 << "MHz" << std::endl;
 			}
 
-			spi = std::make_unique<SpiWrapper>(ftdiDev, iface, freqDivider);
-			prog = std::make_unique<SpiFlash>(spi.get());
+			int usbQueue = tryParse<int>(result, "usbqueue");
+			if(usbQueue < 1)
+			{
+				throw cxxopts::OptionException("Invalid USB queue depth");
+			}
+
+			csPins = tryParse<std::vector<int>>(result, "cs");
+			if(csPins.empty() or std::any_of(csPins.begin(), csPins.end(), [](int pin) { return !SpiWrapper::validChipSelect(pin); }))
+			{
+				throw cxxopts::OptionException("Invalid chip select pin. Use 4-7 for ADBUS4-7 or 8-15 for ACBUS0-7");
+			}
+			if(csPins.size() > 1 and (readId or readStatRegs or customCmd or read or verifySample or useCache or !journalFile.empty()
+				or update or daemon or autotune or dryRun or result.count("record")))
+			{
+				throw cxxopts::OptionException("With more than one --cs, only -w and -v are supported");
+			}
+
+			if(dryRun)
+			{
+				device = SpiDevice::openDryRun(std::make_unique<FtdiCostModel>(actualFreq, usbQueue), dryRunFlashSize);
+			} else {
+				device = SpiDevice::openFtdi(ftdiDev, iface, freqDivider, fastAttach);
+				device->getFtdi()->setQueueDepth(usbQueue);
+				device->getFtdi()->setChipSelects(csPins);
+			}
 
 		} else if(mode == "wbuart") {
 
-			std::string uartDev = tryParse<std::string>(result, "uartdev");
+			std::string uartDev = tryParse<std::string>(result, "uartdev", !dryRun);
 			int baud = tryParse<int>(result, "baud");
-			int compAddr = tryParse<int>(result, "compaddr");
+			int compAddr = tryParse<int>(result, "compaddr", !dryRun);
+			int uartTimeout = tryParse<int>(result, "uarttimeout");
+			if(uartTimeout < 0)
+			{
+				throw cxxopts::OptionException("--uarttimeout cannot be negative");
+			}
+
+			if(dryRun)
+			{
+				device = SpiDevice::openDryRun(std::make_unique<WbUartCostModel>(baud), dryRunFlashSize);
+			} else {
+				device = SpiDevice::openWbUart(uartDev, baud, compAddr, fastAttach);
+				device->getWbUart()->set_timeout(std::chrono::milliseconds(uartTimeout));
+			}
 
-			uart = std::make_unique<WbUart<uint8_t,8>>(uartDev, baud);
-			spi = std::make_unique<WbSpiWrapper>(uart.get(),compAddr);
-			prog = std::make_unique<SpiFlash>(spi.get());
+		} else if(mode == "replay") {
+
+			if(dryRun)
+			{
+				throw cxxopts::OptionException("--dry-run is only supported in FTDI and wbuart modes");
+			}
+			device = SpiDevice::openReplay(tryParse<std::string>(result, "tracefile"));
 
 		} else {
 			throw cxxopts::OptionException("Invalid mode: "+mode);
 		}
 
+		if(result.count("boardid"))
+		{
+			device->setIdentity(tryParse<std::string>(result, "boardid"));
+		}
+
+		// All SPI traffic goes via device->spi(), so that it can optionally be recorded
+		if(result.count("record"))
+		{
+			device->record(tryParse<std::string>(result, "record"));
+		}
+		SpiInterface *bus = device->spi();
+		DryRunSpi *dryRunSpi = device->getDryRun();
+		auto setPhase = [dryRunSpi](std::string phase)
+		{
+			if(dryRunSpi)
+			{
+				dryRunSpi->setPhase(phase);
+			}
+		};
+
+		if(SpiWrapper *ftdi = device->getFtdi())
+		{
+			if(autotune)
+			{
+				// The flash may be asleep, which would look like a dead bus
+				SpiFlash(bus).releasePowerDown();
+				FtdiTuner tuner(ftdi, bus);
+				auto profile = tuner.tune();
+				profile.apply(*ftdi);
+				profile.save(device->identity());
+				std::cout << "Saved profile for " << device->identity() << ". Read throughput " << static_cast<int>(profile.bytesPerSecond/1024) << "KB/s" << std::endl;
+			} else if(!result.count("progfreq") and !result.count("usbqueue")) {
+				// Explicit settings take priority over a saved profile
+				if(auto profile = FtdiProfile::load(device->identity()))
+				{
+					profile->apply(*ftdi);
+					std::cout << "Using tuned profile for " << device->identity() << std::endl;
+				}
+			}
+		} else if(autotune) {
+			throw cxxopts::OptionException("--autotune is only supported in FTDI mode");
+		}
+
+		FlashSession session(bus);
+
+		if(daemon)
+		{
+			Daemon d(tryParse<std::string>(result, "daemon"), &session);
+			d.run();
+			return 0;
+		}
+
 		// Arguments are now parsed, we can do the real work
+		static const std::vector<uint8_t> noImage;
+		const std::vector<uint8_t> &dataIn = image ? *image : noImage;
+
+		if(FlashEmulator *flash = device->getDryRunFlash())
+		{
+			// Start from what the flash would already hold: the old contents for --update, or the image when only verifying
+			const std::vector<uint8_t> *contents = previousImage ? previousImage.get() : (write ? nullptr : image.get());
+			if(contents and address + contents->size() > flash->memory().size())
+			{
+				throw cxxopts::OptionException("Image does not fit in the emulated flash");
+			} else if(contents) {
+				std::copy(contents->begin(), contents->end(), flash->memory().begin() + address);
+			}
+		}
 
-		std::vector<uint8_t> dataIn;
-		if(write or verify)
+		if(csPins.size() > 1)
 		{
-			dataIn = FileUtility::readToVector(inFile);
+			int ret = programChips(session, device->getFtdi(), address, image, write, verify);
+			if(ret == 0)
+			{
+				std::cout << "Done!" << std::endl;
+			}
+			return ret;
 		}
 
 		// Release powerdown in case chip is asleep
-		 prog->releasePowerDown();
+		session.submit([](SpiFlash &f) { f.releasePowerDown(); }).get();
 
 		if(readId)
 		{
 			std::cout << "Read ID" << std::endl;
-			std::vector<uint8_t> data = prog->readId();
+			std::vector<uint8_t> data = session.readId().get();
 			std::cout << "Received ID: ";
 			VectorUtility::print(data);
 			std::cout << std::endl;
@@ -312,8 +600,9 @@ int main(int argc, char* argv[])
 			std::cout << "Read Status registers" << std::endl;
 			for(int i=1; i<=3; i++)
 			{
-				std::cout << "Status register " << i << std::endl; //": 0x" << std::hex << std::setfill('0') << std::setw(2) << (int) prog->readStatusRegister(i) << std::dec << std::endl;
-				print_bits<8>(prog->readStatusRegister(i),stat_reg_explanations[i-1]);
+				uint8_t reg = session.submit([i](SpiFlash &f) { return f.readStatusRegister(i); }).get();
+				std::cout << "Status register " << i << std::endl; //": 0x" << std::hex << std::setfill('0') << std::setw(2) << (int) reg << std::dec << std::endl;
+				print_bits<8>(reg,stat_reg_explanations[i-1]);
 
 			}
 		}
@@ -324,9 +613,13 @@ int main(int argc, char* argv[])
 			VectorUtility::print(*customCmd);
 			std::cout << std::endl;
 
-			spi->setCs(false);
-			auto result = spi->transfer(*customCmd);
-			spi->setCs(true);
+			auto result = session.submit([bus, &customCmd](SpiFlash &)
+			{
+				bus->setCs(false);
+				auto ret = bus->transfer(*customCmd);
+				bus->setCs(true);
+				return ret;
+			}).get();
 
 			std::cout << "Result: ";
 			VectorUtility::print(result);
@@ -334,15 +627,96 @@ int main(int argc, char* argv[])
 		}
 
 
+		std::unique_ptr<FlashCache> cache;
+		std::vector<uint64_t> sectorHashes;
+		// Parts of the image actually programmed, for --verify-sample
+		std::vector<SampleVerifier::Extent> sampleExtents = {{0, dataIn.size()}};
 		if(write)
 		{
+			setPhase("write");
 			std::cout << "Write to " << address << std::endl;
-			prog->program(address, dataIn);
+
+			std::vector<bool> skipSectors;
+			if(useCache)
+			{
+				std::vector<uint8_t> id = session.readId().get();
+				std::ostringstream key;
+				key << std::hex << std::setfill('0');
+				for(int i=0; i<3; i++)
+				{
+					key << std::setw(2) << static_cast<int>(id[i]);
+				}
+				key << "-" << device->identity();
+
+				int sectorSize = session.submit([](SpiFlash &f) { return f.getSectorSize(); }).get();
+				cache = std::make_unique<FlashCache>(key.str(), sectorSize);
+				sectorHashes = FlashCache::hashSectors(dataIn, sectorSize);
+				skipSectors = cache->unchangedSectors(address, sectorHashes);
+				if(address % sectorSize)
+				{
+					// Skips are whole sectors, which an unaligned write doesn't have
+					skipSectors.assign(skipSectors.size(), false);
+				}
+				bool cacheValid = session.submit([&](SpiFlash &f) { return cache->spotCheck(f, address, dataIn, skipSectors, spotChecks); }).get();
+				if(!cacheValid)
+				{
+					std::cout << "WARNING: Flash contents do not match cache. Writing all sectors" << std::endl;
+					cache->clear();
+					skipSectors.clear();
+				}
+
+				// Forget what we are about to write, in case we fail part way through
+				cache->forget(address, sectorHashes.size());
+				cache->save();
+
+				// Sectors skipped were already spot checked, so only sample what is written
+				if(std::find(skipSectors.begin(), skipSectors.end(), false) != skipSectors.end())
+				{
+					sampleExtents.clear();
+					for(size_t i = 0; i < skipSectors.size(); i++)
+					{
+						size_t offset = i*sectorSize;
+						size_t len = std::min(dataIn.size() - offset, static_cast<size_t>(sectorSize));
+						if(skipSectors[i])
+						{
+							continue;
+						} else if(!sampleExtents.empty() and sampleExtents.back().offset + sampleExtents.back().len == offset) {
+							sampleExtents.back().len += len;
+						} else {
+							sampleExtents.push_back({offset, len});
+						}
+					}
+				}
+			}
+
+			ProgramOptions programOptions;
+			programOptions.skipSectors = skipSectors;
+			// Each sector is verified as soon as it is written, so there is no separate verify pass
+			programOptions.verify = verify;
+			programOptions.verifyRetries = retries;
+			std::unique_ptr<ProgramJournal> journal;
+			if(!journalFile.empty())
+			{
+				journal = std::make_unique<ProgramJournal>(journalFile, address, dataIn, resume);
+				programOptions.journal = journal.get();
+			}
+			if(update)
+			{
+				session.update(address, image, previousImage, programOptions).get();
+			} else {
+				session.program(address, image, programOptions).get();
+			}
 		}
 
 		std::vector<uint8_t> dataOut;
+		if(write and verify)
+		{
+			std::cout << "Data verified correctly (CRC32C 0x" << std::hex << BufferUtility::crc32c(dataIn.data(), dataIn.size()) << std::dec << ")" << std::endl;
+			verify = false;
+		}
 		if(read or verify)
 		{
+			setPhase(verify ? "verify" : "read");
 			std::cout << "Read from " << address << std::endl;
 
 			if(write or verify)
@@ -353,10 +727,15 @@ int main(int argc, char* argv[])
 				std::cout << "Size from arguments (" << readLen << ")" << std::endl;
 			}
 
-			dataOut = prog->read(address,readLen);
+			dataOut = session.read(address,readLen).get();
 
-			if(read)
+			if(read and dryRun)
 			{
+				std::cout << "Dry run, so not writing " << outFile << std::endl;
+			} else if(read and sparse) {
+				size_t written = FileUtility::writeSparse(outFile, dataOut);
+				std::cout << "Wrote " << written << " of " << dataOut.size() << " bytes to " << outFile << ". The rest is holes" << std::endl;
+			} else if(read) {
 				FileUtility::writeFromVector(outFile, dataOut);
 			}
 		}
@@ -365,15 +744,93 @@ int main(int argc, char* argv[])
 		{
 			std::cout << "Verifying data" << std::endl;
 
-			if(dataOut == dataIn)
+			auto extent = BufferUtility::mismatchExtent(dataOut.data(), dataIn.data(), std::min(dataOut.size(), dataIn.size()));
+			if(!extent and dataOut.size() == dataIn.size())
 			{
-				std::cout << "Data verified correctly" << std::endl;
+				std::cout << "Data verified correctly (CRC32C 0x" << std::hex << BufferUtility::crc32c(dataIn.data(), dataIn.size()) << std::dec << ")" << std::endl;
 			} else {
 				std::cout << "WARNING: Verifcation error" << std::endl;
+				if(extent)
+				{
+					std::cout << std::hex << "Mismatches between 0x" << address+extent->first << " and 0x" << address+extent->second << std::dec << std::endl;
+				}
+				return -1;
+			}
+		}
+
+		if(verifySample)
+		{
+			setPhase("verify");
+			auto sample = session.submit([&](SpiFlash &f)
+			{
+				const int pageSize = f.getPageSize();
+				size_t totalPages = SampleVerifier::countPages(sampleExtents, pageSize);
+				size_t numPages = sampleConfidence ? SampleVerifier::pagesForConfidence(totalPages, *sampleConfidence, sampleDefects)
+					: static_cast<size_t>(std::ceil(*sampleCoverage * totalPages));
+				auto pages = SampleVerifier::choosePages(sampleExtents, pageSize, numPages, std::random_device()());
+				return SampleVerifier::verify(f, address, dataIn, pages, totalPages);
+			}).get();
+
+			std::cout << "Sample verified " << sample.pagesChecked << " of " << sample.totalPages << " pages ("
+				<< std::fixed << std::setprecision(1) << 100*sample.coverage() << "% coverage, "
+				<< 100*SampleVerifier::confidence(sample.totalPages, sample.pagesChecked, sampleDefects) << "% confidence of finding damage to "
+				<< 100*sampleDefects << "% of pages)" << std::defaultfloat << std::endl;
+			if(!sample.ok())
+			{
+				std::cout << "WARNING: Verifcation error" << std::endl;
+				std::cout << sample.mismatches.size() << " sampled pages differ, the first at 0x" << std::hex << address+sample.mismatches.front() << std::dec << std::endl;
 				return -1;
 			}
 		}
 
+		// Only record what was written once it is known to be good (if verifying)
+		if(cache)
+		{
+			cache->update(address, sectorHashes);
+			cache->save();
+		}
+
+		if(SpiRecorder *recorder = device->getRecorder())
+		{
+			std::cout << "Recorded trace. ";
+			recorder->stats().print(std::cout);
+			std::cout << std::endl;
+		}
+
+		if(SpiReplay *replay = device->getReplay())
+		{
+			std::cout << "Trace as recorded. ";
+			replay->recordedStats().print(std::cout);
+			std::cout << std::endl << "Trace as replayed. ";
+			replay->replayedStats().print(std::cout);
+			std::cout << std::endl;
+			if(!replay->finished())
+			{
+				std::cout << "WARNING: " << replay->remaining() << " trace records were not replayed" << std::endl;
+			}
+		}
+
+		if(dryRunSpi)
+		{
+			dryRunSpi->print(std::cout);
+		}
+
+		if(auto uart = device->getWbUart())
+		{
+			std::cout << "Serial link. ";
+			uart->stats().print(std::cout);
+			std::cout << std::endl;
+		}
+
+#ifdef SPI_PROG_FAKE_FTDI
+		if(device->getFtdi())
+		{
+			std::cout << "Emulated FTDI. ";
+			FakeFtdi::device().stats().print(std::cout);
+			std::cout << std::endl;
+		}
+#endif
+
 		std::cout << "Done!" << std::endl;
 
 
@@ -385,6 +842,50 @@ int main(int argc, char* argv[])
 		std::cerr << "ERROR: Could not parse options: " << e.what() << std::endl;
 		std::cerr << "Run with -h for help" << std::endl;
 		exit(1);
+	} catch (const SpiTraceException& e)
+	{
+		std::cerr << "ERROR: " << e.what() << std::endl;
+		exit(1);
+	} catch (const ProgramJournalException& e)
+	{
+		std::cerr << "ERROR: " << e.what() << std::endl;
+		exit(1);
+	} catch (const FlashCacheException& e)
+	{
+		std::cerr << "ERROR: " << e.what() << std::endl;
+		exit(1);
+	} catch (const FtdiTunerException& e)
+	{
+		std::cerr << "ERROR: " << e.what() << std::endl;
+		exit(1);
+	} catch (const FileUtilityException& e)
+	{
+		std::cerr << "ERROR: " << e.what() << std::endl;
+		exit(1);
+	} catch (const ImageSourceException& e)
+	{
+		std::cerr << "ERROR: " << e.what() << std::endl;
+		exit(1);
+	} catch (const ImageTransformException& e)
+	{
+		std::cerr << "ERROR: " << e.what() << std::endl;
+		exit(1);
+	} catch (const SpiFlashException& e)
+	{
+		std::cerr << "ERROR: " << e.what() << std::endl;
+		exit(1);
+	} catch (const SpiWrapperException& e)
+	{
+		std::cerr << "ERROR: " << e.what() << std::endl;
+		exit(2);
+	} catch (const DaemonException& e)
+	{
+		std::cerr << "ERROR: " << e.what() << std::endl;
+		exit(1);
+	} catch (const WbUartException& e)
+	{
+		std::cerr << "ERROR: " << e.what() << std::endl;
+		exit(1);
 	}
 
 	return 0;
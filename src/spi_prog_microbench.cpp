@@ -0,0 +1,306 @@
+// Microbenchmarks for host side hot paths
+// Each benchmark is run over image sizes from --minsize to --maxsize, and reports time per byte and heap allocations per run
+// No hardware is needed. SPI traffic goes to an interface which discards it
+//
+//   spi_prog_microbench --filter wbuart --maxsize 16M
+
+// Requires : cxxopts
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <functional>
+#include <chrono>
+#include <random>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <cstdio>
+
+#include <unistd.h>
+
+#include <cxxopts.hpp>
+
+#include "BufferUtility.h"
+#include "FileUtility.h"
+#include "ImageSource.hpp"
+#include "ImageTransform.hpp"
+#include "ParseUtility.h"
+#include "VectorUtility.h"
+#include "SpiFlash.hpp"
+#include "SpiFlashT.hpp"
+#include "WbUart.hpp"
+
+// Count every heap allocation made by the process
+static std::atomic<uint64_t> allocCount{0};
+static std::atomic<uint64_t> allocBytes{0};
+
+// Every form of new and delete goes through these two, so the replacements stay a matched set
+static void *countedAlloc(size_t size)
+{
+	allocCount.fetch_add(1, std::memory_order_relaxed);
+	allocBytes.fetch_add(size, std::memory_order_relaxed);
+	if(void *p = std::malloc(size ? size : 1))
+	{
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+static void countedFree(void *p) noexcept
+{
+	std::free(p);
+}
+
+void *operator new(size_t size)
+{
+	return countedAlloc(size);
+}
+
+void *operator new[](size_t size)
+{
+	return countedAlloc(size);
+}
+
+void operator delete(void *p) noexcept
+{
+	countedFree(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+	countedFree(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	countedFree(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+	countedFree(p);
+}
+
+// Stop the compiler discarding work whose result is unused
+template<class T> static void doNotOptimise(T const &val)
+{
+	asm volatile("" : : "r,m"(val) : "memory");
+}
+
+// Accepts and discards all traffic. Only sends are benchmarked, so nothing waits on the flash status
+class NullSpi final : public SpiInterface
+{
+	public:
+		std::vector<uint8_t> transfer(std::vector<uint8_t> data) override { return data; };
+		void setCs(bool) override {};
+		void send(std::vector<uint8_t> data) override { doNotOptimise(data.data()); };
+		std::vector<uint8_t> receive(int num) override { return std::vector<uint8_t>(num, 0xFF); };
+};
+
+struct Benchmark
+{
+	std::string name;
+	// Called with the image, and a scratch buffer of the same size which it may overwrite
+	std::function<void(const std::vector<uint8_t> &image, std::vector<uint8_t> &scratch)> run;
+};
+
+typedef WbUartFraming<uint8_t, 8> framing8_t;
+typedef WbUartFraming<uint32_t, 32> framing32_t;
+
+static std::vector<Benchmark> benchmarks(const std::string &tmpFile)
+{
+	return {
+		{"chunk", [](const std::vector<uint8_t> &, std::vector<uint8_t> &scratch)
+		{
+			// The chunking loop used by WbUart and WbSpiWrapper, with 255 word chunks
+			size_t chunks = 0;
+			auto cur = scratch.begin();
+			while(cur != scratch.end())
+			{
+				cur = VectorUtility::chunk<uint8_t>(cur, scratch.end(), framing8_t::MAX_WORDS);
+				chunks++;
+			}
+			doNotOptimise(chunks);
+		}},
+		{"wbuart_metadata", [](const std::vector<uint8_t> &image, std::vector<uint8_t> &)
+		{
+			// One header per 255 byte transaction
+			uint8_t acc = 0;
+			for(size_t offset = 0; offset < image.size(); offset += framing8_t::MAX_WORDS)
+			{
+				auto meta = framing8_t::format_transaction_metadata(true, framing8_t::MAX_WORDS, offset, AddressMode::FIXED);
+				doNotOptimise(meta);
+				acc ^= meta[1];
+			}
+			doNotOptimise(acc);
+		}},
+		{"wbuart_to_uint8_8", [](const std::vector<uint8_t> &image, std::vector<uint8_t> &scratch)
+		{
+			framing8_t::data_to_uint8(image.data(), image.size(), scratch.data());
+			doNotOptimise(scratch.data());
+		}},
+		{"wbuart_from_uint8_8", [](const std::vector<uint8_t> &image, std::vector<uint8_t> &scratch)
+		{
+			framing8_t::uint8_to_data(image.data(), image.size(), scratch.data());
+			doNotOptimise(scratch.data());
+		}},
+		{"wbuart_to_uint8_32", [](const std::vector<uint8_t> &image, std::vector<uint8_t> &scratch)
+		{
+			framing32_t::data_to_uint8(reinterpret_cast<const uint32_t *>(image.data()), image.size()/4, scratch.data());
+			doNotOptimise(scratch.data());
+		}},
+		{"wbuart_from_uint8_32", [](const std::vector<uint8_t> &image, std::vector<uint8_t> &scratch)
+		{
+			framing32_t::uint8_to_data(image.data(), image.size()/4, reinterpret_cast<uint32_t *>(scratch.data()));
+			doNotOptimise(scratch.data());
+		}},
+		{"spiflash_write", [](const std::vector<uint8_t> &image, std::vector<uint8_t> &)
+		{
+			// Building each page program command
+			NullSpi spi;
+			SpiFlash flash(&spi);
+			const int pageSize = flash.getPageSize();
+			for(size_t offset = 0; offset < image.size(); offset += pageSize)
+			{
+				auto start = image.begin() + offset;
+				auto end = (image.size() - offset > static_cast<size_t>(pageSize)) ? start + pageSize : image.end();
+				flash.write(offset, start, end);
+			}
+		}},
+		{"spiflash_write_direct", [](const std::vector<uint8_t> &image, std::vector<uint8_t> &)
+		{
+			// As spiflash_write, but bound to the backend at compile time
+			NullSpi spi;
+			SpiFlashT<NullSpi> flash(&spi);
+			const int pageSize = flash.getPageSize();
+			for(size_t offset = 0; offset < image.size(); offset += pageSize)
+			{
+				auto start = image.begin() + offset;
+				auto end = (image.size() - offset > static_cast<size_t>(pageSize)) ? start + pageSize : image.end();
+				flash.write(offset, start, end);
+			}
+		}},
+		{"read_file", [tmpFile](const std::vector<uint8_t> &, std::vector<uint8_t> &)
+		{
+			// File is written by the caller before timing starts
+			auto data = FileUtility::readToVector(tmpFile);
+			doNotOptimise(data.data());
+		}},
+		{"read_file_transform", [tmpFile](const std::vector<uint8_t> &, std::vector<uint8_t> &)
+		{
+			// One pass over the file, with every step run on each chunk while it is in cache
+			static const ImageTransform transform("bitrev,bswap32,pad:0xFF:64K");
+			FileSource source(tmpFile);
+			auto data = transform.load(source);
+			doNotOptimise(data.data());
+		}},
+		{"verify_extent", [](const std::vector<uint8_t> &image, std::vector<uint8_t> &scratch)
+		{
+			// Worst case: the buffers match, so every byte is compared
+			auto extent = BufferUtility::mismatchExtent(image.data(), scratch.data(), image.size());
+			doNotOptimise(extent);
+		}},
+		{"verify_first", [](const std::vector<uint8_t> &image, std::vector<uint8_t> &scratch)
+		{
+			auto first = BufferUtility::findFirstMismatch(image.data(), scratch.data(), image.size());
+			doNotOptimise(first);
+		}},
+		{"crc32c", [](const std::vector<uint8_t> &image, std::vector<uint8_t> &)
+		{
+			doNotOptimise(BufferUtility::crc32c(image.data(), image.size()));
+		}},
+	};
+}
+
+int main(int argc, char* argv[])
+{
+	try {
+		cxxopts::Options options(argv[0], "Microbenchmarks for spi_prog host side hot paths");
+		options.add_options()
+			("h,help",    "Print help")
+			("filter",    "Only run benchmarks whose name contains this string", cxxopts::value<std::string>()->default_value(""))
+			("minsize",   "Smallest image size, e.g. 4K", cxxopts::value<std::string>()->default_value("4K"))
+			("maxsize",   "Largest image size, e.g. 256M. Sizes go up in powers of 4", cxxopts::value<std::string>()->default_value("256M"))
+			("mintime",   "Minimum time to spend on each size of each benchmark, in seconds", cxxopts::value<double>()->default_value("0.2"))
+			;
+
+		auto result = options.parse(argc, argv);
+
+		if (result.count("help"))
+		{
+			std::cout << options.help() << std::endl;
+			exit(0);
+		}
+
+		auto minSize = ParseUtility::parseSize(result["minsize"].as<std::string>());
+		auto maxSize = ParseUtility::parseSize(result["maxsize"].as<std::string>());
+		if(!minSize or !maxSize or *minSize < 4 or *minSize > *maxSize)
+		{
+			throw cxxopts::OptionException("Invalid size range");
+		}
+		std::string filter = result["filter"].as<std::string>();
+		double minTime = result["mintime"].as<double>();
+
+		std::string tmpFile = "/tmp/spi_prog_microbench." + std::to_string(getpid());
+
+		std::cout << "Buffer kernels: " << BufferUtility::implementation() << std::endl;
+		std::cout << std::left << std::setw(22) << "benchmark" << std::right
+			<< std::setw(12) << "size" << std::setw(12) << "ns/byte" << std::setw(12) << "MB/s"
+			<< std::setw(12) << "allocs" << std::setw(14) << "alloc bytes" << std::endl;
+
+		std::mt19937 rng(1);
+		for(auto &bench : benchmarks(tmpFile))
+		{
+			if(bench.name.find(filter) == std::string::npos)
+			{
+				continue;
+			}
+
+			for(size_t size = *minSize; size <= *maxSize; size *= 4)
+			{
+				std::vector<uint8_t> image(size);
+				for(auto &byte : image)
+				{
+					byte = rng();
+				}
+				std::vector<uint8_t> scratch(image);
+				if(bench.name.rfind("read_file", 0) == 0)
+				{
+					FileUtility::writeFromVector(tmpFile, image);
+				}
+
+				// One untimed run to warm caches
+				bench.run(image, scratch);
+
+				uint64_t runs = 0;
+				uint64_t allocsBefore = allocCount;
+				uint64_t bytesBefore = allocBytes;
+				auto start = std::chrono::steady_clock::now();
+				std::chrono::duration<double> elapsed{};
+				do
+				{
+					bench.run(image, scratch);
+					runs++;
+					elapsed = std::chrono::steady_clock::now() - start;
+				} while(elapsed.count() < minTime);
+
+				double nsPerByte = elapsed.count() * 1e9 / (static_cast<double>(runs) * size);
+				std::cout << std::left << std::setw(22) << bench.name << std::right
+					<< std::setw(12) << size
+					<< std::setw(12) << std::fixed << std::setprecision(3) << nsPerByte
+					<< std::setw(12) << std::setprecision(0) << 1e3/nsPerByte
+					<< std::setw(12) << (allocCount - allocsBefore)/runs
+					<< std::setw(14) << (allocBytes - bytesBefore)/runs << std::endl;
+			}
+		}
+		std::remove(tmpFile.c_str());
+
+	} catch (const cxxopts::OptionException& e) {
+		std::cerr << "ERROR: Could not parse options: " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
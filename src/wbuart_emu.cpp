@@ -0,0 +1,233 @@
+// Emulator for the wishbone UART bridge, SPI master and an attached flash
+// Presents a pseudo-terminal which spi_prog can use in place of real hardware:
+//   wbuart_emu --link /tmp/wbuart &
+//   spi_prog -m wbuart --uartdev /tmp/wbuart --baud 115200 --compaddr 0 -d
+
+// Requires : cxxopts
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <csignal>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <cxxopts.hpp>
+
+#include "FileUtility.h"
+#include "FlashEmulator.hpp"
+#include "WbSpiEmulator.hpp"
+#include "WbUartEmulator.hpp"
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop(int)
+{
+	stopRequested = 1;
+}
+
+// Paces bytes in one direction to the rate of an 8n1 UART (10 bits per byte)
+class BaudThrottle
+{
+	public:
+		BaudThrottle(int baud) : baud(baud) {};
+
+		// Blocks until num bytes could have crossed the wire after everything before them
+		void pace(size_t num)
+		{
+			if(baud <= 0)
+			{
+				return;
+			}
+			auto now = std::chrono::steady_clock::now();
+			if(wireFree < now)
+			{
+				wireFree = now;
+			}
+			wireFree += std::chrono::nanoseconds(static_cast<int64_t>(num * 10 * 1e9 / baud));
+			std::this_thread::sleep_until(wireFree);
+		}
+
+	private:
+		int baud;
+		std::chrono::steady_clock::time_point wireFree;
+};
+
+static void writeAll(int fd, const uint8_t *data, size_t len)
+{
+	while(len)
+	{
+		ssize_t n = ::write(fd, data, len);
+		if(n < 0)
+		{
+			if(errno == EINTR or errno == EAGAIN)
+			{
+				continue;
+			}
+			throw std::runtime_error(std::string("Write to pty failed: ") + strerror(errno));
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	try {
+		cxxopts::Options options(argv[0], "Emulates a UART wishbone bridge with a wishbone SPI master and SPI flash attached, on a pseudo-terminal");
+		options.add_options()
+			("h,help",     "Print help")
+			("link",       "Create a symlink to the pseudo-terminal at this path", cxxopts::value<std::string>())
+			("baud",       "Limit throughput to that of a UART at this baud rate. 0 for no limit", cxxopts::value<int>()->default_value("0"))
+			("compaddr",   "Address of the wishbone SPI component", cxxopts::value<int>()->default_value("0"))
+			("size",       "Flash size in bytes", cxxopts::value<int>()->default_value("16777216"))
+			("jedecid",    "JEDEC ID bytes (comma separated values)", cxxopts::value<std::vector<uint8_t>>()->default_value("0xEF,0x40,0x18"))
+			("busypolls",  "Number of status reads which report busy after each program or erase", cxxopts::value<int>()->default_value("1"))
+			("i,infile",   "Initial flash contents. Otherwise the flash starts erased", cxxopts::value<std::string>())
+			("o,outfile",  "Save the flash contents to this file on exit", cxxopts::value<std::string>())
+			;
+
+		auto result = options.parse(argc, argv);
+
+		if (result.count("help"))
+		{
+			std::cout << options.help() << std::endl;
+			exit(0);
+		}
+
+		auto jedecId = result["jedecid"].as<std::vector<uint8_t>>();
+		if(jedecId.size() != 3)
+		{
+			throw cxxopts::OptionException("JEDEC ID must be three bytes");
+		}
+		FlashEmulator flash(result["size"].as<int>(), {jedecId[0], jedecId[1], jedecId[2]});
+		flash.setBusyPolls(result["busypolls"].as<int>());
+		if(result.count("infile"))
+		{
+			auto contents = FileUtility::readToVector(result["infile"].as<std::string>());
+			if(contents.size() > flash.memory().size())
+			{
+				throw cxxopts::OptionException("Initial contents are larger than the flash");
+			}
+			std::copy(contents.begin(), contents.end(), flash.memory().begin());
+		}
+
+		WbSpiEmulator spiMaster(&flash, result["compaddr"].as<int>());
+		WbUartEmulator<uint8_t,8> bridge(&spiMaster);
+
+		// Open the pseudo-terminal
+		int master = posix_openpt(O_RDWR | O_NOCTTY);
+		if(master < 0 or grantpt(master) != 0 or unlockpt(master) != 0)
+		{
+			throw std::runtime_error(std::string("Could not create pseudo-terminal: ") + strerror(errno));
+		}
+		std::string slavePath = ptsname(master);
+
+		// Hold the slave side open so the master does not see a hangup between clients
+		// It is also put in raw mode so nothing is echoed before a client configures it
+		int slave = open(slavePath.c_str(), O_RDWR | O_NOCTTY);
+		if(slave < 0)
+		{
+			throw std::runtime_error("Could not open " + slavePath + ": " + strerror(errno));
+		}
+		struct termios tio;
+		tcgetattr(slave, &tio);
+		cfmakeraw(&tio);
+		tcsetattr(slave, TCSANOW, &tio);
+
+		std::string link;
+		if(result.count("link"))
+		{
+			link = result["link"].as<std::string>();
+			unlink(link.c_str());
+			if(symlink(slavePath.c_str(), link.c_str()) != 0)
+			{
+				throw std::runtime_error("Could not create link " + link + ": " + strerror(errno));
+			}
+		}
+		std::cout << "Emulating on " << (link.empty() ? slavePath : link + " -> " + slavePath) << std::endl;
+
+		signal(SIGINT, requestStop);
+		signal(SIGTERM, requestStop);
+
+		BaudThrottle rxThrottle(result["baud"].as<int>());
+		BaudThrottle txThrottle(result["baud"].as<int>());
+		std::vector<uint8_t> rxBuf(4096);
+		std::vector<uint8_t> response;
+		uint64_t bytesIn = 0, bytesOut = 0;
+
+		while(!stopRequested)
+		{
+			struct pollfd pfd = {master, POLLIN, 0};
+			int ready = poll(&pfd, 1, 100);
+			if(ready < 0)
+			{
+				if(errno == EINTR)
+				{
+					continue;
+				}
+				throw std::runtime_error(std::string("poll failed: ") + strerror(errno));
+			}
+			if(ready == 0)
+			{
+				// Like the real bridge, give up on a transaction if the host goes quiet part way through
+				bridge.reset();
+				continue;
+			}
+
+			ssize_t n = ::read(master, rxBuf.data(), rxBuf.size());
+			if(n <= 0)
+			{
+				continue;
+			}
+			bytesIn += n;
+			rxThrottle.pace(n);
+
+			response.clear();
+			bridge.receive(rxBuf.data(), n, response);
+			if(!response.empty())
+			{
+				txThrottle.pace(response.size());
+				writeAll(master, response.data(), response.size());
+				bytesOut += response.size();
+			}
+		}
+
+		if(!link.empty())
+		{
+			unlink(link.c_str());
+		}
+		close(slave);
+		close(master);
+
+		if(result.count("outfile"))
+		{
+			FileUtility::writeFromVector(result["outfile"].as<std::string>(), flash.memory());
+		}
+
+		const auto &b = bridge.stats();
+		const auto &s = spiMaster.stats();
+		const auto &f = flash.stats();
+		std::cout << "UART: " << bytesIn << " bytes in, " << bytesOut << " bytes out, "
+			<< b.writes << " writes, " << b.reads << " reads" << std::endl;
+		std::cout << "SPI: " << s.spi_bytes << " bytes, " << s.fifo_overflows << " FIFO overflows, "
+			<< s.fifo_underflows << " FIFO underflows, " << s.unmapped_accesses << " unmapped accesses" << std::endl;
+		std::cout << "Flash: " << f.commands << " commands, " << f.erases << " erases, " << f.pagePrograms << " page programs" << std::endl;
+
+	} catch (const cxxopts::OptionException& e) {
+		std::cerr << "Error parsing options: " << e.what() << std::endl;
+		return -1;
+	} catch (const std::exception &e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return -1;
+	}
+
+	return 0;
+}